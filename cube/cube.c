@@ -54,6 +54,10 @@
 #include <vulkan/vulkan.h>
 #endif
 
+#if defined(VK_USE_PLATFORM_HEADLESS_EXT) && !defined(VK_EXT_headless_surface)
+#error "Headless cube needs Vulkan headers that define VK_EXT_headless_surface"
+#endif
+
 #include <vulkan/vk_sdk_platform.h>
 #include "linmath.h"
 #include "object_type_string_helper.h"
@@ -2882,6 +2886,32 @@ static void demo_run_display(struct demo *demo) {
         }
     }
 }
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+static VkResult demo_create_headless_surface(struct demo *demo) {
+    PFN_vkCreateHeadlessSurfaceEXT fpCreateHeadlessSurfaceEXT =
+        (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(demo->inst, "vkCreateHeadlessSurfaceEXT");
+    if (fpCreateHeadlessSurfaceEXT == NULL) {
+        ERR_EXIT("vkGetInstanceProcAddr failed to find vkCreateHeadlessSurfaceEXT", "vkGetInstanceProcAddr Failure");
+    }
+
+    VkHeadlessSurfaceCreateInfoEXT create_info;
+    create_info.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT;
+    create_info.pNext = NULL;
+    create_info.flags = 0;
+
+    return fpCreateHeadlessSurfaceEXT(demo->inst, &create_info, NULL, &demo->surface);
+}
+
+static void demo_run_headless(struct demo *demo) {
+    while (!demo->quit) {
+        demo_draw(demo);
+        demo->curFrame++;
+
+        if (demo->frameCount != INT32_MAX && demo->curFrame == demo->frameCount) {
+            demo->quit = true;
+        }
+    }
+}
 #endif
 
 /*
@@ -3005,6 +3035,11 @@ static void demo_init_vk(struct demo *demo) {
                 platformSurfaceExtFound = 1;
                 demo->extension_names[demo->enabled_extension_count++] = VK_KHR_DISPLAY_EXTENSION_NAME;
             }
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+            if (!strcmp(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME, instance_extensions[i].extensionName)) {
+                platformSurfaceExtFound = 1;
+                demo->extension_names[demo->enabled_extension_count++] = VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME;
+            }
 #elif defined(VK_USE_PLATFORM_ANDROID_KHR)
             if (!strcmp(VK_KHR_ANDROID_SURFACE_EXTENSION_NAME, instance_extensions[i].extensionName)) {
                 platformSurfaceExtFound = 1;
@@ -3077,6 +3112,12 @@ static void demo_init_vk(struct demo *demo) {
                  "Do you have a compatible Vulkan installable client driver (ICD) installed?\n"
                  "Please look at the Getting Started guide for additional information.\n",
                  "vkCreateInstance Failure");
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+        ERR_EXIT("vkEnumerateInstanceExtensionProperties failed to find the " VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME
+                 " extension.\n\n"
+                 "Do you have a compatible Vulkan installable client driver (ICD) installed?\n"
+                 "Please look at the Getting Started guide for additional information.\n",
+                 "vkCreateInstance Failure");
 #elif defined(VK_USE_PLATFORM_ANDROID_KHR)
         ERR_EXIT("vkEnumerateInstanceExtensionProperties failed to find the " VK_KHR_ANDROID_SURFACE_EXTENSION_NAME
                  " extension.\n\n"
@@ -3385,6 +3426,8 @@ static void demo_init_vk_swapchain(struct demo *demo) {
     err = vkCreateXcbSurfaceKHR(demo->inst, &createInfo, NULL, &demo->surface);
 #elif defined(VK_USE_PLATFORM_DISPLAY_KHR)
     err = demo_create_display_surface(demo);
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+    err = demo_create_headless_surface(demo);
 #elif defined(VK_USE_PLATFORM_IOS_MVK)
     VkIOSSurfaceCreateInfoMVK surface;
     surface.sType = VK_STRUCTURE_TYPE_IOS_SURFACE_CREATE_INFO_MVK;
@@ -3966,6 +4009,8 @@ int main(int argc, char **argv) {
 #elif defined(VK_USE_PLATFORM_MIR_KHR)
 #elif defined(VK_USE_PLATFORM_DISPLAY_KHR)
     demo_run_display(&demo);
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+    demo_run_headless(&demo);
 #endif
 
     demo_cleanup(&demo);
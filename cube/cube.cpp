@@ -39,6 +39,10 @@
 #define VULKAN_HPP_NO_SMART_HANDLE
 #define VULKAN_HPP_NO_EXCEPTIONS
 #include <vulkan/vulkan.hpp>
+
+#if defined(VK_USE_PLATFORM_HEADLESS_EXT) && !defined(VK_EXT_headless_surface)
+#error "Headless cubepp needs Vulkan headers that define VK_EXT_headless_surface"
+#endif
 #include <vulkan/vk_sdk_platform.h>
 
 #include "linmath.h"
@@ -269,6 +273,9 @@ struct Demo {
 #elif defined(VK_USE_PLATFORM_DISPLAY_KHR)
     vk::Result create_display_surface();
     void run_display();
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+    vk::Result create_headless_surface();
+    void run_headless();
 #endif
 
 #if defined(VK_USE_PLATFORM_WIN32_KHR)
@@ -1112,6 +1119,11 @@ void Demo::init_vk() {
                 platformSurfaceExtFound = 1;
                 extension_names[enabled_extension_count++] = VK_KHR_DISPLAY_EXTENSION_NAME;
             }
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+            if (!strcmp(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME, instance_extensions[i].extensionName)) {
+                platformSurfaceExtFound = 1;
+                extension_names[enabled_extension_count++] = VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME;
+            }
 #elif defined(VK_USE_PLATFORM_IOS_MVK)
             if (!strcmp(VK_MVK_IOS_SURFACE_EXTENSION_NAME, instance_extensions[i].extensionName)) {
                 platformSurfaceExtFound = 1;
@@ -1168,6 +1180,12 @@ void Demo::init_vk() {
                  "Do you have a compatible Vulkan installable client driver (ICD) installed?\n"
                  "Please look at the Getting Started guide for additional information.\n",
                  "vkCreateInstance Failure");
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+        ERR_EXIT("vkEnumerateInstanceExtensionProperties failed to find the " VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME
+                 " extension.\n\n"
+                 "Do you have a compatible Vulkan installable client driver (ICD) installed?\n"
+                 "Please look at the Getting Started guide for additional information.\n",
+                 "vkCreateInstance Failure");
 #elif defined(VK_USE_PLATFORM_IOS_MVK)
         ERR_EXIT("vkEnumerateInstanceExtensionProperties failed to find the " VK_MVK_IOS_SURFACE_EXTENSION_NAME
                  " extension.\n\nDo you have a compatible "
@@ -1332,6 +1350,11 @@ void Demo::init_vk_swapchain() {
         auto result = create_display_surface();
         VERIFY(result == vk::Result::eSuccess);
     }
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+    {
+        auto result = create_headless_surface();
+        VERIFY(result == vk::Result::eSuccess);
+    }
 #endif
     // Iterate over each queue to learn whether it supports presenting:
     std::unique_ptr<vk::Bool32[]> supportsPresent(new vk::Bool32[queue_family_count]);
@@ -2854,6 +2877,33 @@ void Demo::run_display() {
         }
     }
 }
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+
+vk::Result Demo::create_headless_surface() {
+    // The loader doesn't export vkCreateHeadlessSurfaceEXT, so it can't go through the static dispatch.
+    auto const fpCreateHeadlessSurfaceEXT =
+        reinterpret_cast<PFN_vkCreateHeadlessSurfaceEXT>(inst.getProcAddr("vkCreateHeadlessSurfaceEXT"));
+    if (fpCreateHeadlessSurfaceEXT == nullptr) {
+        ERR_EXIT("vkGetInstanceProcAddr failed to find vkCreateHeadlessSurfaceEXT", "vkGetInstanceProcAddr Failure");
+    }
+
+    auto const createInfo = vk::HeadlessSurfaceCreateInfoEXT();
+
+    return static_cast<vk::Result>(fpCreateHeadlessSurfaceEXT(static_cast<VkInstance>(inst),
+                                                              reinterpret_cast<const VkHeadlessSurfaceCreateInfoEXT *>(&createInfo),
+                                                              nullptr, reinterpret_cast<VkSurfaceKHR *>(&surface)));
+}
+
+void Demo::run_headless() {
+    while (!quit) {
+        draw();
+        curFrame++;
+
+        if (frameCount != INT32_MAX && curFrame == frameCount) {
+            quit = true;
+        }
+    }
+}
 #endif
 
 #if _WIN32
@@ -3003,6 +3053,8 @@ int main(int argc, char **argv) {
 #elif defined(VK_USE_PLATFORM_MIR_KHR)
 #elif defined(VK_USE_PLATFORM_DISPLAY_KHR)
     demo.run_display();
+#elif defined(VK_USE_PLATFORM_HEADLESS_EXT)
+    demo.run_headless();
 #endif
 
     demo.cleanup();
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2015-2017 The Khronos Group Inc.
+ * Copyright (c) 2015-2017 Valve Corporation
+ * Copyright (c) 2015-2017 LunarG, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Option parsing and device setup shared by the mock ICD benchmarks. It is header only so each benchmark stays one
+//  source file.
+
+#ifndef MOCK_ICD_BENCHMARK_H
+#define MOCK_ICD_BENCHMARK_H
+
+#include <vulkan/vulkan.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+// If argv[*index] is option and a value follows it, stores the value, raised to at least 1, in count and steps *index
+//  past the value
+static bool ParseCountOption(int argc, char** argv, int* index, const char* option, uint32_t* count) {
+    if (strcmp(argv[*index], option) || *index + 1 >= argc) {
+        return false;
+    }
+    *count = (uint32_t)std::max(strtoul(argv[++*index], nullptr, 0), 1ul);
+    return true;
+}
+
+// An instance, its first physical device and a device with one queue from family 0, with the entrypoints needed to
+//  tear them down
+struct BenchmarkDevice {
+    VkInstance instance;
+    VkPhysicalDevice physical_device;
+    VkDevice device;
+    PFN_vkGetDeviceProcAddr GetDeviceProcAddr;
+    PFN_vkDestroyDevice DestroyDevice;
+    PFN_vkDestroyInstance DestroyInstance;
+};
+
+// Entrypoints are resolved through get_instance_proc_addr, which is the loader's vkGetInstanceProcAddr unless the
+//  benchmark calls into an ICD library directly. On failure, prints what failed and leaves nothing to destroy.
+static bool CreateBenchmarkDevice(PFN_vkGetInstanceProcAddr get_instance_proc_addr, const char* app_name,
+                                  BenchmarkDevice* bench) {
+    auto create_instance = (PFN_vkCreateInstance)get_instance_proc_addr(VK_NULL_HANDLE, "vkCreateInstance");
+    VkApplicationInfo app_info = {VK_STRUCTURE_TYPE_APPLICATION_INFO};
+    app_info.pApplicationName = app_name;
+    app_info.apiVersion = VK_API_VERSION_1_0;
+    VkInstanceCreateInfo instance_info = {VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
+    instance_info.pApplicationInfo = &app_info;
+    bench->instance = VK_NULL_HANDLE;
+    if (!create_instance || create_instance(&instance_info, nullptr, &bench->instance) != VK_SUCCESS) {
+        fprintf(stderr, "vkCreateInstance failed\n");
+        return false;
+    }
+    bench->DestroyInstance = (PFN_vkDestroyInstance)get_instance_proc_addr(bench->instance, "vkDestroyInstance");
+    auto enumerate_physical_devices =
+        (PFN_vkEnumeratePhysicalDevices)get_instance_proc_addr(bench->instance, "vkEnumeratePhysicalDevices");
+    auto create_device = (PFN_vkCreateDevice)get_instance_proc_addr(bench->instance, "vkCreateDevice");
+    bench->GetDeviceProcAddr = (PFN_vkGetDeviceProcAddr)get_instance_proc_addr(bench->instance, "vkGetDeviceProcAddr");
+
+    uint32_t physical_device_count = 1;
+    bench->physical_device = VK_NULL_HANDLE;
+    const VkResult enumerate_result = enumerate_physical_devices(bench->instance, &physical_device_count, &bench->physical_device);
+    if ((enumerate_result != VK_SUCCESS && enumerate_result != VK_INCOMPLETE) || !physical_device_count) {
+        fprintf(stderr, "No physical device\n");
+        bench->DestroyInstance(bench->instance, nullptr);
+        return false;
+    }
+
+    const float priority = 1.0f;
+    VkDeviceQueueCreateInfo queue_info = {VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO};
+    queue_info.queueFamilyIndex = 0;
+    queue_info.queueCount = 1;
+    queue_info.pQueuePriorities = &priority;
+    VkDeviceCreateInfo device_info = {VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO};
+    device_info.queueCreateInfoCount = 1;
+    device_info.pQueueCreateInfos = &queue_info;
+    bench->device = VK_NULL_HANDLE;
+    if (create_device(bench->physical_device, &device_info, nullptr, &bench->device) != VK_SUCCESS) {
+        fprintf(stderr, "vkCreateDevice failed\n");
+        bench->DestroyInstance(bench->instance, nullptr);
+        return false;
+    }
+    bench->DestroyDevice = (PFN_vkDestroyDevice)bench->GetDeviceProcAddr(bench->device, "vkDestroyDevice");
+    return true;
+}
+
+static void DestroyBenchmarkDevice(BenchmarkDevice* bench) {
+    bench->DestroyDevice(bench->device, nullptr);
+    bench->DestroyInstance(bench->instance, nullptr);
+}
+
+#endif  // MOCK_ICD_BENCHMARK_H
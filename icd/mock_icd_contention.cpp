@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2015-2017 The Khronos Group Inc.
+ * Copyright (c) 2015-2017 Valve Corporation
+ * Copyright (c) 2015-2017 LunarG, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// mock_icd_contention measures how the per-call cost of the hot object entrypoints grows with the number of threads
+//  calling them at once. Every thread works on objects of its own, so any slowdown past one thread is lock contention
+//  inside the ICD rather than anything the app would have to synchronize.
+
+#include "mock_icd_benchmark.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+struct ContentionContext {
+    VkDevice device;
+    uint32_t memory_type_index;
+    uint32_t iterations;
+    std::atomic<uint32_t> ready_threads;
+    std::atomic<bool> start;
+    std::atomic<uint32_t> failed_calls;
+};
+
+// One iteration is six calls: map, unmap, get queue, create buffer, get its requirements and destroy it
+static const uint32_t CALLS_PER_ITERATION = 6;
+
+static void ContentionThread(ContentionContext* context) {
+    VkMemoryAllocateInfo alloc_info = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+    alloc_info.allocationSize = 4096;
+    alloc_info.memoryTypeIndex = context->memory_type_index;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    uint32_t failed_calls = 0;
+    if (vkAllocateMemory(context->device, &alloc_info, nullptr, &memory) != VK_SUCCESS) {
+        ++failed_calls;
+    }
+    VkBufferCreateInfo buffer_info = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    buffer_info.size = 256;
+    buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    ++context->ready_threads;
+    while (!context->start) {
+        std::this_thread::yield();
+    }
+    for (uint32_t i = 0; i < context->iterations; ++i) {
+        void* data = nullptr;
+        if (vkMapMemory(context->device, memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS) {
+            ++failed_calls;
+        }
+        vkUnmapMemory(context->device, memory);
+        VkQueue queue = VK_NULL_HANDLE;
+        vkGetDeviceQueue(context->device, 0, 0, &queue);
+        VkBuffer buffer = VK_NULL_HANDLE;
+        if (vkCreateBuffer(context->device, &buffer_info, nullptr, &buffer) != VK_SUCCESS) {
+            ++failed_calls;
+        }
+        VkMemoryRequirements requirements;
+        vkGetBufferMemoryRequirements(context->device, buffer, &requirements);
+        vkDestroyBuffer(context->device, buffer, nullptr);
+    }
+    vkFreeMemory(context->device, memory, nullptr);
+    context->failed_calls += failed_calls;
+}
+
+// Returns the wall time of the whole run, in which each thread made iterations * CALLS_PER_ITERATION calls
+static double RunContention(VkDevice device, uint32_t memory_type_index, uint32_t thread_count, uint32_t iterations,
+                            uint32_t* failed_calls) {
+    ContentionContext context;
+    context.device = device;
+    context.memory_type_index = memory_type_index;
+    context.iterations = iterations;
+    context.ready_threads = 0;
+    context.start = false;
+    context.failed_calls = 0;
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back(ContentionThread, &context);
+    }
+    while (context.ready_threads < thread_count) {
+        std::this_thread::yield();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    context.start = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    *failed_calls = context.failed_calls;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    uint32_t iterations = 100000;
+    uint32_t max_threads = 32;
+    for (int i = 1; i < argc; ++i) {
+        if (!ParseCountOption(argc, argv, &i, "--iterations", &iterations) &&
+            !ParseCountOption(argc, argv, &i, "--threads", &max_threads)) {
+            fprintf(stderr, "Usage: %s [--iterations <count>] [--threads <max count>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    BenchmarkDevice bench;
+    if (!CreateBenchmarkDevice(vkGetInstanceProcAddr, "mock_icd_contention", &bench)) {
+        return 1;
+    }
+
+    // Any host visible type will do, since the mock ICD backs all memory with host allocations
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    vkGetPhysicalDeviceMemoryProperties(bench.physical_device, &memory_properties);
+    uint32_t memory_type_index = 0;
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
+        if (memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            memory_type_index = i;
+            break;
+        }
+    }
+
+    printf("%8s %14s %14s\n", "Threads", "ns/call", "Mcalls/s");
+    int status = 0;
+    for (uint32_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        uint32_t failed_calls = 0;
+        const double seconds = RunContention(bench.device, memory_type_index, thread_count, iterations, &failed_calls);
+        if (failed_calls) {
+            fprintf(stderr, "%u allocate, map or create calls failed with %u threads\n", failed_calls, thread_count);
+            status = 1;
+            break;
+        }
+        const double calls = (double)thread_count * iterations * CALLS_PER_ITERATION;
+        // Per call of one thread, so a flat column means the calls scale with the threads
+        printf("%8u %14.1f %14.2f\n", thread_count, seconds * 1e9 * thread_count / calls, calls / seconds / 1e6);
+    }
+
+    DestroyBenchmarkDevice(&bench);
+    return status;
+}
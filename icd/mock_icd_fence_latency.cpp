@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2015-2017 The Khronos Group Inc.
+ * Copyright (c) 2015-2017 Valve Corporation
+ * Copyright (c) 2015-2017 LunarG, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// mock_icd_fence_latency measures fence round trips: the time from submitting a batch to vkWaitForFences returning for
+//  it, with a given number of batches in flight on the queue. Run it with VK_MOCK_SIMULATE_QUEUES=1 so the batches
+//  complete on the simulated timeline, whose submit cost then shows in the latency as the queue gets deeper.
+
+#include "mock_icd_benchmark.h"
+
+#include <chrono>
+#include <vector>
+
+struct FenceLatencyResult {
+    double seconds;
+    uint64_t timeouts;              // Zero timeout polls that found the fence still pending
+    std::vector<double> latencies;  // Of every round trip, in microseconds
+};
+
+// Keeps depth fence-only batches in flight, waiting on the oldest and resubmitting it iterations times in all
+static bool RunFenceLatency(VkDevice device, VkQueue queue, uint32_t depth, uint32_t iterations, bool poll,
+                            FenceLatencyResult* result) {
+    typedef std::chrono::steady_clock clock;
+    std::vector<VkFence> fences(depth, VK_NULL_HANDLE);
+    std::vector<clock::time_point> submit_times(depth);
+    VkFenceCreateInfo fence_info = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    bool success = true;
+    for (uint32_t i = 0; i < depth && success; ++i) {
+        success = vkCreateFence(device, &fence_info, nullptr, &fences[i]) == VK_SUCCESS;
+    }
+    result->timeouts = 0;
+    result->latencies.clear();
+    result->latencies.reserve(iterations);
+    const auto start = clock::now();
+    for (uint32_t i = 0; i < depth && success; ++i) {
+        submit_times[i] = clock::now();
+        success = vkQueueSubmit(queue, 0, nullptr, fences[i]) == VK_SUCCESS;
+    }
+    for (uint32_t i = 0; i < iterations && success; ++i) {
+        const uint32_t slot = i % depth;
+        VkResult wait_result;
+        if (poll) {
+            while ((wait_result = vkWaitForFences(device, 1, &fences[slot], VK_TRUE, 0)) == VK_TIMEOUT) {
+                ++result->timeouts;
+            }
+        } else {
+            wait_result = vkWaitForFences(device, 1, &fences[slot], VK_TRUE, UINT64_MAX);
+        }
+        const auto now = clock::now();
+        result->latencies.push_back(std::chrono::duration<double, std::micro>(now - submit_times[slot]).count());
+        success = wait_result == VK_SUCCESS && vkResetFences(device, 1, &fences[slot]) == VK_SUCCESS;
+        // Stop refilling once the round trips left are all in flight
+        if (success && i + depth < iterations) {
+            submit_times[slot] = clock::now();
+            success = vkQueueSubmit(queue, 0, nullptr, fences[slot]) == VK_SUCCESS;
+        }
+    }
+    result->seconds = std::chrono::duration<double>(clock::now() - start).count();
+    vkQueueWaitIdle(queue);
+    for (auto fence : fences) {
+        vkDestroyFence(device, fence, nullptr);
+    }
+    return success;
+}
+
+static double GetPercentile(std::vector<double>* values, double percentile) {
+    if (values->empty()) {
+        return 0.0;
+    }
+    const size_t index = std::min(values->size() - 1, (size_t)(values->size() * percentile / 100.0));
+    std::nth_element(values->begin(), values->begin() + index, values->end());
+    return (*values)[index];
+}
+
+int main(int argc, char** argv) {
+    uint32_t iterations = 10000;
+    uint32_t max_depth = 16;
+    bool poll = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--poll")) {
+            poll = true;
+        } else if (!ParseCountOption(argc, argv, &i, "--iterations", &iterations) &&
+                   !ParseCountOption(argc, argv, &i, "--depth", &max_depth)) {
+            fprintf(stderr, "Usage: %s [--iterations <count>] [--depth <max batches in flight>] [--poll]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    BenchmarkDevice bench;
+    if (!CreateBenchmarkDevice(vkGetInstanceProcAddr, "mock_icd_fence_latency", &bench)) {
+        return 1;
+    }
+    VkQueue queue = VK_NULL_HANDLE;
+    vkGetDeviceQueue(bench.device, 0, 0, &queue);
+
+    printf("%8s %12s %12s %12s %14s%s\n", "Depth", "mean us", "p50 us", "p99 us", "fences/s", poll ? "       polls" : "");
+    int status = 0;
+    for (uint32_t depth = 1; depth <= max_depth; depth *= 2) {
+        FenceLatencyResult result;
+        if (!RunFenceLatency(bench.device, queue, depth, std::max(iterations, depth), poll, &result)) {
+            fprintf(stderr, "Fence round trips failed at depth %u\n", depth);
+            status = 1;
+            break;
+        }
+        double total = 0.0;
+        for (auto latency : result.latencies) {
+            total += latency;
+        }
+        const double count = (double)result.latencies.size();
+        const double mean = total / count;
+        const double p50 = GetPercentile(&result.latencies, 50.0);
+        const double p99 = GetPercentile(&result.latencies, 99.0);
+        printf("%8u %12.2f %12.2f %12.2f %14.0f", depth, mean, p50, p99, count / result.seconds);
+        if (poll) {
+            printf(" %11.1f", result.timeouts / count);
+        }
+        printf("\n");
+    }
+
+    DestroyBenchmarkDevice(&bench);
+    return status;
+}
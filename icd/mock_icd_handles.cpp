@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2015-2017 The Khronos Group Inc.
+ * Copyright (c) 2015-2017 Valve Corporation
+ * Copyright (c) 2015-2017 LunarG, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// mock_icd_handles has threads create and destroy descriptor set layouts and pipeline layouts at once. Neither keeps
+//  state in the mock ICD, so a create call is little more than handing out a handle, and if calls per second grow with
+//  the thread count, handing them out doesn't serialize the threads.
+
+#include "mock_icd_benchmark.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+struct HandleContext {
+    VkDevice device;
+    uint32_t iterations;
+    std::atomic<uint32_t> ready_threads;
+    std::atomic<bool> start;
+    std::atomic<uint32_t> failed_calls;
+};
+
+// One iteration is four calls: create a descriptor set layout and a pipeline layout, then destroy both
+static const uint32_t CALLS_PER_ITERATION = 4;
+
+static void HandleThread(HandleContext* context) {
+    VkDescriptorSetLayoutCreateInfo set_layout_info = {VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO};
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+    uint32_t failed_calls = 0;
+
+    ++context->ready_threads;
+    while (!context->start) {
+        std::this_thread::yield();
+    }
+    for (uint32_t i = 0; i < context->iterations; ++i) {
+        VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+        if (vkCreateDescriptorSetLayout(context->device, &set_layout_info, nullptr, &set_layout) != VK_SUCCESS) {
+            ++failed_calls;
+        }
+        VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+        if (vkCreatePipelineLayout(context->device, &pipeline_layout_info, nullptr, &pipeline_layout) != VK_SUCCESS) {
+            ++failed_calls;
+        }
+        vkDestroyPipelineLayout(context->device, pipeline_layout, nullptr);
+        vkDestroyDescriptorSetLayout(context->device, set_layout, nullptr);
+    }
+    context->failed_calls += failed_calls;
+}
+
+// Returns the wall time of the whole run, in which each thread made iterations * CALLS_PER_ITERATION calls
+static double RunHandles(VkDevice device, uint32_t thread_count, uint32_t iterations, uint32_t* failed_calls) {
+    HandleContext context;
+    context.device = device;
+    context.iterations = iterations;
+    context.ready_threads = 0;
+    context.start = false;
+    context.failed_calls = 0;
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back(HandleThread, &context);
+    }
+    while (context.ready_threads < thread_count) {
+        std::this_thread::yield();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    context.start = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    *failed_calls = context.failed_calls;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    uint32_t iterations = 100000;
+    uint32_t max_threads = 64;
+    for (int i = 1; i < argc; ++i) {
+        if (!ParseCountOption(argc, argv, &i, "--iterations", &iterations) &&
+            !ParseCountOption(argc, argv, &i, "--threads", &max_threads)) {
+            fprintf(stderr, "Usage: %s [--iterations <count>] [--threads <max count>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    BenchmarkDevice bench;
+    if (!CreateBenchmarkDevice(vkGetInstanceProcAddr, "mock_icd_handles", &bench)) {
+        return 1;
+    }
+
+    printf("%8s %14s %14s\n", "Threads", "ns/call", "calls/s");
+    int status = 0;
+    for (uint32_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        uint32_t failed_calls = 0;
+        const double seconds = RunHandles(bench.device, thread_count, iterations, &failed_calls);
+        if (failed_calls) {
+            fprintf(stderr, "%u create calls failed with %u threads\n", failed_calls, thread_count);
+            status = 1;
+            break;
+        }
+        const double calls = (double)thread_count * iterations * CALLS_PER_ITERATION;
+        // Per call of one thread, so a flat column means the calls scale with the threads
+        printf("%8u %14.1f %14.0f\n", thread_count, seconds * 1e9 * thread_count / calls, calls / seconds);
+    }
+
+    DestroyBenchmarkDevice(&bench);
+    return status;
+}
@@ -35,156 +35,5714 @@ using mutex_t = std::mutex;
 using lock_guard_t = std::lock_guard<mutex_t>;
 using unique_lock_t = std::unique_lock<mutex_t>;
 
+// VS2013 has no thread_local keyword, but supports __declspec(thread) for POD data
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define MOCK_THREAD_LOCAL __declspec(thread)
+#else
+#define MOCK_THREAD_LOCAL thread_local
+#endif
+
 static mutex_t global_lock;
-static uint64_t global_unique_handle = 1;
+static std::atomic<uint64_t> global_unique_handle(1);
+// Non-dispatchable handles are handed out to each thread in blocks of this many, so the shared
+//  counter is only touched once per block and object creation doesn't serialize between threads.
+static const uint64_t NON_DISP_HANDLE_BLOCK_SIZE = 1024;
 static const uint32_t SUPPORTED_LOADER_ICD_INTERFACE_VERSION = 5;
 static uint32_t loader_interface_version = 0;
 static bool negotiate_loader_icd_interface_called = false;
-static void* CreateDispObjHandle() {
-    auto handle = new VK_LOADER_DATA;
-    set_loader_magic_value(handle);
+
+// Dispatchable objects are carved out of slabs owned by a DispObjPool. Instances, physical devices and devices come from
+//  global_disp_obj_pool, while queues and command buffers come from a pool owned by their device so that everything a
+//  device created is released in bulk when the device is destroyed.
+struct DispObjPool;
+struct DispObj {
+    VK_LOADER_DATA loader_data;  // Must be first, the loader writes its dispatch table pointer here
+    DispObjPool* pool;
+    void* state;
+    DispObj* next_free;
+};
+
+static const uint32_t DISP_OBJ_SLAB_SIZE = 256;
+static const uint32_t DISP_OBJ_THREAD_CACHE_SIZE = 64;
+
+// Pool ids are never reused, so a per-thread cache can tell if the pool its objects came from has been destroyed
+static std::atomic<uint64_t> next_disp_obj_pool_id(1);
+static mutex_t disp_obj_pool_registry_lock;
+static std::unordered_map<uint64_t, DispObjPool*> disp_obj_pool_registry;
+
+struct DispObjPool {
+    uint64_t id;
+    mutex_t lock;
+    DispObj* free_list;
+    std::vector<DispObj*> slabs;
+
+    DispObjPool() : id(next_disp_obj_pool_id.fetch_add(1)), free_list(nullptr) {
+        lock_guard_t registry_lock(disp_obj_pool_registry_lock);
+        disp_obj_pool_registry[id] = this;
+    }
+    ~DispObjPool() {
+        {
+            lock_guard_t registry_lock(disp_obj_pool_registry_lock);
+            disp_obj_pool_registry.erase(id);
+        }
+        for (auto slab : slabs) {
+            delete[] slab;
+        }
+    }
+    // Pop up to count objects off the free list, carving out a new slab if it runs dry
+    uint32_t Take(DispObj** objs, uint32_t count) {
+        lock_guard_t pool_lock(lock);
+        if (!free_list) {
+            auto slab = new DispObj[DISP_OBJ_SLAB_SIZE];
+            for (uint32_t i = 0; i < DISP_OBJ_SLAB_SIZE; ++i) {
+                slab[i].pool = this;
+                slab[i].next_free = (i + 1 < DISP_OBJ_SLAB_SIZE) ? &slab[i + 1] : nullptr;
+            }
+            slabs.push_back(slab);
+            free_list = slab;
+        }
+        uint32_t taken = 0;
+        while (free_list && taken < count) {
+            objs[taken++] = free_list;
+            free_list = free_list->next_free;
+        }
+        return taken;
+    }
+    void Give(DispObj** objs, uint32_t count) {
+        lock_guard_t pool_lock(lock);
+        for (uint32_t i = 0; i < count; ++i) {
+            objs[i]->next_free = free_list;
+            free_list = objs[i];
+        }
+    }
+};
+
+static DispObjPool global_disp_obj_pool;
+
+// Each thread caches free objects of the last pool it used, so allocate/free pairs on the same pool don't take any lock
+struct DispObjThreadCache {
+    uint64_t pool_id;
+    DispObjPool* pool;
+    uint32_t count;
+    DispObj* objs[DISP_OBJ_THREAD_CACHE_SIZE];
+};
+static MOCK_THREAD_LOCAL DispObjThreadCache disp_obj_thread_cache;
+
+// Hands the cached objects back to the pool they came from
+static void FlushDispObjThreadCache() {
+    auto& cache = disp_obj_thread_cache;
+    if (cache.count) {
+        // Objects belonging to a pool that has since been destroyed went away with its slabs
+        lock_guard_t registry_lock(disp_obj_pool_registry_lock);
+        auto old_pool = disp_obj_pool_registry.find(cache.pool_id);
+        if (old_pool != disp_obj_pool_registry.end()) {
+            old_pool->second->Give(cache.objs, cache.count);
+        }
+    }
+    cache.count = 0;
+}
+
+#if !defined(_MSC_VER) || _MSC_VER >= 1900
+// Flushes the thread's cache as the thread exits, so threads coming and going don't strand objects outside their pool.
+//  VS2013 can't run code at thread exit this way, and leaves them until the pool is destroyed.
+struct DispObjThreadCacheFlusher {
+    ~DispObjThreadCacheFlusher() { FlushDispObjThreadCache(); }
+};
+#endif
+
+static void RetargetDispObjThreadCache(DispObjPool* pool) {
+#if !defined(_MSC_VER) || _MSC_VER >= 1900
+    // Every thread retargets its cache before first using it, which constructs the flusher
+    static thread_local DispObjThreadCacheFlusher flusher;
+    (void)flusher;
+#endif
+    FlushDispObjThreadCache();
+    auto& cache = disp_obj_thread_cache;
+    cache.pool_id = pool->id;
+    cache.pool = pool;
+}
+
+static void* CreateDispObjHandle(DispObjPool* pool = &global_disp_obj_pool) {
+    auto& cache = disp_obj_thread_cache;
+    if (cache.pool_id != pool->id) {
+        RetargetDispObjThreadCache(pool);
+    }
+    if (!cache.count) {
+        cache.count = pool->Take(cache.objs, DISP_OBJ_THREAD_CACHE_SIZE / 2);
+    }
+    auto handle = cache.objs[--cache.count];
+    handle->state = nullptr;
+    set_loader_magic_value(&handle->loader_data);
     return handle;
 }
 static void DestroyDispObjHandle(void* handle) {
-    delete reinterpret_cast<VK_LOADER_DATA*>(handle);
+    if (!handle) {
+        return;
+    }
+    auto obj = reinterpret_cast<DispObj*>(handle);
+    auto& cache = disp_obj_thread_cache;
+    if (cache.pool_id != obj->pool->id) {
+        RetargetDispObjThreadCache(obj->pool);
+    }
+    if (cache.count == DISP_OBJ_THREAD_CACHE_SIZE) {
+        // Keep half of the cache around for the next allocations and hand the rest back
+        cache.count = DISP_OBJ_THREAD_CACHE_SIZE / 2;
+        obj->pool->Give(&cache.objs[cache.count], DISP_OBJ_THREAD_CACHE_SIZE / 2);
+    }
+    cache.objs[cache.count++] = obj;
+}
+// Releases every object allocated from the pool at once, whether or not the app freed them
+static void DestroyDispObjPool(DispObjPool* pool) {
+    auto& cache = disp_obj_thread_cache;
+    if (cache.pool_id == pool->id) {
+        cache.count = 0;
+    }
+    delete pool;
+}
+static uint64_t NewNonDispHandle() {
+    static MOCK_THREAD_LOCAL uint64_t next_handle = 0;
+    static MOCK_THREAD_LOCAL uint64_t end_handle = 0;
+    if (next_handle == end_handle) {
+        next_handle = global_unique_handle.fetch_add(NON_DISP_HANDLE_BLOCK_SIZE, std::memory_order_relaxed);
+        end_handle = next_handle + NON_DISP_HANDLE_BLOCK_SIZE;
+    }
+    return next_handle++;
+}
+'''
+
+PROFILE_FIELD_CODE = '''
+// Device profiles set struct members by name, through tables generated from the registry's struct definitions
+enum ProfileFieldType {
+    PROFILE_FIELD_UINT32,
+    PROFILE_FIELD_INT32,
+    PROFILE_FIELD_UINT64,
+    PROFILE_FIELD_SIZE,
+    PROFILE_FIELD_FLOAT,
+};
+
+struct ProfileField {
+    const char* name;
+    ProfileFieldType type;
+    size_t offset;
+    uint32_t count;  // Array length, or 1
+};
+'''
+
+# Entrypoint lookup, emitted in the header after the perfect hash tables that the generator builds
+ENTRYPOINT_LOOKUP_CODE = '''
+// Entrypoint names are looked up through a perfect hash that was computed when this file was generated. The name is
+//  hashed once, the hash picks a bucket whose displacement selects the only slot the name can live in, and a single
+//  strcmp confirms the match. No allocation, no probing.
+struct EntrypointTableEntry {
+    const char* name;
+    void* func;
+};
+
+struct EntrypointTable {
+    const uint32_t* displacements;
+    uint32_t bucket_count;
+    const EntrypointTableEntry* slots;
+    uint32_t slot_count;
+};
+
+static inline uint64_t HashEntrypointName(const char* name) {
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name; ++name) {
+        hash ^= (uint8_t)*name;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline uint32_t EntrypointSlot(uint64_t hash, uint32_t displacement, uint32_t slot_count) {
+    uint64_t x = hash + displacement * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    return (uint32_t)(x % slot_count);
+}
+
+static inline void* FindEntrypoint(const EntrypointTable& table, const char* name) {
+    const uint64_t hash = HashEntrypointName(name);
+    const uint32_t displacement = table.displacements[(uint32_t)(hash >> 32) % table.bucket_count];
+    const auto& entry = table.slots[EntrypointSlot(hash, displacement, table.slot_count)];
+    if (entry.name && !strcmp(entry.name, name)) {
+        return entry.func;
+    }
+    return nullptr;
+}
+'''
+
+# Layout of API trace files, emitted after the entrypoint ids in both the ICD header and the replayer
+TRACE_FORMAT_CODE = '''
+// API traces written with VK_MOCK_TRACE_FILE start with a TraceFileHeader, followed by blocks that each hold a
+//  TraceBlockHeader and one chunk of packets from one thread. A thread's chunks come in the order it filled them, and
+//  its packets are laid out in them like recorded commands: a packet is made of 8-byte aligned items, and an item that
+//  doesn't fit in what's left of a chunk starts the next one.
+static const char TRACE_FILE_MAGIC[8] = {'V', 'K', 'M', 'O', 'C', 'K', 'T', 'R'};
+static const uint32_t TRACE_FILE_VERSION = 1;
+static const size_t TRACE_CHUNK_SIZE = 256 * 1024;
+static const size_t TRACE_ALIGNMENT = 8;
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    // Packets hold structs as they are in memory, so they can only be replayed by a build with the same pointer size
+    uint32_t pointer_size;
+    // and that numbers entrypoints the same way
+    uint32_t entrypoint_count;
+    uint32_t reserved;
+    uint64_t entrypoint_name_hash;
+};
+
+struct TraceBlockHeader {
+    uint32_t thread_index;
+    uint32_t size;
+};
+
+// Each call is a packet: this header, each parameter in API order, what the structs they point to point to in turn,
+//  and finally the handles the call returned
+struct TracePacketHeader {
+    uint32_t id;  // EntrypointId
+    // Where the packet ends, so the replayer can skip calls it doesn't replay
+    uint32_t end_chunk;
+    uint64_t end_offset;
+    // Order the calls of all threads were made in
+    uint64_t sequence;
+};
+
+static inline size_t GetTraceItemSize(size_t size) { return (size + TRACE_ALIGNMENT - 1) & ~(TRACE_ALIGNMENT - 1); }
+
+static inline uint64_t GetEntrypointNameHash() {
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint32_t id = 0; id < ENTRYPOINT_ID_COUNT; ++id) {
+        // Names are hashed with their terminators, so they can't run into each other
+        for (const char* name = entrypoint_names[id];; ++name) {
+            hash ^= (uint8_t)*name;
+            hash *= 1099511628211ULL;
+            if (!*name) {
+                break;
+            }
+        }
+    }
+    return hash;
+}
+'''
+
+# Manual code at the top of the cpp source file
+SOURCE_CPP_PREFIX = '''
+using std::unordered_map;
+
+// Optional mock behavior is controlled through VK_MOCK_* environment variables, read once when the ICD is loaded
+static uint64_t GetEnvUint(const char* name, uint64_t default_value) {
+    const char* value = getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+    return strtoull(value, nullptr, 0);
+}
+
+static std::string GetEnvString(const char* name, const char* default_value) {
+    const char* value = getenv(name);
+    return (value && *value) ? value : default_value;
+}
+
+// Splits a list of paths separated the way PATH is. Empty entries are kept, so list positions stay meaningful.
+static std::vector<std::string> SplitPathList(const std::string& list) {
+#if defined(_WIN32)
+    const char separator = ';';
+#else
+    const char separator = ':';
+#endif
+    std::vector<std::string> paths;
+    if (list.empty()) {
+        return paths;
+    }
+    size_t start = 0;
+    while (true) {
+        const size_t end = list.find(separator, start);
+        paths.push_back(list.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        if (end == std::string::npos) {
+            return paths;
+        }
+        start = end + 1;
+    }
+}
+
+static bool ReadFileContents(const std::string& path, std::vector<char>* contents) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    contents->clear();
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        contents->insert(contents->end(), buffer, buffer + count);
+    }
+    const bool success = !ferror(file);
+    fclose(file);
+    return success;
+}
+
+// Durations are in ns unless they end in us or ms
+static bool ParseDuration(const char* text, char** end, uint64_t* ns) {
+    *ns = strtoull(text, end, 10);
+    if (*end == text) {
+        return false;
+    }
+    if (!strncmp(*end, "ms", 2)) {
+        *ns *= 1000000;
+        *end += 2;
+    } else if (!strncmp(*end, "us", 2)) {
+        *ns *= 1000;
+        *end += 2;
+    } else if (!strncmp(*end, "ns", 2)) {
+        *end += 2;
+    }
+    return true;
+}
+
+// Splits a list of name=value entries separated by commas or whitespace, as VK_MOCK_LATENCY and VK_MOCK_COMMAND_COSTS
+//  take. Entries that don't name an entrypoint are skipped with a warning; the value is left for the caller to check.
+struct EntrypointListEntry {
+    uint32_t id;
+    std::string text;  // The whole entry, for warnings
+    std::string value;
+};
+
+static std::vector<EntrypointListEntry> SplitEntrypointList(const std::string& list, const char* what) {
+    std::vector<EntrypointListEntry> entries;
+    size_t start = 0;
+    while ((start = list.find_first_not_of(", \\t\\r\\n", start)) != std::string::npos) {
+        const size_t end = std::min(list.find_first_of(", \\t\\r\\n", start), list.size());
+        const std::string entry = list.substr(start, end - start);
+        start = end;
+        const size_t equals = entry.find('=');
+        const std::string name = entry.substr(0, equals);
+        uint32_t id = 0;
+        while (id < ENTRYPOINT_ID_COUNT && name != entrypoint_names[id]) {
+            ++id;
+        }
+        if (id == ENTRYPOINT_ID_COUNT || equals == std::string::npos) {
+            fprintf(stderr, "vkmock: Ignoring %s entry %s\\n", what, entry.c_str());
+            continue;
+        }
+        EntrypointListEntry list_entry = {id, entry, entry.substr(equals + 1)};
+        entries.push_back(list_entry);
+    }
+    return entries;
+}
+
+// Simulated GPU time of each recorded command, by entrypoint. VK_MOCK_COMMAND_COSTS overrides default_ns for the
+//  commands it names, e.g. "vkCmdDraw=20us,vkCmdDispatch=50us,vkCmdPipelineBarrier=2us".
+static std::vector<uint64_t> ParseCommandCosts(uint64_t default_ns, const std::string& list) {
+    std::vector<uint64_t> costs(ENTRYPOINT_ID_COUNT, default_ns);
+    for (const auto& entry : SplitEntrypointList(list, "command cost")) {
+        char* next = nullptr;
+        uint64_t ns = 0;
+        if (!ParseDuration(entry.value.c_str(), &next, &ns) || *next) {
+            fprintf(stderr, "vkmock: Ignoring command cost entry %s\\n", entry.text.c_str());
+            continue;
+        }
+        costs[entry.id] = ns;
+    }
+    return costs;
+}
+
+struct MockSettings {
+    // Allocations at least this big get their own pages from the OS instead of coming from the heap
+    uint64_t mmap_threshold;
+    bool huge_pages;
+    // Memory requirements model
+    VkDeviceSize buffer_alignment;
+    VkDeviceSize image_alignment;
+    VkDeviceSize buffer_image_granularity;
+    VkDeviceSize linear_row_pitch_alignment;
+    // Simulated GPU timeline
+    bool simulate_queues;
+    uint64_t submit_cost_ns;
+    std::vector<uint64_t> command_costs_ns;  // By entrypoint, see ParseCommandCosts()
+    // Per-entrypoint profiling, enabled by naming a file for the report
+    std::string profile_file;
+    // Simulated physical devices, the device profile JSON for each, and where their compiled form is cached
+    uint32_t physical_device_count;
+    uint32_t device_group_size;
+    std::vector<std::string> device_profiles;
+    std::string device_profile_cache_dir;
+    // Software rasterizer, and how many threads it draws with and transfers are split over
+    bool rasterize;
+    uint32_t raster_threads;
+    // Refresh rate of the virtual display swapchains present to
+    uint32_t refresh_hz;
+    // Time it takes to compile a pipeline that isn't in the pipeline cache
+    uint64_t pipeline_compile_cost_ns;
+    // API trace capture, enabled by naming a file for the trace
+    std::string trace_file;
+    // Memory budget reported through VK_EXT_memory_budget, as a percentage of each heap's size. Under pressure it
+    //  shrinks to memory_pressure_percent over memory_pressure_frames presented frames.
+    uint32_t memory_budget_percent;
+    uint32_t memory_pressure_percent;
+    uint64_t memory_pressure_frames;
+    // Driver overhead added to entrypoints, see ParseEntrypointLatencies()
+    std::string latency;
+    // Performance lint of command buffers and memory calls, enabled by naming a file for the report
+    std::string lint_file;
+
+    MockSettings() {
+        mmap_threshold = GetEnvUint("VK_MOCK_MMAP_THRESHOLD", 2 * 1024 * 1024);
+        huge_pages = GetEnvUint("VK_MOCK_HUGE_PAGES", 0) != 0;
+        buffer_alignment = std::max<VkDeviceSize>(GetEnvUint("VK_MOCK_BUFFER_ALIGNMENT", 256), 1);
+        image_alignment = std::max<VkDeviceSize>(GetEnvUint("VK_MOCK_IMAGE_ALIGNMENT", 4096), 1);
+        buffer_image_granularity = std::max<VkDeviceSize>(GetEnvUint("VK_MOCK_BUFFER_IMAGE_GRANULARITY", 1), 1);
+        linear_row_pitch_alignment = std::max<VkDeviceSize>(GetEnvUint("VK_MOCK_LINEAR_ROW_PITCH_ALIGNMENT", 256), 1);
+        simulate_queues = GetEnvUint("VK_MOCK_SIMULATE_QUEUES", 0) != 0;
+        submit_cost_ns = GetEnvUint("VK_MOCK_SUBMIT_COST_NS", 10000);
+        command_costs_ns =
+            ParseCommandCosts(GetEnvUint("VK_MOCK_COMMAND_COST_NS", 1000), GetEnvString("VK_MOCK_COMMAND_COSTS", ""));
+        profile_file = GetEnvString("VK_MOCK_PROFILE_FILE", "");
+        device_profiles = SplitPathList(GetEnvString("VK_MOCK_DEVICE_PROFILE", ""));
+        physical_device_count = (uint32_t)std::max<uint64_t>(GetEnvUint("VK_MOCK_PHYSICAL_DEVICE_COUNT", device_profiles.size()), 1);
+        device_group_size = (uint32_t)std::min<uint64_t>(std::max<uint64_t>(GetEnvUint("VK_MOCK_DEVICE_GROUP_SIZE", 1), 1),
+                                                         VK_MAX_DEVICE_GROUP_SIZE);
+#if defined(_WIN32)
+        device_profile_cache_dir = GetEnvString("VK_MOCK_DEVICE_PROFILE_CACHE_DIR", GetEnvString("TEMP", ".").c_str());
+#else
+        device_profile_cache_dir = GetEnvString("VK_MOCK_DEVICE_PROFILE_CACHE_DIR", GetEnvString("TMPDIR", "/tmp").c_str());
+#endif
+        rasterize = GetEnvUint("VK_MOCK_RASTERIZER", 0) != 0;
+        raster_threads = (uint32_t)std::max<uint64_t>(
+            GetEnvUint("VK_MOCK_RASTER_THREADS", std::max(std::thread::hardware_concurrency(), 1u)), 1);
+        refresh_hz = (uint32_t)std::min<uint64_t>(std::max<uint64_t>(GetEnvUint("VK_MOCK_REFRESH_HZ", 60), 1), 1000000000);
+        pipeline_compile_cost_ns = GetEnvUint("VK_MOCK_PIPELINE_COMPILE_COST_NS", 0);
+        trace_file = GetEnvString("VK_MOCK_TRACE_FILE", "");
+        memory_budget_percent = (uint32_t)std::min<uint64_t>(GetEnvUint("VK_MOCK_MEMORY_BUDGET_PERCENT", 100), 100);
+        memory_pressure_percent =
+            (uint32_t)std::min<uint64_t>(GetEnvUint("VK_MOCK_MEMORY_PRESSURE_PERCENT", 50), memory_budget_percent);
+        memory_pressure_frames = GetEnvUint("VK_MOCK_MEMORY_PRESSURE_FRAMES", 0);
+        latency = GetEnvString("VK_MOCK_LATENCY", "");
+        lint_file = GetEnvString("VK_MOCK_LINT_FILE", "");
+    }
+};
+static const MockSettings settings;
+
+// Per-entrypoint profiling. Every intercept opens an EntrypointScope, which counts the call and files the time it took
+//  into a histogram with power-of-two buckets. Each thread records into its own EntrypointProfile, so the only shared
+//  state touched per call is the settings check; profiles are summed up when the report is written.
+static const uint32_t PROFILE_BUCKET_COUNT = 40;  // Bucket i holds calls that took less than 2^i ns
+
+struct EntrypointProfile {
+    // Only the owning thread updates these, but the report can be written from any thread
+    std::atomic<uint64_t> calls[ENTRYPOINT_ID_COUNT];
+    std::atomic<uint64_t> total_ns[ENTRYPOINT_ID_COUNT];
+    std::atomic<uint64_t> histogram[ENTRYPOINT_ID_COUNT][PROFILE_BUCKET_COUNT];
+    // Intercepts called from other intercepts are only counted as part of the outermost one
+    uint32_t depth;
+};
+
+// Profiles of every thread that has called in, kept after the thread exits so its calls still make the report
+static mutex_t profile_lock;
+static std::vector<EntrypointProfile*> profiles;
+static MOCK_THREAD_LOCAL EntrypointProfile* thread_profile = nullptr;
+
+#if !defined(_WIN32)
+// Set by SIGUSR1, and checked as the next intercept returns since the report can't be written from a signal handler
+static volatile sig_atomic_t profile_report_requested = 0;
+
+static void RequestProfileReport(int) { profile_report_requested = 1; }
+
+// Leaves SIGUSR1 alone if the app has its own use for it
+static void InstallProfileSignalHandler() {
+    struct sigaction action;
+    if (sigaction(SIGUSR1, nullptr, &action) != 0 || action.sa_handler != SIG_DFL) {
+        return;
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = RequestProfileReport;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, nullptr);
+}
+#endif
+
+static EntrypointProfile* GetThreadProfile() {
+    if (!thread_profile) {
+        // Value-initialized so all the counters start at zero
+        thread_profile = new EntrypointProfile();
+        lock_guard_t lock(profile_lock);
+        profiles.push_back(thread_profile);
+    }
+    return thread_profile;
+}
+
+static uint32_t GetProfileBucket(uint64_t ns) {
+    uint32_t bucket = 0;
+    while (ns && bucket + 1 < PROFILE_BUCKET_COUNT) {
+        ns >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+// A plain load and store, since no other thread writes the counter
+static void AddToProfileCounter(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Pipelines found in a pipeline cache, and pipelines that had to be compiled, see below
+static std::atomic<uint64_t> pipeline_cache_hits(0);
+static std::atomic<uint64_t> pipeline_cache_misses(0);
+// Bytes moved by transfer commands, and the host time spent moving them, see below
+static std::atomic<uint64_t> transfer_bytes(0);
+static std::atomic<uint64_t> transfer_ns(0);
+
+// Writes the calls recorded so far as JSON to VK_MOCK_PROFILE_FILE, busiest entrypoints first
+static void WriteProfileReport() {
+    struct EntrypointReport {
+        uint32_t id;
+        uint64_t calls;
+        uint64_t total_ns;
+        uint64_t histogram[PROFILE_BUCKET_COUNT];
+    };
+    std::vector<EntrypointReport> reports(ENTRYPOINT_ID_COUNT);
+    lock_guard_t lock(profile_lock);
+    for (uint32_t id = 0; id < ENTRYPOINT_ID_COUNT; ++id) {
+        auto& report = reports[id];
+        memset(&report, 0, sizeof(report));
+        report.id = id;
+        for (auto profile : profiles) {
+            report.calls += profile->calls[id].load(std::memory_order_relaxed);
+            report.total_ns += profile->total_ns[id].load(std::memory_order_relaxed);
+            for (uint32_t bucket = 0; bucket < PROFILE_BUCKET_COUNT; ++bucket) {
+                report.histogram[bucket] += profile->histogram[id][bucket].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    // Presents delimit frames, so per-frame rates come out of the same counters
+    const uint64_t frames = reports[ENTRYPOINT_ID_vkQueuePresentKHR].calls;
+    std::sort(reports.begin(), reports.end(),
+              [](const EntrypointReport& a, const EntrypointReport& b) { return a.total_ns > b.total_ns; });
+
+    FILE* file = fopen(settings.profile_file.c_str(), "w");
+    if (!file) {
+        return;
+    }
+    fprintf(file, "{\\n    \\"frames\\": %llu,\\n", (unsigned long long)frames);
+    fprintf(file, "    \\"pipeline_cache\\": {\\"hits\\": %llu, \\"misses\\": %llu},\\n",
+            (unsigned long long)pipeline_cache_hits.load(std::memory_order_relaxed),
+            (unsigned long long)pipeline_cache_misses.load(std::memory_order_relaxed));
+    const uint64_t bytes = transfer_bytes.load(std::memory_order_relaxed);
+    const uint64_t ns = transfer_ns.load(std::memory_order_relaxed);
+    fprintf(file, "    \\"transfers\\": {\\"bytes\\": %llu, \\"ns\\": %llu, \\"bytes_per_second\\": %.0f},\\n",
+            (unsigned long long)bytes, (unsigned long long)ns, ns ? bytes * 1e9 / ns : 0.0);
+    fprintf(file, "    \\"entrypoints\\": [");
+    bool first_report = true;
+    for (const auto& report : reports) {
+        if (!report.calls) {
+            continue;
+        }
+        fprintf(file, "%s\\n        {\\"name\\": \\"%s\\", \\"calls\\": %llu, \\"calls_per_frame\\": %.3f, ", first_report ? "" : ",",
+                entrypoint_names[report.id], (unsigned long long)report.calls, frames ? (double)report.calls / frames : 0.0);
+        fprintf(file, "\\"total_ns\\": %llu, \\"mean_ns\\": %llu, \\"histogram\\": [", (unsigned long long)report.total_ns,
+                (unsigned long long)(report.total_ns / report.calls));
+        first_report = false;
+        bool first_bucket = true;
+        for (uint32_t bucket = 0; bucket < PROFILE_BUCKET_COUNT; ++bucket) {
+            if (!report.histogram[bucket]) {
+                continue;
+            }
+            fprintf(file, "%s{\\"under_ns\\": ", first_bucket ? "" : ", ");
+            // The last bucket catches everything slower, so it has no upper bound
+            if (bucket + 1 < PROFILE_BUCKET_COUNT) {
+                fprintf(file, "%llu", 1ull << bucket);
+            } else {
+                fprintf(file, "null");
+            }
+            fprintf(file, ", \\"count\\": %llu}", (unsigned long long)report.histogram[bucket]);
+            first_bucket = false;
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "\\n    ]\\n}\\n");
+    fclose(file);
+}
+
+// Latency injection. VK_MOCK_LATENCY lists entrypoints to add a fixed CPU cost to, as name=duration entries separated
+//  by commas or whitespace, e.g. "vkQueueSubmit=50us,vkCreateGraphicsPipelines=2ms:sleep,vkAcquireNextImageKHR=1ms~500us".
+//  Durations are in ns unless they end in us or ms. "~jitter" varies each call's cost by up to that much either way, and
+//  ":sleep" sleeps instead of busy-waiting, so the thread gives its core up. A list starting with @ is read from the
+//  file it names. Only calls the app makes pay the cost, not the ones the ICD makes internally.
+struct EntrypointLatency {
+    uint64_t ns;
+    uint64_t jitter_ns;
+    bool sleep;
+};
+static EntrypointLatency entrypoint_latencies[ENTRYPOINT_ID_COUNT];
+static MOCK_THREAD_LOCAL uint32_t latency_depth = 0;
+static MOCK_THREAD_LOCAL uint64_t latency_random_state = 0;
+
+static bool ParseEntrypointLatencies() {
+    std::string list = settings.latency;
+    if (!list.empty() && list[0] == '@') {
+        std::vector<char> contents;
+        if (!ReadFileContents(list.substr(1), &contents)) {
+            fprintf(stderr, "vkmock: Can't read latency list %s\\n", list.c_str() + 1);
+            return false;
+        }
+        list.assign(contents.begin(), contents.end());
+    }
+    bool enabled = false;
+    for (const auto& entry : SplitEntrypointList(list, "latency")) {
+        EntrypointLatency latency = {0, 0, false};
+        char* next = nullptr;
+        bool valid = ParseDuration(entry.value.c_str(), &next, &latency.ns);
+        if (valid && *next == '~') {
+            valid = ParseDuration(next + 1, &next, &latency.jitter_ns);
+            latency.jitter_ns = std::min(latency.jitter_ns, latency.ns);
+        }
+        if (valid && !strcmp(next, ":sleep")) {
+            latency.sleep = true;
+        } else if (valid && *next) {
+            valid = false;
+        }
+        if (!valid) {
+            fprintf(stderr, "vkmock: Ignoring latency entry %s\\n", entry.text.c_str());
+            continue;
+        }
+        entrypoint_latencies[entry.id] = latency;
+        enabled = true;
+    }
+    return enabled;
+}
+
+// The list is parsed by the first call the app makes rather than when the ICD is loaded, to keep file access out of
+//  library initialization
+static std::once_flag entrypoint_latencies_once;
+static bool latency_enabled = false;
+
+static bool IsLatencyEnabled() {
+    if (settings.latency.empty()) {
+        return false;
+    }
+    std::call_once(entrypoint_latencies_once, [] { latency_enabled = ParseEntrypointLatencies(); });
+    return latency_enabled;
+}
+
+static void InjectLatency(const EntrypointLatency& latency) {
+    if (!latency.ns) {
+        return;
+    }
+    uint64_t ns = latency.ns;
+    if (latency.jitter_ns) {
+        // xorshift64, seeded the same way on every run so jittered runs are repeatable
+        uint64_t& state = latency_random_state;
+        if (!state) {
+            state = 0x9E3779B97F4A7C15ULL;
+        }
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        ns = ns - latency.jitter_ns + state % (2 * latency.jitter_ns + 1);
+    }
+    if (latency.sleep) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+        return;
+    }
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns);
+    while (std::chrono::steady_clock::now() < deadline) {
+    }
+}
+
+class EntrypointScope {
+   public:
+    explicit EntrypointScope(EntrypointId id) : id_(id), profile_(nullptr) {
+        if (IsLatencyEnabled()) {
+            ++latency_depth;
+        }
+        if (settings.profile_file.empty()) {
+            return;
+        }
+        profile_ = GetThreadProfile();
+        if (profile_->depth++ == 0) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+    ~EntrypointScope() {
+        // Paid before the call is timed, so the profile report includes it. The constructor already parsed the list.
+        if (latency_enabled && --latency_depth == 0) {
+            InjectLatency(entrypoint_latencies[id_]);
+        }
+        if (!profile_ || --profile_->depth != 0) {
+            return;
+        }
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+        AddToProfileCounter(profile_->calls[id_], 1);
+        AddToProfileCounter(profile_->total_ns[id_], ns);
+        AddToProfileCounter(profile_->histogram[id_][GetProfileBucket(ns)], 1);
+#if !defined(_WIN32)
+        if (profile_report_requested) {
+            profile_report_requested = 0;
+            WriteProfileReport();
+        }
+#endif
+    }
+
+   private:
+    EntrypointId id_;
+    EntrypointProfile* profile_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Device profiles. Every physical device query answers from a PhysicalDeviceProfile, which starts out as the built-in
+//  mock device and can be overridden from a DevSim-style JSON file named by VK_MOCK_DEVICE_PROFILE. The JSON is only
+//  parsed the first time a given file is seen: the result is written to a binary cache named after the file's hash,
+//  which later processes map straight in.
+static const uint32_t MAX_PROFILE_QUEUE_FAMILIES = 16;
+static const uint32_t MAX_PROFILE_EXTENSION_FORMATS = 64;
+// Core formats are stored by value, extension formats in a short list
+static const uint32_t PROFILE_CORE_FORMAT_COUNT = VK_FORMAT_ASTC_12x12_SRGB_BLOCK + 1;
+
+struct ProfileExtensionFormat {
+    VkFormat format;
+    VkFormatProperties properties;
+};
+
+// Plain data only, so it can be written to the cache and mapped back as is
+struct PhysicalDeviceProfile {
+    VkPhysicalDeviceProperties properties;
+    VkPhysicalDeviceFeatures features;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    uint32_t queue_family_count;
+    VkQueueFamilyProperties queue_families[MAX_PROFILE_QUEUE_FAMILIES];
+    VkFormatProperties core_formats[PROFILE_CORE_FORMAT_COUNT];
+    uint32_t extension_format_count;
+    ProfileExtensionFormat extension_formats[MAX_PROFILE_EXTENSION_FORMATS];
+    // What extension formats that aren't in the list get. Profiles that list formats don't support any others.
+    VkFormatProperties unlisted_format;
+};
+
+// TODO: Would like to codegen this but limits aren't in XML
+static VkPhysicalDeviceLimits SetLimits(VkPhysicalDeviceLimits *limits) {
+    limits->maxImageDimension1D = 4096;
+    limits->maxImageDimension2D = 4096;
+    limits->maxImageDimension3D = 256;
+    limits->maxImageDimensionCube = 4096;
+    limits->maxImageArrayLayers = 256;
+    limits->maxTexelBufferElements = 65536;
+    limits->maxUniformBufferRange = 16384;
+    limits->maxStorageBufferRange = 134217728;
+    limits->maxPushConstantsSize = 128;
+    limits->maxMemoryAllocationCount = 4096;
+    limits->maxSamplerAllocationCount = 4000;
+    limits->bufferImageGranularity = settings.buffer_image_granularity;
+    limits->sparseAddressSpaceSize = 2147483648;
+    limits->maxBoundDescriptorSets = 4;
+    limits->maxPerStageDescriptorSamplers = 16;
+    limits->maxPerStageDescriptorUniformBuffers = 12;
+    limits->maxPerStageDescriptorStorageBuffers = 4;
+    limits->maxPerStageDescriptorSampledImages = 16;
+    limits->maxPerStageDescriptorStorageImages = 4;
+    limits->maxPerStageDescriptorInputAttachments = 4;
+    limits->maxPerStageResources = 128^2;
+    limits->maxDescriptorSetSamplers = 96^8;
+    limits->maxDescriptorSetUniformBuffers = 72^8;
+    limits->maxDescriptorSetUniformBuffersDynamic = 8;
+    limits->maxDescriptorSetStorageBuffers = 24^8;
+    limits->maxDescriptorSetStorageBuffersDynamic = 4;
+    limits->maxDescriptorSetSampledImages = 96^8;
+    limits->maxDescriptorSetStorageImages = 24^8;
+    limits->maxDescriptorSetInputAttachments = 4;
+    limits->maxVertexInputAttributes = 16;
+    limits->maxVertexInputBindings = 16;
+    limits->maxVertexInputAttributeOffset = 2047;
+    limits->maxVertexInputBindingStride = 2048;
+    limits->maxVertexOutputComponents = 64;
+    limits->maxTessellationGenerationLevel = 64;
+    limits->maxTessellationPatchSize = 32;
+    limits->maxTessellationControlPerVertexInputComponents = 64;
+    limits->maxTessellationControlPerVertexOutputComponents = 64;
+    limits->maxTessellationControlPerPatchOutputComponents = 120;
+    limits->maxTessellationControlTotalOutputComponents = 2048;
+    limits->maxTessellationEvaluationInputComponents = 64;
+    limits->maxTessellationEvaluationOutputComponents = 64;
+    limits->maxGeometryShaderInvocations = 32;
+    limits->maxGeometryInputComponents = 64;
+    limits->maxGeometryOutputComponents = 64;
+    limits->maxGeometryOutputVertices = 256;
+    limits->maxGeometryTotalOutputComponents = 1024;
+    limits->maxFragmentInputComponents = 64;
+    limits->maxFragmentOutputAttachments = 4;
+    limits->maxFragmentDualSrcAttachments = 1;
+    limits->maxFragmentCombinedOutputResources = 4;
+    limits->maxComputeSharedMemorySize = 16384;
+    limits->maxComputeWorkGroupCount[0] = 65535;
+    limits->maxComputeWorkGroupCount[1] = 65535;
+    limits->maxComputeWorkGroupCount[2] = 65535;
+    limits->maxComputeWorkGroupInvocations = 128;
+    limits->maxComputeWorkGroupSize[0] = 128;
+    limits->maxComputeWorkGroupSize[1] = 128;
+    limits->maxComputeWorkGroupSize[2] = 64;
+    limits->subPixelPrecisionBits = 4;
+    limits->subTexelPrecisionBits = 4;
+    limits->mipmapPrecisionBits = 4;
+    limits->maxDrawIndexedIndexValue = (2^32) - 1;
+    limits->maxDrawIndirectCount = (2^16) - 1;
+    limits->maxSamplerLodBias = 2.0f;
+    limits->maxSamplerAnisotropy = 16;
+    limits->maxViewports = 16;
+    limits->maxViewportDimensions[0] = 4096;
+    limits->maxViewportDimensions[1] = 4096;
+    limits->viewportBoundsRange[0] = -8192;
+    limits->viewportBoundsRange[1] = 8191;
+    limits->viewportSubPixelBits = 0;
+    limits->minMemoryMapAlignment = 64;
+    limits->minTexelBufferOffsetAlignment = 16;
+    limits->minUniformBufferOffsetAlignment = 16;
+    limits->minStorageBufferOffsetAlignment = 16;
+    limits->minTexelOffset = -8;
+    limits->maxTexelOffset = 7;
+    limits->minTexelGatherOffset = -8;
+    limits->maxTexelGatherOffset = 7;
+    limits->minInterpolationOffset = 0.0f;
+    limits->maxInterpolationOffset = 0.5f;
+    limits->subPixelInterpolationOffsetBits = 4;
+    limits->maxFramebufferWidth = 4096;
+    limits->maxFramebufferHeight = 4096;
+    limits->maxFramebufferLayers = 256;
+    limits->framebufferColorSampleCounts = 0x7F;
+    limits->framebufferDepthSampleCounts = 0x7F;
+    limits->framebufferStencilSampleCounts = 0x7F;
+    limits->framebufferNoAttachmentsSampleCounts = 0x7F;
+    limits->maxColorAttachments = 4;
+    limits->sampledImageColorSampleCounts = 0x7F;
+    limits->sampledImageIntegerSampleCounts = 0x7F;
+    limits->sampledImageDepthSampleCounts = 0x7F;
+    limits->sampledImageStencilSampleCounts = 0x7F;
+    limits->storageImageSampleCounts = 0x7F;
+    limits->maxSampleMaskWords = 1;
+    limits->timestampComputeAndGraphics = VK_TRUE;
+    limits->timestampPeriod = 1;
+    limits->maxClipDistances = 8;
+    limits->maxCullDistances = 8;
+    limits->maxCombinedClipAndCullDistances = 8;
+    limits->discreteQueuePriorities = 2;
+    limits->pointSizeRange[0] = 1.0f;
+    limits->pointSizeRange[1] = 64.0f;
+    limits->lineWidthRange[0] = 1.0f;
+    limits->lineWidthRange[1] = 8.0f;
+    limits->pointSizeGranularity = 1.0f;
+    limits->lineWidthGranularity = 1.0f;
+    limits->strictLines = VK_TRUE;
+    limits->standardSampleLocations = VK_TRUE;
+    limits->optimalBufferCopyOffsetAlignment = 1;
+    limits->optimalBufferCopyRowPitchAlignment = 1;
+    limits->nonCoherentAtomSize = 256;
+
+    return *limits;
+}
+
+void SetBoolArrayTrue(VkBool32* bool_array, uint32_t num_bools)
+{
+    for (uint32_t i = 0; i < num_bools; ++i) {
+        bool_array[i] = VK_TRUE;
+    }
+}
+
+static void InitDefaultProfile(PhysicalDeviceProfile* profile) {
+    memset(profile, 0, sizeof(*profile));
+    auto& properties = profile->properties;
+    properties.apiVersion = VK_API_VERSION_1_0;
+    properties.driverVersion = 1;
+    properties.vendorID = 0xba5eba11;
+    properties.deviceID = 0xf005ba11;
+    properties.deviceType = VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU;
+    strcpy(properties.deviceName, "Vulkan Mock Device");
+    properties.pipelineCacheUUID[0] = 18;
+    SetLimits(&properties.limits);
+    properties.sparseProperties = { VK_TRUE, VK_TRUE, VK_TRUE, VK_TRUE, VK_TRUE };
+
+    SetBoolArrayTrue(&profile->features.robustBufferAccess, sizeof(VkPhysicalDeviceFeatures) / sizeof(VkBool32));
+
+    auto& memory_properties = profile->memory_properties;
+    memory_properties.memoryTypeCount = 2;
+    memory_properties.memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    memory_properties.memoryTypes[0].heapIndex = 0;
+    memory_properties.memoryTypes[1].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    memory_properties.memoryTypes[1].heapIndex = 1;
+    memory_properties.memoryHeapCount = 2;
+    memory_properties.memoryHeaps[0].flags = 0;
+    memory_properties.memoryHeaps[0].size = 8000000000;
+    memory_properties.memoryHeaps[1].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+    memory_properties.memoryHeaps[1].size = 8000000000;
+
+    profile->queue_family_count = 1;
+    profile->queue_families[0].queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT | VK_QUEUE_SPARSE_BINDING_BIT;
+    profile->queue_families[0].queueCount = 1;
+    profile->queue_families[0].timestampValidBits = 64;
+    profile->queue_families[0].minImageTransferGranularity = {1,1,1};
+
+    // TODO: Just returning full support for everything initially
+    const VkFormatProperties full_support = { 0x00FFFFFF, 0x00FFFFFF, 0x00FFFFFF };
+    for (uint32_t format = VK_FORMAT_UNDEFINED + 1; format < PROFILE_CORE_FORMAT_COUNT; ++format) {
+        profile->core_formats[format] = full_support;
+    }
+    profile->unlisted_format = full_support;
+}
+
+// Just enough JSON to read device profiles
+struct JsonValue {
+    enum Type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+    Type type;
+    bool boolean;
+    // Numbers keep their text in string as well, so 64-bit integers don't lose precision going through a double
+    double number;
+    std::string string;
+    // Array elements, or object member values with their names in keys
+    std::vector<JsonValue> elements;
+    std::vector<std::string> keys;
+
+    JsonValue() : type(JSON_NULL), boolean(false), number(0.0) {}
+
+    const JsonValue* Find(const char* key) const {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (keys[i] == key) {
+                return &elements[i];
+            }
+        }
+        return nullptr;
+    }
+    uint64_t AsUint() const {
+        if (type == JSON_BOOL) {
+            return boolean ? 1 : 0;
+        }
+        if (type != JSON_NUMBER || number < 0.0) {
+            return 0;
+        }
+        if (string.find_first_of(".eE") != std::string::npos) {
+            return (uint64_t)number;
+        }
+        return strtoull(string.c_str(), nullptr, 10);
+    }
+    int64_t AsInt() const {
+        if (type != JSON_NUMBER) {
+            return (int64_t)AsUint();
+        }
+        if (string.find_first_of(".eE") != std::string::npos) {
+            return (int64_t)number;
+        }
+        return strtoll(string.c_str(), nullptr, 10);
+    }
+    double AsFloat() const { return type == JSON_NUMBER ? number : (double)AsUint(); }
+};
+
+class JsonParser {
+   public:
+    JsonParser(const char* begin, const char* end) : cur_(begin), end_(end) {}
+
+    bool Parse(JsonValue* value) {
+        if (!ParseValue(value, 0)) {
+            return false;
+        }
+        SkipWhitespace();
+        return cur_ == end_;
+    }
+
+   private:
+    static const int MAX_DEPTH = 64;
+
+    void SkipWhitespace() {
+        while (cur_ != end_ && (*cur_ == ' ' || *cur_ == '\\t' || *cur_ == '\\n' || *cur_ == '\\r')) {
+            ++cur_;
+        }
+    }
+    bool Consume(char c) {
+        SkipWhitespace();
+        if (cur_ == end_ || *cur_ != c) {
+            return false;
+        }
+        ++cur_;
+        return true;
+    }
+    bool ConsumeLiteral(const char* literal) {
+        const size_t length = strlen(literal);
+        if ((size_t)(end_ - cur_) < length || strncmp(cur_, literal, length)) {
+            return false;
+        }
+        cur_ += length;
+        return true;
+    }
+    static int HexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+    bool ParseString(std::string* string) {
+        if (!Consume('"')) {
+            return false;
+        }
+        string->clear();
+        while (cur_ != end_ && *cur_ != '"') {
+            char c = *cur_++;
+            if (c != '\\\\') {
+                string->push_back(c);
+                continue;
+            }
+            if (cur_ == end_) {
+                return false;
+            }
+            c = *cur_++;
+            switch (c) {
+                case 'b': string->push_back('\\b'); break;
+                case 'f': string->push_back('\\f'); break;
+                case 'n': string->push_back('\\n'); break;
+                case 'r': string->push_back('\\r'); break;
+                case 't': string->push_back('\\t'); break;
+                case 'u': {
+                    uint32_t code_point = 0;
+                    for (int i = 0; i < 4; ++i) {
+                        const int digit = (cur_ != end_) ? HexDigit(*cur_++) : -1;
+                        if (digit < 0) {
+                            return false;
+                        }
+                        code_point = (code_point << 4) | digit;
+                    }
+                    // Encoded as UTF-8. Surrogate pairs aren't combined, which no profile needs.
+                    if (code_point < 0x80) {
+                        string->push_back((char)code_point);
+                    } else if (code_point < 0x800) {
+                        string->push_back((char)(0xC0 | (code_point >> 6)));
+                        string->push_back((char)(0x80 | (code_point & 0x3F)));
+                    } else {
+                        string->push_back((char)(0xE0 | (code_point >> 12)));
+                        string->push_back((char)(0x80 | ((code_point >> 6) & 0x3F)));
+                        string->push_back((char)(0x80 | (code_point & 0x3F)));
+                    }
+                    break;
+                }
+                default: string->push_back(c); break;
+            }
+        }
+        if (cur_ == end_) {
+            return false;
+        }
+        ++cur_;
+        return true;
+    }
+    bool ParseNumber(JsonValue* value) {
+        const char* start = cur_;
+        while (cur_ != end_ && (isdigit((unsigned char)*cur_) || strchr("+-.eE", *cur_))) {
+            ++cur_;
+        }
+        value->string.assign(start, cur_);
+        char* number_end = nullptr;
+        value->number = strtod(value->string.c_str(), &number_end);
+        value->type = JsonValue::JSON_NUMBER;
+        return cur_ != start && number_end == value->string.c_str() + value->string.size();
+    }
+    bool ParseValue(JsonValue* value, int depth) {
+        SkipWhitespace();
+        if (cur_ == end_ || depth > MAX_DEPTH) {
+            return false;
+        }
+        switch (*cur_) {
+            case '{':
+                ++cur_;
+                value->type = JsonValue::JSON_OBJECT;
+                if (Consume('}')) {
+                    return true;
+                }
+                do {
+                    value->keys.push_back(std::string());
+                    value->elements.push_back(JsonValue());
+                    if (!ParseString(&value->keys.back()) || !Consume(':') || !ParseValue(&value->elements.back(), depth + 1)) {
+                        return false;
+                    }
+                } while (Consume(','));
+                return Consume('}');
+            case '[':
+                ++cur_;
+                value->type = JsonValue::JSON_ARRAY;
+                if (Consume(']')) {
+                    return true;
+                }
+                do {
+                    value->elements.push_back(JsonValue());
+                    if (!ParseValue(&value->elements.back(), depth + 1)) {
+                        return false;
+                    }
+                } while (Consume(','));
+                return Consume(']');
+            case '"':
+                value->type = JsonValue::JSON_STRING;
+                return ParseString(&value->string);
+            case 't':
+                value->type = JsonValue::JSON_BOOL;
+                value->boolean = true;
+                return ConsumeLiteral("true");
+            case 'f':
+                value->type = JsonValue::JSON_BOOL;
+                return ConsumeLiteral("false");
+            case 'n':
+                return ConsumeLiteral("null");
+            default:
+                return ParseNumber(value);
+        }
+    }
+
+    const char* cur_;
+    const char* end_;
+};
+
+// Stores value, or each element of an array value, into the struct member described by field
+static void ApplyProfileField(const JsonValue& value, const ProfileField& field, void* base) {
+    for (uint32_t i = 0; i < field.count; ++i) {
+        const JsonValue* element = &value;
+        if (field.count > 1) {
+            if (value.type != JsonValue::JSON_ARRAY || i >= value.elements.size()) {
+                return;
+            }
+            element = &value.elements[i];
+        }
+        char* dst = reinterpret_cast<char*>(base) + field.offset;
+        switch (field.type) {
+            case PROFILE_FIELD_UINT32: {
+                const uint32_t uint32_value = (uint32_t)element->AsUint();
+                memcpy(dst + i * sizeof(uint32_value), &uint32_value, sizeof(uint32_value));
+                break;
+            }
+            case PROFILE_FIELD_INT32: {
+                const int32_t int32_value = (int32_t)element->AsInt();
+                memcpy(dst + i * sizeof(int32_value), &int32_value, sizeof(int32_value));
+                break;
+            }
+            case PROFILE_FIELD_UINT64: {
+                const uint64_t uint64_value = element->AsUint();
+                memcpy(dst + i * sizeof(uint64_value), &uint64_value, sizeof(uint64_value));
+                break;
+            }
+            case PROFILE_FIELD_SIZE: {
+                const size_t size_value = (size_t)element->AsUint();
+                memcpy(dst + i * sizeof(size_value), &size_value, sizeof(size_value));
+                break;
+            }
+            case PROFILE_FIELD_FLOAT: {
+                const float float_value = (float)element->AsFloat();
+                memcpy(dst + i * sizeof(float_value), &float_value, sizeof(float_value));
+                break;
+            }
+        }
+    }
+}
+
+// Members the profile object doesn't mention keep their current value
+template <size_t N>
+static void ApplyProfileFields(const JsonValue* object, const ProfileField (&fields)[N], void* base) {
+    if (!object || object->type != JsonValue::JSON_OBJECT) {
+        return;
+    }
+    for (const auto& field : fields) {
+        const JsonValue* value = object->Find(field.name);
+        if (value) {
+            ApplyProfileField(*value, field, base);
+        }
+    }
+}
+
+// Returns false if the profile doesn't hold together, which leaves it partly applied
+static bool ApplyProfile(const JsonValue& root, PhysicalDeviceProfile* profile) {
+    const JsonValue* properties = root.Find("VkPhysicalDeviceProperties");
+    if (properties) {
+        ApplyProfileFields(properties, physical_device_properties_fields, &profile->properties);
+        const JsonValue* device_type = properties->Find("deviceType");
+        if (device_type) {
+            profile->properties.deviceType = (VkPhysicalDeviceType)device_type->AsUint();
+        }
+        const JsonValue* device_name = properties->Find("deviceName");
+        if (device_name && device_name->type == JsonValue::JSON_STRING) {
+            memset(profile->properties.deviceName, 0, sizeof(profile->properties.deviceName));
+            strncpy(profile->properties.deviceName, device_name->string.c_str(), sizeof(profile->properties.deviceName) - 1);
+        }
+        const JsonValue* pipeline_cache_uuid = properties->Find("pipelineCacheUUID");
+        if (pipeline_cache_uuid) {
+            for (size_t i = 0; i < std::min<size_t>(pipeline_cache_uuid->elements.size(), VK_UUID_SIZE); ++i) {
+                profile->properties.pipelineCacheUUID[i] = (uint8_t)pipeline_cache_uuid->elements[i].AsUint();
+            }
+        }
+        ApplyProfileFields(properties->Find("limits"), physical_device_limits_fields, &profile->properties.limits);
+        ApplyProfileFields(properties->Find("sparseProperties"), physical_device_sparse_properties_fields,
+                           &profile->properties.sparseProperties);
+    }
+
+    ApplyProfileFields(root.Find("VkPhysicalDeviceFeatures"), physical_device_features_fields, &profile->features);
+
+    const JsonValue* memory_properties = root.Find("VkPhysicalDeviceMemoryProperties");
+    if (memory_properties) {
+        const JsonValue* memory_heaps = memory_properties->Find("memoryHeaps");
+        if (memory_heaps && memory_heaps->type == JsonValue::JSON_ARRAY) {
+            auto& count = profile->memory_properties.memoryHeapCount;
+            count = (uint32_t)std::min<size_t>(memory_heaps->elements.size(), VK_MAX_MEMORY_HEAPS);
+            for (uint32_t i = 0; i < count; ++i) {
+                profile->memory_properties.memoryHeaps[i] = VkMemoryHeap();
+                ApplyProfileFields(&memory_heaps->elements[i], memory_heap_fields, &profile->memory_properties.memoryHeaps[i]);
+            }
+        }
+        const JsonValue* memory_types = memory_properties->Find("memoryTypes");
+        if (memory_types && memory_types->type == JsonValue::JSON_ARRAY) {
+            auto& count = profile->memory_properties.memoryTypeCount;
+            count = (uint32_t)std::min<size_t>(memory_types->elements.size(), VK_MAX_MEMORY_TYPES);
+            for (uint32_t i = 0; i < count; ++i) {
+                profile->memory_properties.memoryTypes[i] = VkMemoryType();
+                ApplyProfileFields(&memory_types->elements[i], memory_type_fields, &profile->memory_properties.memoryTypes[i]);
+            }
+        }
+        // Heap indices are used to index the heaps, and the heaps may have been replaced without the types or vice versa
+        for (uint32_t i = 0; i < profile->memory_properties.memoryTypeCount; ++i) {
+            if (profile->memory_properties.memoryTypes[i].heapIndex >= profile->memory_properties.memoryHeapCount) {
+                return false;
+            }
+        }
+    }
+
+    const JsonValue* queue_families = root.Find("ArrayOfVkQueueFamilyProperties");
+    if (queue_families && queue_families->type == JsonValue::JSON_ARRAY) {
+        profile->queue_family_count = (uint32_t)std::min<size_t>(queue_families->elements.size(), MAX_PROFILE_QUEUE_FAMILIES);
+        for (uint32_t i = 0; i < profile->queue_family_count; ++i) {
+            const JsonValue& queue_family = queue_families->elements[i];
+            profile->queue_families[i] = VkQueueFamilyProperties();
+            profile->queue_families[i].minImageTransferGranularity = {1, 1, 1};
+            ApplyProfileFields(&queue_family, queue_family_properties_fields, &profile->queue_families[i]);
+            ApplyProfileFields(queue_family.Find("minImageTransferGranularity"), extent_3d_fields,
+                               &profile->queue_families[i].minImageTransferGranularity);
+        }
+    }
+
+    const JsonValue* formats = root.Find("ArrayOfVkFormatProperties");
+    if (formats && formats->type == JsonValue::JSON_ARRAY) {
+        memset(profile->core_formats, 0, sizeof(profile->core_formats));
+        profile->extension_format_count = 0;
+        profile->unlisted_format = VkFormatProperties();
+        for (const auto& format : formats->elements) {
+            const JsonValue* format_id = format.Find("formatID");
+            if (!format_id) {
+                continue;
+            }
+            VkFormatProperties format_properties = {};
+            ApplyProfileFields(&format, format_properties_fields, &format_properties);
+            const uint64_t id = format_id->AsUint();
+            if (id < PROFILE_CORE_FORMAT_COUNT) {
+                profile->core_formats[id] = format_properties;
+            } else if (profile->extension_format_count < MAX_PROFILE_EXTENSION_FORMATS) {
+                auto& extension_format = profile->extension_formats[profile->extension_format_count++];
+                extension_format.format = (VkFormat)id;
+                extension_format.properties = format_properties;
+            }
+        }
+    }
+    return true;
+}
+
+// The cache is a header followed by the PhysicalDeviceProfile, in the layout of the process that wrote it
+static const uint32_t PROFILE_CACHE_MAGIC = 0x504D4B56;  // "VKMP"
+static const uint32_t PROFILE_CACHE_VERSION = 1;         // Bump whenever PhysicalDeviceProfile changes
+
+struct ProfileCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t profile_size;
+    uint64_t key;
+};
+
+static const size_t PROFILE_CACHE_SIZE = sizeof(ProfileCacheHeader) + sizeof(PhysicalDeviceProfile);
+
+// The key covers everything the compiled profile depends on: the JSON itself, the default profile it's applied over,
+//  which takes in settings as well as what this build of the ICD reports, and the Vulkan headers the formats come from.
+//  InitDefaultProfile() clears the whole profile first, so its padding hashes the same every time.
+static uint64_t GetProfileCacheKey(const std::vector<char>& source, const PhysicalDeviceProfile& default_profile) {
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto c : source) {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ULL;
+    }
+    const auto default_bytes = reinterpret_cast<const uint8_t*>(&default_profile);
+    for (size_t i = 0; i < sizeof(default_profile); ++i) {
+        hash ^= default_bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    const uint32_t header_version = VK_HEADER_VERSION;
+    for (size_t i = 0; i < sizeof(header_version); ++i) {
+        hash ^= (uint8_t)(header_version >> (i * 8));
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static std::string GetProfileCachePath(uint64_t key) {
+    char name[64];
+    sprintf(name, "vk_mock_profile_%016llx.bin", (unsigned long long)key);
+    std::string path = settings.device_profile_cache_dir;
+    if (!path.empty() && path.back() != '/' && path.back() != '\\\\') {
+        path += '/';
+    }
+    return path + name;
+}
+
+static bool IsValidProfileCache(const void* data, uint64_t key) {
+    const auto header = reinterpret_cast<const ProfileCacheHeader*>(data);
+    return header->magic == PROFILE_CACHE_MAGIC && header->version == PROFILE_CACHE_VERSION &&
+           header->profile_size == sizeof(PhysicalDeviceProfile) && header->key == key;
+}
+
+// A cache with the right header can still be damaged or planted, and its counts index fixed size arrays
+static bool IsValidCachedProfile(const PhysicalDeviceProfile& profile) {
+    const auto& memory_properties = profile.memory_properties;
+    if (profile.queue_family_count > MAX_PROFILE_QUEUE_FAMILIES ||
+        profile.extension_format_count > MAX_PROFILE_EXTENSION_FORMATS ||
+        memory_properties.memoryTypeCount > VK_MAX_MEMORY_TYPES || memory_properties.memoryHeapCount > VK_MAX_MEMORY_HEAPS) {
+        return false;
+    }
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
+        if (memory_properties.memoryTypes[i].heapIndex >= memory_properties.memoryHeapCount) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the cached profile for key, or null if there isn't a valid one. The cache stays mapped for the life of the process.
+static const PhysicalDeviceProfile* MapProfileCache(const std::string& path, uint64_t key) {
+#if defined(_WIN32)
+    // Small enough that reading it is as good as mapping it
+    std::vector<char> contents;
+    if (!ReadFileContents(path, &contents) || contents.size() != PROFILE_CACHE_SIZE || !IsValidProfileCache(contents.data(), key)) {
+        return nullptr;
+    }
+    auto profile = new PhysicalDeviceProfile;
+    memcpy(profile, contents.data() + sizeof(ProfileCacheHeader), sizeof(PhysicalDeviceProfile));
+    if (!IsValidCachedProfile(*profile)) {
+        delete profile;
+        return nullptr;
+    }
+    return profile;
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat file_stat;
+    void* data = MAP_FAILED;
+    // The cache directory defaults to a shared one, so only trust caches written by this user
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_uid == getuid() && (size_t)file_stat.st_size == PROFILE_CACHE_SIZE) {
+        data = mmap(nullptr, PROFILE_CACHE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    auto profile = reinterpret_cast<const PhysicalDeviceProfile*>(reinterpret_cast<const char*>(data) + sizeof(ProfileCacheHeader));
+    if (!IsValidProfileCache(data, key) || !IsValidCachedProfile(*profile)) {
+        munmap(data, PROFILE_CACHE_SIZE);
+        return nullptr;
+    }
+    return profile;
+#endif
+}
+
+static void WriteProfileCache(const std::string& path, uint64_t key, const PhysicalDeviceProfile& profile) {
+    // Written under a name of its own and then renamed, so other processes never map a partly written cache
+#if defined(_WIN32)
+    const std::string temp_path = path + "." + std::to_string(_getpid()) + ".tmp";
+#else
+    const std::string temp_path = path + "." + std::to_string(getpid()) + ".tmp";
+#endif
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    const ProfileCacheHeader header = {PROFILE_CACHE_MAGIC, PROFILE_CACHE_VERSION, sizeof(PhysicalDeviceProfile), key};
+    const bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(&profile, sizeof(profile), 1, file) == 1;
+    if (fclose(file) != 0 || !written || rename(temp_path.c_str(), path.c_str()) != 0) {
+        // Also the case on Windows when another process got its cache in place first, which is just as good
+        remove(temp_path.c_str());
+    }
+}
+
+static const PhysicalDeviceProfile* LoadPhysicalDeviceProfile(const std::string& path) {
+    auto profile = new PhysicalDeviceProfile;
+    InitDefaultProfile(profile);
+    if (path.empty()) {
+        return profile;
+    }
+    std::vector<char> source;
+    if (!ReadFileContents(path, &source)) {
+        fprintf(stderr, "vkmock: Can't read device profile %s, using the default device\\n", path.c_str());
+        return profile;
+    }
+    const uint64_t key = GetProfileCacheKey(source, *profile);
+    const std::string cache_path = GetProfileCachePath(key);
+    const PhysicalDeviceProfile* cached_profile = MapProfileCache(cache_path, key);
+    if (cached_profile) {
+        delete profile;
+        return cached_profile;
+    }
+    JsonValue root;
+    JsonParser parser(source.data(), source.data() + source.size());
+    if (!parser.Parse(&root) || root.type != JsonValue::JSON_OBJECT) {
+        fprintf(stderr, "vkmock: Can't parse device profile %s, using the default device\\n", path.c_str());
+        return profile;
+    }
+    if (!ApplyProfile(root, profile)) {
+        fprintf(stderr, "vkmock: Device profile %s has a memory type without a heap, using the default device\\n", path.c_str());
+        InitDefaultProfile(profile);
+        return profile;
+    }
+    WriteProfileCache(cache_path, key, *profile);
+    return profile;
+}
+
+// One profile per physical device, loaded on first use rather than when the ICD is loaded to keep file access out of
+//  library initialization. Devices given the same profile file share one loaded profile.
+static std::once_flag physical_device_profiles_once;
+static std::vector<const PhysicalDeviceProfile*> physical_device_profiles;
+
+static const PhysicalDeviceProfile* GetPhysicalDeviceProfileAt(uint32_t index) {
+    std::call_once(physical_device_profiles_once, [] {
+        unordered_map<std::string, const PhysicalDeviceProfile*> loaded_profiles;
+        for (uint32_t i = 0; i < settings.physical_device_count; ++i) {
+            const std::string path = (i < settings.device_profiles.size()) ? settings.device_profiles[i] : std::string();
+            auto& profile = loaded_profiles[path];
+            if (!profile) {
+                profile = LoadPhysicalDeviceProfile(path);
+            }
+            physical_device_profiles.push_back(profile);
+        }
+    });
+    return physical_device_profiles[index];
+}
+
+// Each instance has its own set of physical devices, hanging off the VkInstance handle like device state does
+struct InstanceState {
+    std::vector<VkPhysicalDevice> physical_devices;
+};
+
+struct PhysicalDeviceState {
+    uint32_t index;  // Position in vkEnumeratePhysicalDevices
+    const PhysicalDeviceProfile* profile;
+    // Bytes of VkDeviceMemory allocated from each heap by every device created from this physical device
+    std::atomic<VkDeviceSize> heap_usage[VK_MAX_MEMORY_HEAPS];
+};
+
+static InstanceState* GetInstanceState(VkInstance instance) {
+    return reinterpret_cast<InstanceState*>(reinterpret_cast<DispObj*>(instance)->state);
+}
+
+static PhysicalDeviceState* GetPhysicalDeviceState(VkPhysicalDevice physical_device) {
+    return reinterpret_cast<PhysicalDeviceState*>(reinterpret_cast<DispObj*>(physical_device)->state);
+}
+
+static const PhysicalDeviceProfile& GetPhysicalDeviceProfile(VkPhysicalDevice physical_device) {
+    return *GetPhysicalDeviceState(physical_device)->profile;
+}
+
+static VkFormatProperties GetProfileFormatProperties(const PhysicalDeviceProfile& profile, VkFormat format) {
+    if ((uint32_t)format < PROFILE_CORE_FORMAT_COUNT) {
+        return profile.core_formats[format];
+    }
+    for (uint32_t i = 0; i < profile.extension_format_count; ++i) {
+        if (profile.extension_formats[i].format == format) {
+            return profile.extension_formats[i].properties;
+        }
+    }
+    return profile.unlisted_format;
+}
+
+// Objects that are looked up on hot paths live in maps split into shards by handle, each with its own lock, so threads
+//  working on different objects rarely wait on each other. Lookups copy the value out rather than hand back a reference
+//  that would outlive the lock. Code that also holds global_lock must take it first.
+template <typename Key, typename Value>
+class ShardedMap {
+   public:
+    void Insert(const Key& key, const Value& value) {
+        Shard& shard = GetShard(key);
+        lock_guard_t lock(shard.lock);
+        shard.map[key] = value;
+    }
+    // Copies the value to *value, if it's asked for, before erasing it
+    bool Erase(const Key& key, Value* value = nullptr) {
+        Shard& shard = GetShard(key);
+        lock_guard_t lock(shard.lock);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end()) {
+            return false;
+        }
+        if (value) {
+            *value = it->second;
+        }
+        shard.map.erase(it);
+        return true;
+    }
+    bool Find(const Key& key, Value* value) {
+        Shard& shard = GetShard(key);
+        lock_guard_t lock(shard.lock);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end()) {
+            return false;
+        }
+        *value = it->second;
+        return true;
+    }
+    // Calls func on the value in place, with the shard locked
+    template <typename Func>
+    bool Update(const Key& key, Func func) {
+        Shard& shard = GetShard(key);
+        lock_guard_t lock(shard.lock);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end()) {
+            return false;
+        }
+        func(it->second);
+        return true;
+    }
+
+   private:
+    static const uint32_t SHARD_BITS = 6;
+    // Padded so neighboring shards' locks don't share a cache line
+    struct Shard {
+        mutex_t lock;
+        unordered_map<Key, Value> map;
+        char padding[64];
+    };
+
+    Shard& GetShard(const Key& key) {
+        // Handles are handed out in runs of consecutive values, so mix the bits before taking the top ones
+        const uint64_t hash = (uint64_t)std::hash<Key>()(key) * 0x9E3779B97F4A7C15ULL;
+        return shards_[hash >> (64 - SHARD_BITS)];
+    }
+
+    Shard shards_[1 << SHARD_BITS];
+};
+
+// Every VkDeviceMemory is backed by real host memory for its whole lifetime, so mapping it is just pointer arithmetic and
+//  anything written through a mapping is still there the next time it's mapped.
+static const size_t DEVICE_MEMORY_ALIGNMENT = 64;  // Matches limits.minMemoryMapAlignment
+
+struct DeviceMemoryState {
+    void* data;
+    VkDeviceSize size;
+    size_t os_pages_size;  // Non-zero if data was mapped straight from the OS rather than allocated from the heap
+    std::atomic<VkDeviceSize>* heap_usage;  // The usage counter of the heap it came from, null if it isn't counted
+    int fd;  // File the backing store is a shared mapping of, for memory that can be exported or was imported, else -1
+    bool host_pointer;  // The backing store was imported from the app, which keeps ownership of it
+};
+static ShardedMap<VkDeviceMemory, DeviceMemoryState> device_memory_map;
+
+// Heap usage is counted for each physical device, and allocations that would take a heap past its size fail the way
+//  they would on a real device. The budget is advisory: it's only reported, so apps that watch it can be tested under
+//  memory pressure.
+static bool ReserveHeapMemory(std::atomic<VkDeviceSize>* heap_usage, VkDeviceSize heap_size, VkDeviceSize size) {
+    VkDeviceSize usage = heap_usage->load();
+    do {
+        if (size > heap_size || usage > heap_size - size) {
+            return false;
+        }
+    } while (!heap_usage->compare_exchange_weak(usage, usage + size));
+    return true;
+}
+
+static void ReleaseHeapMemory(const DeviceMemoryState& memory_state) {
+    if (memory_state.heap_usage) {
+        memory_state.heap_usage->fetch_sub(memory_state.size);
+    }
+}
+
+// Frames presented so far by any swapchain, which is what the pressure budget shrinks with, so runs are repeatable
+static std::atomic<uint64_t> presented_frames(0);
+
+static VkDeviceSize GetHeapBudget(const VkMemoryHeap& heap) {
+    uint64_t percent = settings.memory_budget_percent;
+    if (settings.memory_pressure_frames) {
+        const uint64_t frames = std::min<uint64_t>(presented_frames.load(), settings.memory_pressure_frames);
+        percent -= (percent - settings.memory_pressure_percent) * frames / settings.memory_pressure_frames;
+    }
+    // Split the multiply so heap sizes near the top of the range don't overflow
+    return heap.size / 100 * percent + heap.size % 100 * percent / 100;
+}
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Fills in data and os_pages_size for a backing store of memory_state->size bytes
+static bool AllocateBackingStore(DeviceMemoryState* memory_state) {
+    const size_t size = (size_t)memory_state->size;
+    memory_state->data = nullptr;
+    memory_state->os_pages_size = 0;
+    if (size >= settings.mmap_threshold) {
+#if defined(_WIN32)
+        memory_state->data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (memory_state->data) {
+            memory_state->os_pages_size = size;
+            return true;
+        }
+#else
+        void* data = MAP_FAILED;
+        size_t os_pages_size = size;
+#if defined(MAP_HUGETLB)
+        if (settings.huge_pages) {
+            // Explicit huge pages fail up front if the pool is too small, so fall back to regular pages in that case
+            os_pages_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+            data = mmap(nullptr, os_pages_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+#endif
+        if (data == MAP_FAILED) {
+            os_pages_size = size;
+            data = mmap(nullptr, os_pages_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#if defined(MADV_HUGEPAGE)
+            if (data != MAP_FAILED && settings.huge_pages) {
+                madvise(data, os_pages_size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        if (data != MAP_FAILED) {
+            memory_state->data = data;
+            memory_state->os_pages_size = os_pages_size;
+            return true;
+        }
+#endif
+        // Fall back to the heap
+    }
+#if defined(_WIN32)
+    memory_state->data = _aligned_malloc(size, DEVICE_MEMORY_ALIGNMENT);
+#else
+    if (posix_memalign(&memory_state->data, DEVICE_MEMORY_ALIGNMENT, size) != 0) {
+        memory_state->data = nullptr;
+    }
+#endif
+    if (!memory_state->data) {
+        return false;
+    }
+    // Pages from the OS come zeroed, make heap allocations behave the same
+    memset(memory_state->data, 0, size);
+    return true;
+}
+
+static void FreeBackingStore(const DeviceMemoryState& memory_state) {
+    if (memory_state.host_pointer) {
+        return;
+    }
+    if (memory_state.os_pages_size) {
+#if defined(_WIN32)
+        VirtualFree(memory_state.data, 0, MEM_RELEASE);
+#else
+        munmap(memory_state.data, memory_state.os_pages_size);
+#endif
+    } else {
+#if defined(_WIN32)
+        _aligned_free(memory_state.data);
+#else
+        free(memory_state.data);
+#endif
+    }
+#if !defined(_WIN32)
+    if (memory_state.fd >= 0) {
+        close(memory_state.fd);
+    }
+#endif
+}
+
+// External memory is shared through files that live only as long as a descriptor or mapping of them does. The backing
+//  store of such memory is a shared mapping of the file, so every process that imports it sees the same bytes with no
+//  copies, the way the processes sharing a dma-buf would on a real device.
+static const VkDeviceSize HOST_POINTER_ALIGNMENT = 4096;
+
+#if !defined(_WIN32)
+static int CreateSharedMemoryFile(VkDeviceSize size) {
+    int fd = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+    // Called through syscall() as libc only got a wrapper for it in glibc 2.27
+    fd = (int)syscall(SYS_memfd_create, "vkmock", 0);
+#endif
+    if (fd < 0) {
+        // Without memfd, an unlinked temporary file does the same
+        char path[] = "/tmp/vkmock-XXXXXX";
+        fd = mkstemp(path);
+        if (fd >= 0) {
+            unlink(path);
+        }
+    }
+    if (fd >= 0 && ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Maps the file into memory_state, which takes ownership of fd once this succeeds
+static bool MapSharedMemoryFile(int fd, DeviceMemoryState* memory_state) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (VkDeviceSize)file_stat.st_size < memory_state->size) {
+        return false;
+    }
+    const size_t size = (size_t)memory_state->size;
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    memory_state->data = data;
+    memory_state->os_pages_size = size;
+    memory_state->fd = fd;
+    return true;
+}
+#endif
+
+// Handle types memory can be exported to and imported from on this platform
+static void GetExternalMemoryProperties(VkExternalMemoryHandleTypeFlagBits handle_type,
+                                        VkExternalMemoryProperties* properties) {
+    *properties = VkExternalMemoryProperties();
+#if !defined(_WIN32)
+    if (handle_type == VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT) {
+        properties->externalMemoryFeatures =
+            VK_EXTERNAL_MEMORY_FEATURE_EXPORTABLE_BIT | VK_EXTERNAL_MEMORY_FEATURE_IMPORTABLE_BIT;
+        properties->exportFromImportedHandleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+        properties->compatibleHandleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    }
+#endif
+#ifdef VK_EXT_external_memory_host
+    if (handle_type == VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT ||
+        handle_type == VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_MAPPED_FOREIGN_MEMORY_BIT_EXT) {
+        properties->externalMemoryFeatures = VK_EXTERNAL_MEMORY_FEATURE_IMPORTABLE_BIT;
+        properties->compatibleHandleTypes = handle_type;
+    }
+#endif /* VK_EXT_external_memory_host */
+}
+
+// Buffers and images remember how they were created so their memory requirements can be derived from it, and where
+//  they're bound so their contents can be found
+struct BufferState {
+    VkDeviceSize size;
+    VkBufferUsageFlags usage;
+    VkDeviceMemory memory;
+    VkDeviceSize memory_offset;
+};
+static ShardedMap<VkBuffer, BufferState> buffer_map;
+
+struct ImageState {
+    VkImageCreateInfo create_info;  // pNext and pQueueFamilyIndices aren't kept
+    VkDeviceMemory memory;
+    VkDeviceSize memory_offset;
+};
+static ShardedMap<VkImage, ImageState> image_map;
+
+static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return ((value + alignment - 1) / alignment) * alignment;
+}
+
+// Size in bytes of one texel block of the format, and the block's extent in texels
+struct FormatBlockInfo {
+    uint32_t size;
+    uint32_t width;
+    uint32_t height;
+};
+
+static FormatBlockInfo GetFormatBlockInfo(VkFormat format) {
+    static const uint32_t astc_block_extents[][2] = {{4, 4}, {5, 4}, {5, 5}, {6, 5}, {6, 6}, {8, 5}, {8, 6},
+                                                      {8, 8}, {10, 5}, {10, 6}, {10, 8}, {10, 10}, {12, 10}, {12, 12}};
+    if (format == VK_FORMAT_UNDEFINED) return {0, 1, 1};
+    if (format <= VK_FORMAT_R4G4_UNORM_PACK8) return {1, 1, 1};
+    if (format <= VK_FORMAT_A1R5G5B5_UNORM_PACK16) return {2, 1, 1};
+    if (format <= VK_FORMAT_R8_SRGB) return {1, 1, 1};
+    if (format <= VK_FORMAT_R8G8_SRGB) return {2, 1, 1};
+    if (format <= VK_FORMAT_B8G8R8_SRGB) return {3, 1, 1};
+    if (format <= VK_FORMAT_A2B10G10R10_SINT_PACK32) return {4, 1, 1};
+    if (format <= VK_FORMAT_R16_SFLOAT) return {2, 1, 1};
+    if (format <= VK_FORMAT_R16G16_SFLOAT) return {4, 1, 1};
+    if (format <= VK_FORMAT_R16G16B16_SFLOAT) return {6, 1, 1};
+    if (format <= VK_FORMAT_R16G16B16A16_SFLOAT) return {8, 1, 1};
+    if (format <= VK_FORMAT_R32_SFLOAT) return {4, 1, 1};
+    if (format <= VK_FORMAT_R32G32_SFLOAT) return {8, 1, 1};
+    if (format <= VK_FORMAT_R32G32B32_SFLOAT) return {12, 1, 1};
+    if (format <= VK_FORMAT_R32G32B32A32_SFLOAT) return {16, 1, 1};
+    if (format <= VK_FORMAT_R64_SFLOAT) return {8, 1, 1};
+    if (format <= VK_FORMAT_R64G64_SFLOAT) return {16, 1, 1};
+    if (format <= VK_FORMAT_R64G64B64_SFLOAT) return {24, 1, 1};
+    if (format <= VK_FORMAT_R64G64B64A64_SFLOAT) return {32, 1, 1};
+    if (format <= VK_FORMAT_E5B9G9R9_UFLOAT_PACK32) return {4, 1, 1};
+    // Depth/stencil sizes are what typical implementations use, packed formats get padded
+    if (format == VK_FORMAT_D16_UNORM) return {2, 1, 1};
+    if (format <= VK_FORMAT_D32_SFLOAT) return {4, 1, 1};
+    if (format == VK_FORMAT_S8_UINT) return {1, 1, 1};
+    if (format <= VK_FORMAT_D24_UNORM_S8_UINT) return {4, 1, 1};
+    if (format == VK_FORMAT_D32_SFLOAT_S8_UINT) return {8, 1, 1};
+    if (format <= VK_FORMAT_BC1_RGBA_SRGB_BLOCK) return {8, 4, 4};
+    if (format <= VK_FORMAT_BC3_SRGB_BLOCK) return {16, 4, 4};
+    if (format <= VK_FORMAT_BC4_SNORM_BLOCK) return {8, 4, 4};
+    if (format <= VK_FORMAT_BC7_SRGB_BLOCK) return {16, 4, 4};
+    if (format <= VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK) return {8, 4, 4};
+    if (format <= VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK) return {16, 4, 4};
+    if (format <= VK_FORMAT_EAC_R11_SNORM_BLOCK) return {8, 4, 4};
+    if (format <= VK_FORMAT_EAC_R11G11_SNORM_BLOCK) return {16, 4, 4};
+    if (format <= VK_FORMAT_ASTC_12x12_SRGB_BLOCK) {
+        const auto& extent = astc_block_extents[(format - VK_FORMAT_ASTC_4x4_UNORM_BLOCK) / 2];
+        return {16, extent[0], extent[1]};
+    }
+    // Extension formats aren't modeled, assume a generous 4 bytes per texel
+    return {4, 1, 1};
+}
+
+// Images are stored linearly whatever their tiling. Each array layer holds a whole mip chain and every mip level starts
+//  on a 16 byte boundary. Rows of texel blocks are packed tightly in optimally tiled images, whose layout the app never
+//  sees. Linearly tiled images pad their rows to VK_MOCK_LINEAR_ROW_PITCH_ALIGNMENT and start their mip levels on a
+//  multiple of it, as drivers do, and vkGetImageSubresourceLayout reports that layout.
+static VkDeviceSize GetSubresourceAlignment(const VkImageCreateInfo& create_info) {
+    return (create_info.tiling == VK_IMAGE_TILING_LINEAR) ? std::max<VkDeviceSize>(settings.linear_row_pitch_alignment, 16)
+                                                          : 16;
+}
+
+static VkDeviceSize GetSubresourceRowPitch(const VkImageCreateInfo& create_info, uint32_t mip_level) {
+    const FormatBlockInfo block = GetFormatBlockInfo(create_info.format);
+    const VkDeviceSize width = std::max(create_info.extent.width >> mip_level, 1u);
+    const VkDeviceSize row_size = (width + block.width - 1) / block.width * block.size;
+    return (create_info.tiling == VK_IMAGE_TILING_LINEAR) ? AlignUp(row_size, settings.linear_row_pitch_alignment) : row_size;
+}
+
+// Distance between the depth slices of a 3D image, or the size of one slice of any other image
+static VkDeviceSize GetSubresourceDepthPitch(const VkImageCreateInfo& create_info, uint32_t mip_level) {
+    const FormatBlockInfo block = GetFormatBlockInfo(create_info.format);
+    const VkDeviceSize height = std::max(create_info.extent.height >> mip_level, 1u);
+    return GetSubresourceRowPitch(create_info, mip_level) * ((height + block.height - 1) / block.height);
+}
+
+// Size of a single subresource, i.e. one mip level of one array layer
+static VkDeviceSize GetSubresourceSize(const VkImageCreateInfo& create_info, uint32_t mip_level) {
+    const VkDeviceSize depth = std::max(create_info.extent.depth >> mip_level, 1u);
+    return GetSubresourceDepthPitch(create_info, mip_level) * depth * std::max<uint32_t>(create_info.samples, 1);
+}
+
+static VkDeviceSize GetLayerSize(const VkImageCreateInfo& create_info) {
+    const VkDeviceSize alignment = GetSubresourceAlignment(create_info);
+    VkDeviceSize layer_size = 0;
+    for (uint32_t mip = 0; mip < std::max(create_info.mipLevels, 1u); ++mip) {
+        layer_size += AlignUp(GetSubresourceSize(create_info, mip), alignment);
+    }
+    return layer_size;
+}
+
+static VkDeviceSize GetSubresourceOffset(const VkImageCreateInfo& create_info, uint32_t mip_level, uint32_t array_layer) {
+    const VkDeviceSize alignment = GetSubresourceAlignment(create_info);
+    VkDeviceSize offset = array_layer * GetLayerSize(create_info);
+    for (uint32_t mip = 0; mip < mip_level; ++mip) {
+        offset += AlignUp(GetSubresourceSize(create_info, mip), alignment);
+    }
+    return offset;
+}
+
+// Every memory type of the device can back any buffer or image
+static uint32_t GetMemoryTypeBits(const PhysicalDeviceProfile& profile) {
+    const uint32_t type_count = profile.memory_properties.memoryTypeCount;
+    return type_count >= 32 ? ~0u : (1u << type_count) - 1;
+}
+
+static VkMemoryRequirements GetImageMemoryRequirementsFromCreateInfo(const VkImageCreateInfo& create_info,
+                                                                      const PhysicalDeviceProfile& profile) {
+    VkMemoryRequirements reqs = {};
+    // Optimally tiled images are kept bufferImageGranularity apart from anything else so they never need to alias a
+    //  linear resource's page
+    reqs.alignment = settings.image_alignment;
+    if (create_info.tiling == VK_IMAGE_TILING_OPTIMAL) {
+        reqs.alignment = std::max(reqs.alignment, profile.properties.limits.bufferImageGranularity);
+    }
+    reqs.size = AlignUp(GetLayerSize(create_info) * std::max(create_info.arrayLayers, 1u), reqs.alignment);
+    reqs.memoryTypeBits = GetMemoryTypeBits(profile);
+    return reqs;
+}
+
+// Swapchain images are tracked like the app's own images. They only get memory when the rasterizer is drawing to them.
+//  What the presentation engine does with them is tracked separately, see below.
+struct SwapchainState {
+    std::vector<VkImage> images;
+    std::vector<VkDeviceMemory> memories;
+};
+static unordered_map<VkSwapchainKHR, SwapchainState> swapchain_map;
+
+// Pipeline caches. Pipelines are keyed by a hash of everything in their create info that would go into compiling them:
+//  the code of their shader modules, entry points, specialization constants and fixed-function state. Handles are left
+//  out, so keys stay the same from one run to the next. Each cache entry holds the hashes of the pipeline's shader code
+//  as a stand-in for the compiled pipeline, and a checksum of the entry so damaged data gets dropped when it's loaded.
+//  Compiling a pipeline the cache doesn't have takes VK_MOCK_PIPELINE_COMPILE_COST_NS.
+class PipelineHasher {
+   public:
+    PipelineHasher() : hash_(14695981039346656037ULL) {}
+
+    void Add(const void* data, size_t size) {
+        // 64-bit FNV-1a
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash_ ^= bytes[i];
+            hash_ *= 1099511628211ULL;
+        }
+    }
+    template <typename T>
+    void Add(const T& value) {
+        Add(&value, sizeof(value));
+    }
+    // Only for structs without padding or pointers
+    template <typename T>
+    void AddArray(const T* values, uint32_t count) {
+        Add(count);
+        if (values) {
+            Add(values, sizeof(T) * count);
+        }
+    }
+    void AddString(const char* string) { Add(string, string ? strlen(string) + 1 : 0); }
+    uint64_t Get() const { return hash_; }
+
+   private:
+    uint64_t hash_;
+};
+
+// Hashes of the code of each shader module, guarded by global_lock
+static unordered_map<VkShaderModule, uint64_t> shader_module_map;
+
+// Must be called with global_lock held
+static void AddPipelineStage(PipelineHasher* hasher, std::vector<uint64_t>* code_hashes,
+                             const VkPipelineShaderStageCreateInfo& stage) {
+    auto module = shader_module_map.find(stage.module);
+    const uint64_t code_hash = (module != shader_module_map.end()) ? module->second : 0;
+    code_hashes->push_back(code_hash);
+    hasher->Add(stage.stage);
+    hasher->Add(code_hash);
+    hasher->AddString(stage.pName);
+    if (stage.pSpecializationInfo) {
+        hasher->AddArray(stage.pSpecializationInfo->pMapEntries, stage.pSpecializationInfo->mapEntryCount);
+        hasher->Add(stage.pSpecializationInfo->pData, stage.pSpecializationInfo->dataSize);
+    }
+}
+
+// The key of a graphics pipeline, and the code hashes of its stages. State the pipeline ignores isn't looked at, as its
+//  pointers don't have to be valid.
+static uint64_t GetGraphicsPipelineKey(const VkGraphicsPipelineCreateInfo& create_info, std::vector<uint64_t>* code_hashes) {
+    PipelineHasher hasher;
+    bool tessellation = false;
+    {
+        unique_lock_t lock(global_lock);
+        for (uint32_t i = 0; i < create_info.stageCount; ++i) {
+            AddPipelineStage(&hasher, code_hashes, create_info.pStages[i]);
+            tessellation |= (create_info.pStages[i].stage & VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT) != 0;
+        }
+    }
+    if (const auto vertex_input = create_info.pVertexInputState) {
+        hasher.AddArray(vertex_input->pVertexBindingDescriptions, vertex_input->vertexBindingDescriptionCount);
+        hasher.AddArray(vertex_input->pVertexAttributeDescriptions, vertex_input->vertexAttributeDescriptionCount);
+    }
+    if (const auto input_assembly = create_info.pInputAssemblyState) {
+        hasher.Add(input_assembly->topology);
+        hasher.Add(input_assembly->primitiveRestartEnable);
+    }
+    if (tessellation && create_info.pTessellationState) {
+        hasher.Add(create_info.pTessellationState->patchControlPoints);
+    }
+    bool dynamic_viewport = false;
+    bool dynamic_scissor = false;
+    if (const auto dynamic = create_info.pDynamicState) {
+        hasher.AddArray(dynamic->pDynamicStates, dynamic->dynamicStateCount);
+        for (uint32_t i = 0; i < dynamic->dynamicStateCount; ++i) {
+            dynamic_viewport |= dynamic->pDynamicStates[i] == VK_DYNAMIC_STATE_VIEWPORT;
+            dynamic_scissor |= dynamic->pDynamicStates[i] == VK_DYNAMIC_STATE_SCISSOR;
+        }
+    }
+    const auto rasterization = create_info.pRasterizationState;
+    if (rasterization) {
+        hasher.Add(rasterization->depthClampEnable);
+        hasher.Add(rasterization->rasterizerDiscardEnable);
+        hasher.Add(rasterization->polygonMode);
+        hasher.Add(rasterization->cullMode);
+        hasher.Add(rasterization->frontFace);
+        hasher.Add(rasterization->depthBiasEnable);
+        hasher.Add(rasterization->depthBiasConstantFactor);
+        hasher.Add(rasterization->depthBiasClamp);
+        hasher.Add(rasterization->depthBiasSlopeFactor);
+        hasher.Add(rasterization->lineWidth);
+    }
+    hasher.Add(create_info.subpass);
+    if (!rasterization || rasterization->rasterizerDiscardEnable) {
+        return hasher.Get();
+    }
+    if (const auto viewport = create_info.pViewportState) {
+        hasher.AddArray(dynamic_viewport ? nullptr : viewport->pViewports, viewport->viewportCount);
+        hasher.AddArray(dynamic_scissor ? nullptr : viewport->pScissors, viewport->scissorCount);
+    }
+    if (const auto multisample = create_info.pMultisampleState) {
+        hasher.Add(multisample->rasterizationSamples);
+        hasher.Add(multisample->sampleShadingEnable);
+        hasher.Add(multisample->minSampleShading);
+        hasher.AddArray(multisample->pSampleMask, (multisample->rasterizationSamples + 31) / 32);
+        hasher.Add(multisample->alphaToCoverageEnable);
+        hasher.Add(multisample->alphaToOneEnable);
+    }
+    if (const auto depth_stencil = create_info.pDepthStencilState) {
+        hasher.Add(depth_stencil->depthTestEnable);
+        hasher.Add(depth_stencil->depthWriteEnable);
+        hasher.Add(depth_stencil->depthCompareOp);
+        hasher.Add(depth_stencil->depthBoundsTestEnable);
+        hasher.Add(depth_stencil->stencilTestEnable);
+        hasher.Add(depth_stencil->front);
+        hasher.Add(depth_stencil->back);
+        hasher.Add(depth_stencil->minDepthBounds);
+        hasher.Add(depth_stencil->maxDepthBounds);
+    }
+    if (const auto color_blend = create_info.pColorBlendState) {
+        hasher.Add(color_blend->logicOpEnable);
+        hasher.Add(color_blend->logicOp);
+        hasher.AddArray(color_blend->pAttachments, color_blend->attachmentCount);
+        hasher.Add(color_blend->blendConstants);
+    }
+    return hasher.Get();
+}
+
+static uint64_t GetComputePipelineKey(const VkComputePipelineCreateInfo& create_info, std::vector<uint64_t>* code_hashes) {
+    PipelineHasher hasher;
+    unique_lock_t lock(global_lock);
+    AddPipelineStage(&hasher, code_hashes, create_info.stage);
+    return hasher.Get();
+}
+
+struct PipelineCacheState {
+    // Identifies the device in the header of the cache's data
+    const PhysicalDeviceProfile* profile;
+    mutex_t lock;
+    // Ordered, so the same entries always serialize the same way
+    std::map<uint64_t, std::vector<uint64_t>> entries;
+};
+static unordered_map<VkPipelineCache, PipelineCacheState*> pipeline_cache_map;
+
+// Entries follow the header in the cache's data, each with its payload of code hashes right after it
+struct PipelineCacheEntryHeader {
+    uint64_t key;
+    uint64_t checksum;
+    uint64_t code_hash_count;
+};
+
+static const size_t PIPELINE_CACHE_HEADER_SIZE = 16 + VK_UUID_SIZE;
+
+static uint64_t GetPipelineCacheEntryChecksum(uint64_t key, const uint64_t* code_hashes, uint64_t code_hash_count) {
+    PipelineHasher hasher;
+    hasher.Add(key);
+    hasher.Add(code_hashes, (size_t)(sizeof(uint64_t) * code_hash_count));
+    return hasher.Get();
+}
+
+static void WritePipelineCacheHeader(const PhysicalDeviceProfile* profile, uint8_t* data) {
+    const uint32_t header[4] = {(uint32_t)PIPELINE_CACHE_HEADER_SIZE, VK_PIPELINE_CACHE_HEADER_VERSION_ONE,
+                                profile->properties.vendorID, profile->properties.deviceID};
+    memcpy(data, header, sizeof(header));
+    memcpy(data + sizeof(header), profile->properties.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+// Data written for another device, or by another version of the ICD, is ignored like drivers do. Entries that don't
+//  fit or whose checksum doesn't match are dropped.
+static void LoadPipelineCacheData(PipelineCacheState* cache, const uint8_t* data, size_t size) {
+    if (!data || size < PIPELINE_CACHE_HEADER_SIZE) {
+        return;
+    }
+    uint8_t expected_header[PIPELINE_CACHE_HEADER_SIZE];
+    WritePipelineCacheHeader(cache->profile, expected_header);
+    if (memcmp(data, expected_header, PIPELINE_CACHE_HEADER_SIZE) != 0) {
+        return;
+    }
+    size_t offset = PIPELINE_CACHE_HEADER_SIZE;
+    while (size - offset >= sizeof(PipelineCacheEntryHeader)) {
+        PipelineCacheEntryHeader entry;
+        memcpy(&entry, data + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.code_hash_count > (size - offset) / sizeof(uint64_t)) {
+            return;
+        }
+        std::vector<uint64_t> code_hashes((size_t)entry.code_hash_count);
+        memcpy(code_hashes.data(), data + offset, code_hashes.size() * sizeof(uint64_t));
+        offset += code_hashes.size() * sizeof(uint64_t);
+        if (entry.checksum == GetPipelineCacheEntryChecksum(entry.key, code_hashes.data(), code_hashes.size())) {
+            cache->entries[entry.key] = std::move(code_hashes);
+        }
+    }
+}
+
+// Writes the header and as many whole entries as fit, returning how many bytes that took. With no data, returns the
+//  size of all of it.
+static size_t StorePipelineCacheData(PipelineCacheState* cache, uint8_t* data, size_t size, bool* complete) {
+    *complete = true;
+    if (data && size < PIPELINE_CACHE_HEADER_SIZE) {
+        *complete = false;
+        return 0;
+    }
+    if (data) {
+        WritePipelineCacheHeader(cache->profile, data);
+    }
+    size_t offset = PIPELINE_CACHE_HEADER_SIZE;
+    for (const auto& entry : cache->entries) {
+        const size_t entry_size = sizeof(PipelineCacheEntryHeader) + entry.second.size() * sizeof(uint64_t);
+        if (data) {
+            if (size - offset < entry_size) {
+                *complete = false;
+                break;
+            }
+            PipelineCacheEntryHeader header;
+            header.key = entry.first;
+            header.checksum = GetPipelineCacheEntryChecksum(entry.first, entry.second.data(), entry.second.size());
+            header.code_hash_count = entry.second.size();
+            memcpy(data + offset, &header, sizeof(header));
+            if (!entry.second.empty()) {
+                memcpy(data + offset + sizeof(header), entry.second.data(), entry.second.size() * sizeof(uint64_t));
+            }
+        }
+        offset += entry_size;
+    }
+    return offset;
+}
+
+// Looks the pipeline up in the cache, if there is one, and compiles it if it isn't there
+static void CompilePipeline(VkPipelineCache pipeline_cache, uint64_t key, std::vector<uint64_t>&& code_hashes) {
+    PipelineCacheState* cache = nullptr;
+    if (pipeline_cache != VK_NULL_HANDLE) {
+        unique_lock_t lock(global_lock);
+        auto cache_it = pipeline_cache_map.find(pipeline_cache);
+        if (cache_it != pipeline_cache_map.end()) {
+            cache = cache_it->second;
+        }
+    }
+    if (cache) {
+        lock_guard_t lock(cache->lock);
+        if (cache->entries.count(key)) {
+            pipeline_cache_hits.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    pipeline_cache_misses.fetch_add(1, std::memory_order_relaxed);
+    if (settings.pipeline_compile_cost_ns) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(settings.pipeline_compile_cost_ns));
+    }
+    if (cache) {
+        lock_guard_t lock(cache->lock);
+        cache->entries[key] = std::move(code_hashes);
+    }
+}
+
+// Fences and semaphores are signaled when the queue work they're attached to completes, events by the host or by the
+//  commands setting them as the queue walks them. All sync object state is guarded by sync_lock, and sync_cv is
+//  notified whenever anything gets signaled.
+static mutex_t sync_lock;
+static std::condition_variable sync_cv;
+
+struct FenceState {
+    bool signaled;
+};
+static unordered_map<VkFence, FenceState> fence_map;
+
+// Must be called with sync_lock held. Fences the mock doesn't track count as signaled, as nothing would signal them.
+static bool IsFenceSignaled(VkFence fence) {
+    auto fence_state = fence_map.find(fence);
+    return fence_state == fence_map.end() || fence_state->second.signaled;
+}
+
+// Must be called with sync_lock held
+static bool AreFencesSignaled(uint32_t fence_count, const VkFence* fences, bool wait_all) {
+    for (uint32_t i = 0; i < fence_count; ++i) {
+        if (IsFenceSignaled(fences[i]) != wait_all) {
+            return !wait_all;
+        }
+    }
+    return wait_all;
+}
+
+// Blocks on sync_cv until ready() holds or timeout_ns have passed, and returns whether it holds
+template <typename Predicate>
+static bool WaitForSync(unique_lock_t& lock, uint64_t timeout_ns, Predicate ready) {
+    if (timeout_ns == 0) {
+        return ready();
+    }
+    // Timeouts that would overflow the clock are as good as forever, which is what UINT64_MAX is used for
+    if (timeout_ns >= (uint64_t)INT64_MAX / 2) {
+        sync_cv.wait(lock, ready);
+        return true;
+    }
+    return sync_cv.wait_for(lock, std::chrono::nanoseconds(timeout_ns), ready);
+}
+
+struct EventState {
+    bool signaled;
+};
+static unordered_map<VkEvent, EventState> event_map;
+
+static void SetEventState(VkEvent event, bool signaled) {
+    {
+        unique_lock_t lock(sync_lock);
+        event_map[event].signaled = signaled;
+    }
+    if (signaled) {
+        sync_cv.notify_all();
+    }
+}
+
+struct SemaphoreState {
+    bool signaled;
+};
+static unordered_map<VkSemaphore, SemaphoreState> semaphore_map;
+
+static void SignalFence(VkFence fence) {
+    if (fence == VK_NULL_HANDLE) {
+        return;
+    }
+    {
+        unique_lock_t lock(sync_lock);
+        fence_map[fence].signaled = true;
+    }
+    sync_cv.notify_all();
+}
+
+static void SignalSemaphores(const std::vector<VkSemaphore>& semaphores) {
+    if (semaphores.empty()) {
+        return;
+    }
+    {
+        unique_lock_t lock(sync_lock);
+        for (auto semaphore : semaphores) {
+            semaphore_map[semaphore].signaled = true;
+        }
+    }
+    sync_cv.notify_all();
+}
+
+// Consumes the signal of each semaphore, blocking until it's there if block is set
+static void WaitSemaphores(const std::vector<VkSemaphore>& semaphores, bool block) {
+    unique_lock_t lock(sync_lock);
+    for (auto semaphore : semaphores) {
+        auto& semaphore_state = semaphore_map[semaphore];
+        if (block) {
+            sync_cv.wait(lock, [&semaphore_state] { return semaphore_state.signaled; });
+        }
+        semaphore_state.signaled = false;
+    }
+}
+
+// Simulated presentation engine. Swapchain images go back and forth between the app and the engine, which puts presented
+//  images on screen at the vertical blanks of a virtual display refreshing VK_MOCK_REFRESH_HZ times a second. The image
+//  on screen only goes back to the app once another one replaces it. FIFO_RELAXED presentation is treated as FIFO and
+//  the shared present modes as IMMEDIATE. Presentation state is guarded by present_lock, and present_cv is notified
+//  whenever an image is presented. Times are steady clock nanoseconds, as VK_GOOGLE_display_timing reports them.
+enum PresentImageState {
+    PRESENT_IMAGE_AVAILABLE,
+    PRESENT_IMAGE_ACQUIRED,
+    PRESENT_IMAGE_PRESENTED,  // Presented, but the queue hasn't got to the present yet
+    PRESENT_IMAGE_QUEUED,     // Waiting for a vertical blank
+    PRESENT_IMAGE_DISPLAYED
+};
+
+struct PresentRequest {
+    VkSwapchainKHR swapchain;
+    uint32_t image_index;
+    uint32_t present_id;
+    uint64_t desired_present_time;   // 0 if the app doesn't care
+    uint64_t queued_time;            // When the queue got to the present
+    uint64_t earliest_present_time;  // The vertical blank it could have made without its desired time, once known
+};
+
+// Presentation timings kept for vkGetPastPresentationTimingGOOGLE before the oldest are dropped
+static const size_t PRESENT_TIMING_HISTORY = 64;
+
+struct PresentEngineState {
+    VkPresentModeKHR present_mode;
+    bool retired;  // Replaced by a newer swapchain, so no more images can be acquired
+    std::vector<PresentImageState> images;
+    std::deque<uint32_t> available;  // In the order the engine let go of them
+    std::deque<PresentRequest> queued;
+    uint32_t displayed;  // UINT32_MAX until something is presented
+    uint64_t next_vblank;
+    std::deque<VkPastPresentationTimingGOOGLE> timings;
+};
+static mutex_t present_lock;
+static std::condition_variable present_cv;
+static unordered_map<VkSwapchainKHR, PresentEngineState> present_engine_map;
+
+static uint64_t GetSteadyClockNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::chrono::steady_clock::time_point GetSteadyClockTime(uint64_t ns) {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(ns)));
+}
+
+static uint64_t GetRefreshDurationNs() { return 1000000000ull / settings.refresh_hz; }
+
+// The first vertical blank at or after time
+static uint64_t GetNextVblank(uint64_t time) {
+    const uint64_t period = GetRefreshDurationNs();
+    return (time + period - 1) / period * period;
+}
+
+static void DisplayImage(PresentEngineState* engine, const PresentRequest& present, uint64_t time) {
+    if (engine->displayed != UINT32_MAX) {
+        engine->images[engine->displayed] = PRESENT_IMAGE_AVAILABLE;
+        engine->available.push_back(engine->displayed);
+    }
+    engine->displayed = present.image_index;
+    engine->images[present.image_index] = PRESENT_IMAGE_DISPLAYED;
+    VkPastPresentationTimingGOOGLE timing;
+    timing.presentID = present.present_id;
+    timing.desiredPresentTime = present.desired_present_time;
+    timing.actualPresentTime = time;
+    timing.earliestPresentTime = present.earliest_present_time ? present.earliest_present_time : time;
+    timing.presentMargin = timing.earliestPresentTime - present.queued_time;
+    if (engine->timings.size() == PRESENT_TIMING_HISTORY) {
+        engine->timings.pop_front();
+    }
+    engine->timings.push_back(timing);
+}
+
+// Puts queued images on screen, one per vertical blank, for every vertical blank up to now
+static void AdvancePresentEngine(PresentEngineState* engine, uint64_t now) {
+    while (!engine->queued.empty() && engine->next_vblank <= now) {
+        auto& present = engine->queued.front();
+        if (present.desired_present_time > engine->next_vblank) {
+            // Only its desired time keeps it off this vertical blank
+            if (!present.earliest_present_time) {
+                present.earliest_present_time = engine->next_vblank;
+            }
+            engine->next_vblank = GetNextVblank(present.desired_present_time);
+            continue;
+        }
+        DisplayImage(engine, present, engine->next_vblank);
+        engine->queued.pop_front();
+        engine->next_vblank += GetRefreshDurationNs();
+    }
+    if (engine->next_vblank <= now) {
+        // Nothing was waiting for the vertical blanks in between
+        engine->next_vblank = GetNextVblank(now + 1);
+    }
+}
+
+// Hands presented images to their swapchain's engine once the queue gets to the present
+static void PresentImages(const std::vector<PresentRequest>& presents) {
+    if (presents.empty()) {
+        return;
+    }
+    const uint64_t now = GetSteadyClockNs();
+    {
+        lock_guard_t lock(present_lock);
+        for (auto present : presents) {
+            auto engine_it = present_engine_map.find(present.swapchain);
+            if (engine_it == present_engine_map.end()) {
+                continue;
+            }
+            auto engine = &engine_it->second;
+            if (present.image_index >= engine->images.size() ||
+                engine->images[present.image_index] != PRESENT_IMAGE_PRESENTED) {
+                continue;
+            }
+            AdvancePresentEngine(engine, now);
+            present.queued_time = now;
+            switch (engine->present_mode) {
+                case VK_PRESENT_MODE_FIFO_KHR:
+                case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+                    break;
+                case VK_PRESENT_MODE_MAILBOX_KHR:
+                    // A newer image replaces the one waiting for the vertical blank, which goes straight back to the app
+                    for (const auto& replaced : engine->queued) {
+                        engine->images[replaced.image_index] = PRESENT_IMAGE_AVAILABLE;
+                        engine->available.push_back(replaced.image_index);
+                    }
+                    engine->queued.clear();
+                    break;
+                default:
+                    // No waiting for the vertical blank at all
+                    DisplayImage(engine, present, now);
+                    continue;
+            }
+            engine->images[present.image_index] = PRESENT_IMAGE_QUEUED;
+            engine->queued.push_back(present);
+        }
+    }
+    present_cv.notify_all();
+}
+
+// Queries. Each query's values are kept with its pool, guarded by query_lock, and query_cv is notified whenever queries
+//  become available or a submission leaves the simulated timeline. Timestamps are steady clock nanoseconds, matching the
+//  timestampPeriod of 1 the device reports, taken at the point of the queue's timeline where the command executes.
+//  Pipeline statistics are counted from the draws and dispatches recorded between vkCmdBeginQuery and vkCmdEndQuery.
+static const uint32_t PIPELINE_STATISTIC_COUNT = 11;
+
+struct QueryState {
+    bool available;
+    // Timestamps and occlusion results are in values[0], pipeline statistics at the index of their flag bit
+    uint64_t values[PIPELINE_STATISTIC_COUNT];
+};
+
+struct QueryPoolState {
+    VkQueryType type;
+    VkQueryPipelineStatisticFlags statistics;
+    std::vector<QueryState> queries;
+};
+static mutex_t query_lock;
+static std::condition_variable query_cv;
+static unordered_map<VkQueryPool, QueryPoolState> query_pool_map;
+// Submissions handed to a simulated queue that haven't finished yet, so waiting on a query can tell whether anything
+//  could still make it available
+static uint64_t in_flight_submissions = 0;
+
+static uint32_t GetQueryValueCount(const QueryPoolState& pool_state) {
+    if (pool_state.type != VK_QUERY_TYPE_PIPELINE_STATISTICS) {
+        return 1;
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < PIPELINE_STATISTIC_COUNT; ++i) {
+        count += (pool_state.statistics >> i) & 1;
+    }
+    return count;
+}
+
+// Must be called with query_lock held
+static bool AreQueriesAvailable(const QueryPoolState& pool_state, uint32_t first_query, uint32_t query_count) {
+    for (uint32_t i = first_query; i < first_query + query_count && i < pool_state.queries.size(); ++i) {
+        if (!pool_state.queries[i].available) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static VkDeviceSize GetQueryResultSize(const QueryPoolState& pool_state, VkQueryResultFlags flags) {
+    const VkDeviceSize value_size = (flags & VK_QUERY_RESULT_64_BIT) ? sizeof(uint64_t) : sizeof(uint32_t);
+    return value_size * (GetQueryValueCount(pool_state) + ((flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT) ? 1 : 0));
+}
+
+// Lays out query results the way vkGetQueryPoolResults and vkCmdCopyQueryPoolResults do, without writing past
+//  data_size. Returns false if any of the queries isn't available. Must be called with query_lock held.
+static bool WriteQueryResults(const QueryPoolState& pool_state, uint32_t first_query, uint32_t query_count, uint8_t* data,
+                              VkDeviceSize data_size, VkDeviceSize stride, VkQueryResultFlags flags) {
+    const uint32_t value_count = GetQueryValueCount(pool_state);
+    const VkDeviceSize value_size = (flags & VK_QUERY_RESULT_64_BIT) ? sizeof(uint64_t) : sizeof(uint32_t);
+    const VkDeviceSize result_size = GetQueryResultSize(pool_state, flags);
+    bool all_available = true;
+    for (uint32_t i = 0; i < query_count && first_query + i < pool_state.queries.size(); ++i) {
+        if (i * stride + result_size > data_size) {
+            break;
+        }
+        const auto& query = pool_state.queries[first_query + i];
+        all_available &= query.available;
+        uint64_t values[PIPELINE_STATISTIC_COUNT + 1];
+        uint32_t count = 0;
+        for (uint32_t bit = 0; bit < PIPELINE_STATISTIC_COUNT && count < value_count; ++bit) {
+            if (pool_state.type != VK_QUERY_TYPE_PIPELINE_STATISTICS || (pool_state.statistics & (1 << bit))) {
+                values[count++] = query.values[bit];
+            }
+        }
+        // Results of unavailable queries are only written for partial results, and then they're what was counted so far
+        const bool write_values = query.available || (flags & VK_QUERY_RESULT_PARTIAL_BIT);
+        if (flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT) {
+            values[count++] = query.available ? 1 : 0;
+        }
+        uint8_t* result = data + i * stride;
+        for (uint32_t j = write_values ? 0 : value_count; j < count; ++j) {
+            if (value_size == sizeof(uint64_t)) {
+                memcpy(result + j * value_size, &values[j], sizeof(uint64_t));
+            } else {
+                // Values that don't fit wrap, which keeps differences between 32 bit timestamps meaningful
+                const uint32_t value = (uint32_t)values[j];
+                memcpy(result + j * value_size, &value, sizeof(uint32_t));
+            }
+        }
+    }
+    return all_available;
+}
+
+// Simulated GPU timeline. With VK_MOCK_SIMULATE_QUEUES set, each VkQueue gets a worker thread that consumes submissions
+//  in order, waits on their semaphores, spends the time the cost model charges for them and only then signals their
+//  semaphores and fence. Otherwise submissions complete immediately inside vkQueueSubmit.
+struct DeviceState;
+// Runs the transfers and event commands in a command buffer, and its draws through the software rasterizer, see below
+static void ExecuteCommandBuffer(DeviceState* device_state, VkCommandBuffer command_buffer);
+// Writes the results of the queries a command buffer touches, see below. Its timestamps are laid out on the timeline from
+//  begin_ns by the cost of each command before them, or read from the clock as they're written if begin_ns is 0.
+static void ExecuteQueryCommands(VkCommandBuffer command_buffer, uint64_t begin_ns);
+// Simulated GPU time of the commands recorded in a command buffer, see CommandBufferState
+static uint64_t GetCommandBufferCost(VkCommandBuffer command_buffer);
+
+struct QueueSubmission {
+    std::vector<VkSemaphore> wait_semaphores;
+    std::vector<VkCommandBuffer> command_buffers;
+    std::vector<VkSemaphore> signal_semaphores;
+    VkFence fence;
+    std::vector<PresentRequest> presents;
+};
+
+struct QueueState {
+    DeviceState* device_state;
+    mutex_t lock;
+    std::condition_variable work_cv;  // Wakes the worker when work arrives or it's time to exit
+    std::condition_variable idle_cv;  // Wakes vkQueueWaitIdle when the queue drains
+    std::deque<QueueSubmission> submissions;
+    bool executing;
+    bool exit;
+    std::thread worker;
+    // When the simulated GPU finishes the work submitted so far
+    std::chrono::steady_clock::time_point busy_until;
+
+    QueueState() : device_state(nullptr), executing(false), exit(false) {}
+    ~QueueState() {
+        if (worker.joinable()) {
+            {
+                lock_guard_t queue_lock(lock);
+                exit = true;
+            }
+            work_cv.notify_all();
+            worker.join();
+        }
+    }
+};
+
+static QueueState* GetQueueState(VkQueue queue) {
+    return reinterpret_cast<QueueState*>(reinterpret_cast<DispObj*>(queue)->state);
+}
+
+static std::chrono::nanoseconds GetSubmissionCost(const QueueSubmission& submission) {
+    uint64_t cost_ns = settings.submit_cost_ns;
+    for (auto command_buffer : submission.command_buffers) {
+        cost_ns += GetCommandBufferCost(command_buffer);
+    }
+    return std::chrono::nanoseconds(cost_ns);
+}
+
+static void ExecuteSubmission(QueueState* queue_state, const QueueSubmission& submission) {
+    WaitSemaphores(submission.wait_semaphores, settings.simulate_queues);
+    // Transfers and rendering take real time on top of what the timeline charges
+    for (auto command_buffer : submission.command_buffers) {
+        ExecuteCommandBuffer(queue_state->device_state, command_buffer);
+    }
+    if (settings.simulate_queues) {
+        // Work can't start before the queue is done with earlier work, nor before it was submitted and its waits resolved
+        const auto start = std::max(queue_state->busy_until, std::chrono::steady_clock::now());
+        queue_state->busy_until = start + GetSubmissionCost(submission);
+        std::this_thread::sleep_until(queue_state->busy_until);
+        // The command buffers ran one after the other once the batch's own cost was paid
+        uint64_t begin_ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count() + settings.submit_cost_ns;
+        for (auto command_buffer : submission.command_buffers) {
+            ExecuteQueryCommands(command_buffer, begin_ns);
+            begin_ns += GetCommandBufferCost(command_buffer);
+        }
+    } else {
+        for (auto command_buffer : submission.command_buffers) {
+            ExecuteQueryCommands(command_buffer, 0);
+        }
+    }
+    SignalSemaphores(submission.signal_semaphores);
+    SignalFence(submission.fence);
+    PresentImages(submission.presents);
+}
+
+static void QueueWorker(QueueState* queue_state) {
+    unique_lock_t lock(queue_state->lock);
+    while (true) {
+        queue_state->work_cv.wait(lock, [queue_state] { return queue_state->exit || !queue_state->submissions.empty(); });
+        if (queue_state->submissions.empty()) {
+            return;
+        }
+        auto submission = std::move(queue_state->submissions.front());
+        queue_state->submissions.pop_front();
+        queue_state->executing = true;
+        lock.unlock();
+        ExecuteSubmission(queue_state, submission);
+        {
+            lock_guard_t in_flight_lock(query_lock);
+            --in_flight_submissions;
+        }
+        query_cv.notify_all();
+        lock.lock();
+        queue_state->executing = false;
+        if (queue_state->submissions.empty()) {
+            queue_state->idle_cv.notify_all();
+        }
+    }
+}
+
+static void SubmitToQueue(VkQueue queue, QueueSubmission&& submission) {
+    auto queue_state = GetQueueState(queue);
+    if (!settings.simulate_queues) {
+        ExecuteSubmission(queue_state, submission);
+        return;
+    }
+    {
+        // Counted before the worker can see it, so it can't be counted out first
+        lock_guard_t lock(query_lock);
+        ++in_flight_submissions;
+    }
+    {
+        lock_guard_t lock(queue_state->lock);
+        if (!queue_state->worker.joinable()) {
+            // Workers are only started for queues that actually get used
+            queue_state->worker = std::thread(QueueWorker, queue_state);
+        }
+        queue_state->submissions.push_back(std::move(submission));
+    }
+    queue_state->work_cv.notify_one();
+}
+
+static void WaitQueueIdle(VkQueue queue) {
+    auto queue_state = GetQueueState(queue);
+    unique_lock_t lock(queue_state->lock);
+    queue_state->idle_cv.wait(lock, [queue_state] { return queue_state->submissions.empty() && !queue_state->executing; });
+}
+
+class WorkerPool;
+
+// Per-device state hangs off the VkDevice handle itself, so devices don't share any state or locks
+struct DeviceState {
+    // The physical device the device was created from, and its profile
+    PhysicalDeviceState* physical_device_state;
+    const PhysicalDeviceProfile* profile;
+    // Queues and command buffers are allocated from a pool owned by their device
+    DispObjPool* disp_obj_pool;
+    // Queues requested at device creation, laid out family after family. queue_family_offsets[family] is the index of
+    //  the family's first queue in queues.
+    std::vector<VkQueue> queues;
+    std::vector<uint32_t> queue_family_offsets;
+    std::vector<uint32_t> queue_family_counts;
+    // Queues handed out for family/index pairs that weren't requested at device creation
+    mutex_t extra_queue_lock;
+    unordered_map<uint64_t, VkQueue> extra_queues;
+    // Threads the software rasterizer draws with and large transfers are split over
+    WorkerPool* worker_pool;
+};
+
+static DeviceState* GetDeviceState(VkDevice device) {
+    return reinterpret_cast<DeviceState*>(reinterpret_cast<DispObj*>(device)->state);
+}
+
+static VkQueue CreateQueue(DeviceState* device_state) {
+    auto queue = reinterpret_cast<DispObj*>(CreateDispObjHandle(device_state->disp_obj_pool));
+    auto queue_state = new QueueState;
+    queue_state->device_state = device_state;
+    queue->state = queue_state;
+    return reinterpret_cast<VkQueue>(queue);
+}
+
+// Calls func on every queue the device has handed out
+template <typename Func>
+static void ForEachDeviceQueue(DeviceState* device_state, Func func) {
+    for (auto queue : device_state->queues) {
+        func(queue);
+    }
+    lock_guard_t lock(device_state->extra_queue_lock);
+    for (const auto& extra_queue : device_state->extra_queues) {
+        func(extra_queue.second);
+    }
+}
+
+// Command recording. Every vkCmd* call appends a packet to its command buffer: a CommandHeader followed by the call's
+//  parameters in API order, with the arrays and structs they point to copied in so the packet stands on its own. What
+//  the copied structs point to comes after the last parameter, so readers can take the parameters in order.
+//  Packets live in chunks owned by the command buffer's pool. Resetting a command buffer or its pool hands the chunks
+//  back to the pool for the next recording instead of freeing them.
+static const size_t COMMAND_CHUNK_SIZE = 64 * 1024;
+static const size_t COMMAND_ALIGNMENT = 8;
+
+struct CommandChunk {
+    size_t capacity;
+    size_t used;
+
+    // Packet data follows the chunk header
+    uint8_t* Data() { return reinterpret_cast<uint8_t*>(this + 1); }
+    const uint8_t* Data() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+};
+
+// A command pool and all its command buffers are externally synchronized, so none of this needs a lock
+struct CommandPoolState {
+    std::vector<CommandChunk*> free_chunks;
+    std::vector<VkCommandBuffer> command_buffers;
+
+    ~CommandPoolState() {
+        for (auto chunk : free_chunks) {
+            free(chunk);
+        }
+    }
+    // Returns a chunk that can hold at least size bytes, or null if out of memory
+    CommandChunk* TakeChunk(size_t size) {
+        CommandChunk* chunk = nullptr;
+        if (size <= COMMAND_CHUNK_SIZE && !free_chunks.empty()) {
+            chunk = free_chunks.back();
+            free_chunks.pop_back();
+        } else {
+            const size_t capacity = std::max(size, COMMAND_CHUNK_SIZE);
+            chunk = reinterpret_cast<CommandChunk*>(malloc(sizeof(CommandChunk) + capacity));
+            if (!chunk) {
+                return nullptr;
+            }
+            chunk->capacity = capacity;
+        }
+        chunk->used = 0;
+        return chunk;
+    }
+    void GiveChunk(CommandChunk* chunk) {
+        // Oversized chunks were made for one big command, so they aren't worth keeping around
+        if (chunk->capacity == COMMAND_CHUNK_SIZE) {
+            free_chunks.push_back(chunk);
+        } else {
+            free(chunk);
+        }
+    }
+    void Trim() {
+        for (auto chunk : free_chunks) {
+            free(chunk);
+        }
+        free_chunks.clear();
+    }
+};
+static ShardedMap<VkCommandPool, CommandPoolState*> command_pool_map;
+
+struct CommandBufferState {
+    CommandPoolState* pool;
+    std::vector<CommandChunk*> chunks;
+    // Simulated GPU time of the commands, including the secondary command buffers they execute
+    uint64_t cost_ns;
+    // Set if a chunk couldn't be allocated, which vkEndCommandBuffer reports
+    bool out_of_memory;
+    // Set if the commands touch queries, directly or in the secondary command buffers they execute, so submitting them
+    //  has to walk them
+    bool has_queries;
+    // Likewise for transfers, which are executed even when the rasterizer isn't, and for event commands
+    bool has_transfers;
+    bool has_events;
+
+    void Reset() {
+        for (auto chunk : chunks) {
+            pool->GiveChunk(chunk);
+        }
+        chunks.clear();
+        cost_ns = 0;
+        out_of_memory = false;
+        has_queries = false;
+        has_transfers = false;
+        has_events = false;
+    }
+};
+
+static CommandBufferState* GetCommandBufferState(VkCommandBuffer command_buffer) {
+    return reinterpret_cast<CommandBufferState*>(reinterpret_cast<DispObj*>(command_buffer)->state);
+}
+
+static uint64_t GetCommandBufferCost(VkCommandBuffer command_buffer) { return GetCommandBufferState(command_buffer)->cost_ns; }
+
+struct CommandHeader {
+    EntrypointId id;
+    // Where the packet ends, so readers can skip parameters they don't need
+    uint32_t end_chunk;
+    uint64_t end_offset;
+};
+
+// Packets are made of items: the header, then each parameter value and each array. An item that doesn't fit in what's
+//  left of the current chunk starts the next one, and readers apply the same rule, so items never straddle chunks and
+//  pointers fixed up to point at copied arrays stay valid for as long as the recording.
+static size_t GetCommandItemSize(size_t size) { return (size + COMMAND_ALIGNMENT - 1) & ~(COMMAND_ALIGNMENT - 1); }
+
+class CommandWriter {
+   public:
+    CommandWriter(VkCommandBuffer command_buffer, EntrypointId id)
+        : state_(GetCommandBufferState(command_buffer)), header_(Allocate<CommandHeader>(1)) {
+        if (header_) {
+            header_->id = id;
+        }
+    }
+    ~CommandWriter() {
+        if (header_ && !state_->out_of_memory) {
+            header_->end_chunk = (uint32_t)(state_->chunks.size() - 1);
+            header_->end_offset = state_->chunks.back()->used;
+            state_->cost_ns += settings.command_costs_ns[header_->id];
+        }
+    }
+
+    template <typename T>
+    void Write(const T& value) {
+        T* copy = Allocate<T>(1);
+        if (copy) {
+            memcpy(copy, &value, sizeof(T));
+        }
+    }
+    // Writes the element count followed by the elements, and returns the copy so pointers inside it can be fixed up
+    template <typename T>
+    T* WriteArray(const T* values, uint64_t count) {
+        if (!values) {
+            count = 0;
+        }
+        Write(count);
+        T* copy = count ? Allocate<T>(count) : nullptr;
+        if (copy) {
+            memcpy(copy, values, (size_t)(sizeof(T) * count));
+        }
+        return copy;
+    }
+    const char* WriteString(const char* string) { return WriteArray(string, string ? strlen(string) + 1 : 0); }
+    void SetHasQueries() { state_->has_queries = true; }
+    void SetHasTransfers() { state_->has_transfers = true; }
+    void SetHasEvents() { state_->has_events = true; }
+    void AddCost(uint64_t ns) { state_->cost_ns += ns; }
+
+   private:
+    template <typename T>
+    T* Allocate(uint64_t count) {
+        if (state_->out_of_memory) {
+            return nullptr;
+        }
+        const size_t size = GetCommandItemSize((size_t)(sizeof(T) * count));
+        CommandChunk* chunk = state_->chunks.empty() ? nullptr : state_->chunks.back();
+        if (!chunk || chunk->used + size > chunk->capacity) {
+            chunk = state_->pool->TakeChunk(size);
+            if (!chunk) {
+                state_->out_of_memory = true;
+                return nullptr;
+            }
+            state_->chunks.push_back(chunk);
+        }
+        T* data = reinterpret_cast<T*>(chunk->Data() + chunk->used);
+        chunk->used += size;
+        return data;
+    }
+
+    CommandBufferState* state_;
+    CommandHeader* header_;
+};
+
+// Walks the packets recorded in a command buffer. Next() moves to the following packet and reports which command it
+//  holds; parameters are then read back in API order, and any left unread are skipped by the next call to Next().
+class CommandReader {
+   public:
+    explicit CommandReader(const CommandBufferState* state)
+        : state_(state), chunk_(0), offset_(0), next_chunk_(0), next_offset_(0) {}
+
+    bool Next(EntrypointId* id) {
+        chunk_ = next_chunk_;
+        offset_ = next_offset_;
+        const CommandHeader* header = ReadItems<CommandHeader>(1);
+        if (!header) {
+            return false;
+        }
+        *id = header->id;
+        next_chunk_ = header->end_chunk;
+        next_offset_ = header->end_offset;
+        return true;
+    }
+    template <typename T>
+    T Read() {
+        const T* value = ReadItems<T>(1);
+        return value ? *value : T();
+    }
+    // Returns null for empty arrays
+    template <typename T>
+    const T* ReadArray(uint64_t* count) {
+        *count = Read<uint64_t>();
+        return *count ? ReadItems<T>(*count) : nullptr;
+    }
+    const char* ReadString() {
+        uint64_t size;
+        return ReadArray<char>(&size);
+    }
+
+   private:
+    template <typename T>
+    const T* ReadItems(uint64_t count) {
+        const size_t size = GetCommandItemSize((size_t)(sizeof(T) * count));
+        if (chunk_ < state_->chunks.size() && offset_ + size > state_->chunks[chunk_]->used) {
+            ++chunk_;
+            offset_ = 0;
+        }
+        if (chunk_ >= state_->chunks.size()) {
+            return nullptr;
+        }
+        const T* data = reinterpret_cast<const T*>(state_->chunks[chunk_]->Data() + offset_);
+        offset_ += size;
+        return data;
+    }
+
+    const CommandBufferState* state_;
+    size_t chunk_;
+    uint64_t offset_;
+    size_t next_chunk_;
+    uint64_t next_offset_;
+};
+
+// API trace capture. With VK_MOCK_TRACE_FILE set, every call the app makes is written to a binary trace that
+//  mock_icd_replay can play back against this or any other ICD. Calls are serialized much like recorded commands, see
+//  TraceFileHeader for the layout. Each thread packs its calls into chunks of its own and only takes trace_lock to append
+//  a chunk to the file once it's full, so tracing doesn't serialize threads on every call. Chunks go out in the order
+//  they were filled, and the sequence number each packet gets as its call starts puts the calls of all threads back in
+//  order for replay. The trace is complete once vkDestroyInstance returns or the process exits.
+struct TraceThread {
+    uint32_t index;
+    // Chunks started so far, the current one included
+    uint32_t chunk_count;
+    CommandChunk* chunk;
+    // Full chunks holding part of the packet being written, which go out once it's finished
+    std::vector<CommandChunk*> full_chunks;
+    std::vector<CommandChunk*> free_chunks;
+    // Intercepts called from other intercepts aren't traced
+    uint32_t depth;
+    // Set if a chunk couldn't be allocated, after which the thread's calls are left out
+    bool out_of_memory;
+};
+
+// trace_lock guards the file and the list of threads
+static mutex_t trace_lock;
+static FILE* trace_file = nullptr;
+static std::vector<TraceThread*> trace_threads;
+static std::atomic<uint64_t> trace_sequence(0);
+static MOCK_THREAD_LOCAL TraceThread* thread_trace = nullptr;
+
+// The file is opened by the first vkCreateInstance rather than when the ICD is loaded, to keep file access out of
+//  library initialization. Calls made before it, such as instance extension queries, aren't traced.
+static std::once_flag trace_file_once;
+static std::atomic<bool> trace_enabled(false);
+
+static void OpenTraceFile() {
+    trace_file = fopen(settings.trace_file.c_str(), "wb");
+    if (!trace_file) {
+        return;
+    }
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FILE_VERSION;
+    header.pointer_size = sizeof(void*);
+    header.entrypoint_count = ENTRYPOINT_ID_COUNT;
+    header.entrypoint_name_hash = GetEntrypointNameHash();
+    fwrite(&header, sizeof(header), 1, trace_file);
+    trace_enabled.store(true, std::memory_order_release);
+}
+
+static TraceThread* GetTraceThread() {
+    if (!thread_trace) {
+        thread_trace = new TraceThread();
+        lock_guard_t lock(trace_lock);
+        thread_trace->index = (uint32_t)trace_threads.size();
+        trace_threads.push_back(thread_trace);
+    }
+    return thread_trace;
+}
+
+// Called with trace_lock held
+static void WriteTraceChunk(TraceThread* thread, CommandChunk* chunk) {
+    if (trace_file) {
+        TraceBlockHeader block = {thread->index, (uint32_t)chunk->used};
+        fwrite(&block, sizeof(block), 1, trace_file);
+        fwrite(chunk->Data(), 1, chunk->used, trace_file);
+    }
+    // Oversized chunks were made for one big item, so they aren't worth keeping around
+    if (chunk->capacity == TRACE_CHUNK_SIZE) {
+        thread->free_chunks.push_back(chunk);
+    } else {
+        free(chunk);
+    }
+}
+
+// Writes out the chunks the last packet filled, and with close set the one it ended in too
+static void FlushTraceThread(TraceThread* thread, bool close) {
+    if (thread->full_chunks.empty() && !(close && thread->chunk)) {
+        return;
+    }
+    lock_guard_t lock(trace_lock);
+    for (auto chunk : thread->full_chunks) {
+        WriteTraceChunk(thread, chunk);
+    }
+    thread->full_chunks.clear();
+    if (close && thread->chunk) {
+        WriteTraceChunk(thread, thread->chunk);
+        thread->chunk = nullptr;
+        fflush(trace_file);
+    }
+}
+
+// Writes out what every thread has traced when the process exits. Threads still inside a call lose it.
+struct TraceFileCloser {
+    ~TraceFileCloser() {
+        if (!trace_file) {
+            return;
+        }
+        std::vector<TraceThread*> threads;
+        {
+            lock_guard_t lock(trace_lock);
+            threads = trace_threads;
+        }
+        for (auto thread : threads) {
+            if (!thread->depth && !thread->out_of_memory) {
+                FlushTraceThread(thread, true);
+            }
+        }
+        lock_guard_t lock(trace_lock);
+        fclose(trace_file);
+        trace_file = nullptr;
+    }
+};
+static TraceFileCloser trace_file_closer;
+
+// Every intercept but the proc address queries opens a TraceWriter after its EntrypointScope, and writes its parameters
+//  through it when Tracing() is set. Handles the call returns are written as it does.
+class TraceWriter {
+   public:
+    explicit TraceWriter(EntrypointId id)
+        : thread_(nullptr), header_(nullptr), output_handles_(nullptr), output_handle_size_(0), output_count_(0),
+          output_count_pointer_(nullptr) {
+        if (id == ENTRYPOINT_ID_vkCreateInstance && !settings.trace_file.empty()) {
+            std::call_once(trace_file_once, OpenTraceFile);
+        }
+        if (!trace_enabled.load(std::memory_order_acquire)) {
+            return;
+        }
+        thread_ = GetTraceThread();
+        if (thread_->depth++ != 0 || thread_->out_of_memory) {
+            return;
+        }
+        header_ = Allocate<TracePacketHeader>(1);
+        if (header_) {
+            header_->id = id;
+            header_->sequence = trace_sequence.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    ~TraceWriter() {
+        if (!thread_) {
+            return;
+        }
+        if (header_ && !thread_->out_of_memory) {
+            WriteOutputHandles();
+        }
+        if (header_ && !thread_->out_of_memory) {
+            header_->end_chunk = thread_->chunk_count - 1;
+            header_->end_offset = thread_->chunk->used;
+            // Apps often exit without unloading the ICD, so the trace is written out as their instance goes away
+            FlushTraceThread(thread_, header_->id == ENTRYPOINT_ID_vkDestroyInstance);
+        }
+        --thread_->depth;
+    }
+
+    bool Tracing() const { return header_ != nullptr; }
+
+    template <typename T>
+    void Write(const T& value) {
+        T* copy = Allocate<T>(1);
+        if (copy) {
+            memcpy(copy, &value, sizeof(T));
+        }
+    }
+    // Writes the element count followed by the elements
+    template <typename T>
+    void WriteArray(const T* values, uint64_t count) {
+        if (!values) {
+            count = 0;
+        }
+        Write(count);
+        T* copy = count ? Allocate<T>(count) : nullptr;
+        if (copy) {
+            memcpy(copy, values, (size_t)(sizeof(T) * count));
+        }
+    }
+    void WriteString(const char* string) { WriteArray(string, string ? strlen(string) + 1 : 0); }
+    void WriteStringArray(const char* const* strings, uint64_t count) {
+        if (!strings) {
+            count = 0;
+        }
+        Write(count);
+        for (uint64_t i = 0; i < count; ++i) {
+            WriteString(strings[i]);
+        }
+    }
+    // Only the size of what the call writes to is traced, so the replayer can give it somewhere to write. Null outputs
+    //  are written as UINT64_MAX.
+    void WriteOutput(const void* values, uint64_t count) { Write<uint64_t>(values ? count : UINT64_MAX); }
+    // The handles are read as the call returns, along with the count if it's returned through a pointer
+    template <typename T>
+    void SetOutputHandles(T* handles, uint64_t count) {
+        output_handles_ = handles;
+        output_handle_size_ = sizeof(T);
+        output_count_ = count;
+    }
+    template <typename T>
+    void SetOutputHandles(T* handles, const uint32_t* count) {
+        SetOutputHandles(handles, (uint64_t)0);
+        output_count_pointer_ = count;
+    }
+
+   private:
+    template <typename T>
+    T* Allocate(uint64_t count) {
+        if (thread_->out_of_memory) {
+            return nullptr;
+        }
+        const size_t size = GetTraceItemSize((size_t)(sizeof(T) * count));
+        CommandChunk* chunk = thread_->chunk;
+        if (!chunk || chunk->used + size > chunk->capacity) {
+            if (size <= TRACE_CHUNK_SIZE && !thread_->free_chunks.empty()) {
+                chunk = thread_->free_chunks.back();
+                thread_->free_chunks.pop_back();
+            } else {
+                const size_t capacity = std::max(size, TRACE_CHUNK_SIZE);
+                chunk = reinterpret_cast<CommandChunk*>(malloc(sizeof(CommandChunk) + capacity));
+                if (!chunk) {
+                    thread_->out_of_memory = true;
+                    return nullptr;
+                }
+                chunk->capacity = capacity;
+            }
+            chunk->used = 0;
+            if (thread_->chunk) {
+                thread_->full_chunks.push_back(thread_->chunk);
+            }
+            thread_->chunk = chunk;
+            ++thread_->chunk_count;
+        }
+        T* data = reinterpret_cast<T*>(chunk->Data() + chunk->used);
+        chunk->used += size;
+        return data;
+    }
+    // Handles are written as 64-bit values whatever their size
+    void WriteOutputHandles() {
+        if (!output_handle_size_) {
+            return;
+        }
+        const uint64_t count = !output_handles_ ? 0 : output_count_pointer_ ? *output_count_pointer_ : output_count_;
+        Write(count);
+        uint64_t* values = count ? Allocate<uint64_t>(count) : nullptr;
+        for (uint64_t i = 0; values && i < count; ++i) {
+            values[i] = 0;
+            memcpy(&values[i], static_cast<const uint8_t*>(output_handles_) + i * output_handle_size_, output_handle_size_);
+        }
+    }
+
+    TraceThread* thread_;
+    TracePacketHeader* header_;
+    const void* output_handles_;
+    size_t output_handle_size_;
+    uint64_t output_count_;
+    const uint32_t* output_count_pointer_;
+};
+
+// Software rasterizer. When VK_MOCK_RASTERIZER is set, command buffers are executed as they're submitted, and draws that
+//  follow the contract of the cube demo's shaders are rendered into the memory bound to the framebuffer's images. The
+//  contract is a vertex shader pulling its vertices from a uniform buffer at set 0 binding 0 laid out as
+//      mat4 mvp; vec4 position[N]; vec4 attr[N];
+//  that outputs mvp * position[gl_VertexIndex], and a fragment shader that samples the combined image sampler at set 0
+//  binding 1 at attr[gl_VertexIndex].xy and lights the result by the face normal. Shader code isn't looked at, and
+//  whatever the executor doesn't understand is skipped.
+//
+//  Objects the rasterizer needs to know about are only tracked while it's enabled. Image views and samplers are kept in
+//  sharded maps like buffers and images, the rest is guarded by global_lock.
+struct ImageViewState {
+    VkImage image;
+    VkFormat format;
+    uint32_t base_mip_level;
+    uint32_t base_array_layer;
+};
+static ShardedMap<VkImageView, ImageViewState> image_view_map;
+
+struct SamplerState {
+    VkFilter filter;  // Only base mip levels are sampled, so there's no telling magnification from minification
+    VkSamplerAddressMode address_mode_u;
+    VkSamplerAddressMode address_mode_v;
+};
+static ShardedMap<VkSampler, SamplerState> sampler_map;
+
+// Only the first subpass of a render pass is drawn
+struct RenderPassState {
+    std::vector<VkAttachmentDescription> attachments;
+    uint32_t color_attachment;  // VK_ATTACHMENT_UNUSED if the subpass has none
+    uint32_t depth_attachment;
+};
+static unordered_map<VkRenderPass, RenderPassState> render_pass_map;
+
+struct FramebufferState {
+    std::vector<VkImageView> attachments;
+    uint32_t width;
+    uint32_t height;
+};
+static unordered_map<VkFramebuffer, FramebufferState> framebuffer_map;
+
+// Only the first array element of each binding is tracked
+struct DescriptorState {
+    VkDescriptorType type;
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    VkDeviceSize range;
+    VkImageView image_view;
+    VkSampler sampler;
+};
+
+struct DescriptorSetState {
+    VkDescriptorPool pool;
+    unordered_map<uint32_t, DescriptorState> bindings;
+};
+static unordered_map<VkDescriptorSet, DescriptorSetState> descriptor_set_map;
+
+static void ForgetDescriptorPoolSets(VkDescriptorPool pool) {
+    for (auto set = descriptor_set_map.begin(); set != descriptor_set_map.end();) {
+        if (set->second.pool == pool) {
+            set = descriptor_set_map.erase(set);
+        } else {
+            ++set;
+        }
+    }
+}
+
+struct GraphicsPipelineState {
+    bool drawable;  // Whether the pipeline fits the rasterizer's contract at all
+    VkCullModeFlags cull_mode;
+    VkFrontFace front_face;
+    bool depth_test;
+    bool depth_write;
+    VkCompareOp depth_compare_op;
+    bool dynamic_viewport;
+    bool dynamic_scissor;
+    VkViewport viewport;
+    VkRect2D scissor;
+};
+static unordered_map<VkPipeline, GraphicsPipelineState> pipeline_map;
+
+static GraphicsPipelineState GetGraphicsPipelineState(const VkGraphicsPipelineCreateInfo& create_info) {
+    GraphicsPipelineState state = {};
+    const auto vertex_input = create_info.pVertexInputState;
+    const auto input_assembly = create_info.pInputAssemblyState;
+    const auto rasterization = create_info.pRasterizationState;
+    const auto multisample = create_info.pMultisampleState;
+    // Vertices are pulled from the uniform buffer, so there must not be any vertex input
+    state.drawable = create_info.stageCount == 2 && vertex_input && !vertex_input->vertexBindingDescriptionCount &&
+                     !vertex_input->vertexAttributeDescriptionCount && input_assembly &&
+                     input_assembly->topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST && rasterization &&
+                     !rasterization->rasterizerDiscardEnable && rasterization->polygonMode == VK_POLYGON_MODE_FILL &&
+                     (!multisample || multisample->rasterizationSamples == VK_SAMPLE_COUNT_1_BIT);
+    for (uint32_t i = 0; state.drawable && i < create_info.stageCount; ++i) {
+        const auto stage = create_info.pStages[i].stage;
+        state.drawable = stage == VK_SHADER_STAGE_VERTEX_BIT || stage == VK_SHADER_STAGE_FRAGMENT_BIT;
+    }
+    const auto color_blend = create_info.pColorBlendState;
+    for (uint32_t i = 0; state.drawable && color_blend && i < color_blend->attachmentCount; ++i) {
+        state.drawable = !color_blend->pAttachments[i].blendEnable;
+    }
+    if (!state.drawable) {
+        return state;
+    }
+    state.cull_mode = rasterization->cullMode;
+    state.front_face = rasterization->frontFace;
+    if (create_info.pDepthStencilState) {
+        state.depth_test = create_info.pDepthStencilState->depthTestEnable != VK_FALSE;
+        state.depth_write = state.depth_test && create_info.pDepthStencilState->depthWriteEnable;
+        state.depth_compare_op = create_info.pDepthStencilState->depthCompareOp;
+    }
+    if (create_info.pDynamicState) {
+        for (uint32_t i = 0; i < create_info.pDynamicState->dynamicStateCount; ++i) {
+            state.dynamic_viewport |= create_info.pDynamicState->pDynamicStates[i] == VK_DYNAMIC_STATE_VIEWPORT;
+            state.dynamic_scissor |= create_info.pDynamicState->pDynamicStates[i] == VK_DYNAMIC_STATE_SCISSOR;
+        }
+    }
+    const auto viewport_state = create_info.pViewportState;
+    if (viewport_state && !state.dynamic_viewport && viewport_state->viewportCount && viewport_state->pViewports) {
+        state.viewport = viewport_state->pViewports[0];
+    }
+    if (viewport_state && !state.dynamic_scissor && viewport_state->scissorCount && viewport_state->pScissors) {
+        state.scissor = viewport_state->pScissors[0];
+    }
+    return state;
+}
+
+// An image subresource resolved to the host memory backing it
+struct RasterImage {
+    uint8_t* data;  // First texel of the subresource
+    VkFormat format;
+    uint32_t width;
+    uint32_t height;
+    VkDeviceSize row_pitch;
+    uint32_t texel_size;
+};
+
+static bool GetRasterImage(VkImageView image_view, RasterImage* raster_image) {
+    ImageViewState view;
+    ImageState image;
+    DeviceMemoryState memory;
+    if (!image_view_map.Find(image_view, &view) || !image_map.Find(view.image, &image) ||
+        !device_memory_map.Find(image.memory, &memory)) {
+        return false;
+    }
+    const auto& create_info = image.create_info;
+    const uint32_t mip = view.base_mip_level;
+    const uint32_t layer = view.base_array_layer;
+    if (mip >= create_info.mipLevels || layer >= create_info.arrayLayers) {
+        return false;
+    }
+    raster_image->format = view.format;
+    raster_image->width = std::max(create_info.extent.width >> mip, 1u);
+    raster_image->height = std::max(create_info.extent.height >> mip, 1u);
+    raster_image->row_pitch = GetSubresourceRowPitch(create_info, mip);
+    raster_image->texel_size = GetFormatBlockInfo(create_info.format).size;
+    const VkDeviceSize offset = image.memory_offset + GetSubresourceOffset(create_info, mip, layer);
+    if (offset + raster_image->row_pitch * raster_image->height > memory.size) {
+        return false;
+    }
+    raster_image->data = static_cast<uint8_t*>(memory.data) + offset;
+    return true;
+}
+
+static uint8_t* GetBufferData(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size) {
+    BufferState buffer_state;
+    DeviceMemoryState memory;
+    if (!buffer_map.Find(buffer, &buffer_state) || !device_memory_map.Find(buffer_state.memory, &memory) ||
+        size > buffer_state.size || offset > buffer_state.size - size ||
+        buffer_state.memory_offset + offset + size > memory.size) {
+        return nullptr;
+    }
+    return static_cast<uint8_t*>(memory.data) + buffer_state.memory_offset + offset;
+}
+
+// Color attachments and textures can be 8 bit RGBA or BGRA. Depth attachments can be any depth format, but stencil
+//  isn't modeled.
+static bool IsRasterColorFormat(VkFormat format) {
+    return format == VK_FORMAT_R8G8B8A8_UNORM || format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_B8G8R8A8_UNORM ||
+           format == VK_FORMAT_B8G8R8A8_SRGB;
+}
+
+static bool IsRasterDepthFormat(VkFormat format) {
+    return format == VK_FORMAT_D16_UNORM || format == VK_FORMAT_X8_D24_UNORM_PACK32 || format == VK_FORMAT_D32_SFLOAT ||
+           format == VK_FORMAT_D16_UNORM_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT ||
+           format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+}
+
+struct SrgbTables {
+    float decode[256];     // sRGB byte to linear
+    uint8_t encode[4096];  // Linear value scaled to 0..4095 to sRGB byte
+};
+static SrgbTables srgb_tables;
+static std::once_flag srgb_tables_once;
+
+static const SrgbTables& GetSrgbTables() {
+    std::call_once(srgb_tables_once, [] {
+        for (uint32_t i = 0; i < 256; ++i) {
+            const float value = i / 255.0f;
+            srgb_tables.decode[i] = (value <= 0.04045f) ? value / 12.92f : powf((value + 0.055f) / 1.055f, 2.4f);
+        }
+        for (uint32_t i = 0; i < 4096; ++i) {
+            const float value = i / 4095.0f;
+            const float encoded = (value <= 0.0031308f) ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+            srgb_tables.encode[i] = (uint8_t)(encoded * 255.0f + 0.5f);
+        }
+    });
+    return srgb_tables;
+}
+
+static uint32_t PackColor(const float color[4], VkFormat format) {
+    const bool srgb = format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_B8G8R8A8_SRGB;
+    const bool bgra = format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB;
+    uint8_t bytes[4];
+    for (uint32_t c = 0; c < 4; ++c) {
+        const float value = std::min(std::max(color[c], 0.0f), 1.0f);
+        bytes[c] = (srgb && c < 3) ? GetSrgbTables().encode[(uint32_t)(value * 4095.0f + 0.5f)] : (uint8_t)(value * 255.0f + 0.5f);
+    }
+    if (bgra) {
+        std::swap(bytes[0], bytes[2]);
+    }
+    uint32_t packed;
+    memcpy(&packed, bytes, sizeof(packed));
+    return packed;
+}
+
+static void UnpackColor(const uint8_t* texel, VkFormat format, float color[4]) {
+    const bool srgb = format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_B8G8R8A8_SRGB;
+    const bool bgra = format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB;
+    for (uint32_t c = 0; c < 4; ++c) {
+        const uint8_t value = texel[(bgra && c < 3) ? 2 - c : c];
+        color[c] = (srgb && c < 3) ? GetSrgbTables().decode[value] : value / 255.0f;
+    }
+}
+
+static float LoadDepth(const uint8_t* texel, VkFormat format) {
+    if (format == VK_FORMAT_D16_UNORM || format == VK_FORMAT_D16_UNORM_S8_UINT) {
+        uint16_t depth;
+        memcpy(&depth, texel, sizeof(depth));
+        return depth / 65535.0f;
+    }
+    if (format == VK_FORMAT_X8_D24_UNORM_PACK32 || format == VK_FORMAT_D24_UNORM_S8_UINT) {
+        uint32_t depth;
+        memcpy(&depth, texel, sizeof(depth));
+        return (depth & 0xFFFFFF) / 16777215.0f;
+    }
+    float depth;
+    memcpy(&depth, texel, sizeof(depth));
+    return depth;
+}
+
+static void StoreDepth(uint8_t* texel, VkFormat format, float depth) {
+    if (format == VK_FORMAT_D16_UNORM || format == VK_FORMAT_D16_UNORM_S8_UINT) {
+        const uint16_t value = (uint16_t)(std::min(std::max(depth, 0.0f), 1.0f) * 65535.0f + 0.5f);
+        memcpy(texel, &value, sizeof(value));
+    } else if (format == VK_FORMAT_X8_D24_UNORM_PACK32 || format == VK_FORMAT_D24_UNORM_S8_UINT) {
+        uint32_t value;
+        memcpy(&value, texel, sizeof(value));
+        value = (value & 0xFF000000) | (uint32_t)(std::min(std::max(depth, 0.0f), 1.0f) * 16777215.0f + 0.5f);
+        memcpy(texel, &value, sizeof(value));
+    } else {
+        memcpy(texel, &depth, sizeof(depth));
+    }
+}
+
+struct RasterTexture {
+    bool valid;  // Fragments are lit white without a texture
+    RasterImage image;
+    SamplerState sampler;
+};
+
+static int32_t WrapTexelCoordinate(int32_t coord, int32_t size, VkSamplerAddressMode address_mode) {
+    if (address_mode == VK_SAMPLER_ADDRESS_MODE_REPEAT) {
+        coord %= size;
+        return (coord < 0) ? coord + size : coord;
+    }
+    if (address_mode == VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT) {
+        coord %= 2 * size;
+        coord = (coord < 0) ? coord + 2 * size : coord;
+        return (coord < size) ? coord : 2 * size - 1 - coord;
+    }
+    // Border colors aren't modeled, so clamping to the border samples the edge too
+    return std::min(std::max(coord, 0), size - 1);
+}
+
+static void FetchTexel(const RasterTexture& texture, int32_t x, int32_t y, float color[4]) {
+    x = WrapTexelCoordinate(x, (int32_t)texture.image.width, texture.sampler.address_mode_u);
+    y = WrapTexelCoordinate(y, (int32_t)texture.image.height, texture.sampler.address_mode_v);
+    UnpackColor(texture.image.data + y * texture.image.row_pitch + x * texture.image.texel_size, texture.image.format, color);
+}
+
+static void SampleTexture(const RasterTexture& texture, float u, float v, float color[4]) {
+    if (!texture.valid) {
+        color[0] = color[1] = color[2] = color[3] = 1.0f;
+        return;
+    }
+    // Keep wild coordinates from overflowing the texel math, NaNs included
+    u = (u > -65536.0f && u < 65536.0f) ? u : 0.0f;
+    v = (v > -65536.0f && v < 65536.0f) ? v : 0.0f;
+    const float x = u * texture.image.width;
+    const float y = v * texture.image.height;
+    if (texture.sampler.filter != VK_FILTER_LINEAR) {
+        FetchTexel(texture, (int32_t)floorf(x), (int32_t)floorf(y), color);
+        return;
+    }
+    const float x0 = floorf(x - 0.5f);
+    const float y0 = floorf(y - 0.5f);
+    const float fx = x - 0.5f - x0;
+    const float fy = y - 0.5f - y0;
+    float texels[4][4];
+    FetchTexel(texture, (int32_t)x0, (int32_t)y0, texels[0]);
+    FetchTexel(texture, (int32_t)x0 + 1, (int32_t)y0, texels[1]);
+    FetchTexel(texture, (int32_t)x0, (int32_t)y0 + 1, texels[2]);
+    FetchTexel(texture, (int32_t)x0 + 1, (int32_t)y0 + 1, texels[3]);
+    for (uint32_t c = 0; c < 4; ++c) {
+        const float top = texels[0][c] + (texels[1][c] - texels[0][c]) * fx;
+        const float bottom = texels[2][c] + (texels[3][c] - texels[2][c]) * fx;
+        color[c] = top + (bottom - top) * fy;
+    }
+}
+
+// Spreads rasterizer and transfer jobs over a device's threads. Submissions from different queues take turns using it.
+//  Threads are only started once there's more than one job to run, so devices that never draw or transfer much don't
+//  pay for them.
+class WorkerPool {
+   public:
+    explicit WorkerPool(uint32_t thread_count)
+        : thread_count_(thread_count), job_(nullptr), job_count_(0), next_job_(0), busy_(0), generation_(0), exit_(false) {}
+    ~WorkerPool() {
+        {
+            lock_guard_t lock(lock_);
+            exit_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // Calls job(i) for every i below job_count and returns once they've all finished
+    void Run(uint32_t job_count, const std::function<void(uint32_t)>& job) {
+        lock_guard_t run_lock(run_lock_);
+        if (job_count > 1 && threads_.empty()) {
+            // The thread calling Run() works on the jobs too, so it counts as one of the threads
+            for (uint32_t i = 1; i < thread_count_; ++i) {
+                threads_.push_back(std::thread(&WorkerPool::Worker, this));
+            }
+        }
+        {
+            lock_guard_t lock(lock_);
+            job_ = &job;
+            job_count_ = job_count;
+            next_job_ = 0;
+            ++generation_;
+        }
+        work_cv_.notify_all();
+        DoJobs(job, job_count);
+        unique_lock_t lock(lock_);
+        done_cv_.wait(lock, [this] { return busy_ == 0; });
+        // Workers that wake up from here on must not pick up a job that's gone
+        job_ = nullptr;
+    }
+
+   private:
+    void DoJobs(const std::function<void(uint32_t)>& job, uint32_t job_count) {
+        for (uint32_t i = next_job_++; i < job_count; i = next_job_++) {
+            job(i);
+        }
+    }
+    void Worker() {
+        unique_lock_t lock(lock_);
+        uint64_t generation = 0;
+        while (true) {
+            work_cv_.wait(lock, [this, generation] { return exit_ || generation_ != generation; });
+            if (exit_) {
+                return;
+            }
+            generation = generation_;
+            if (!job_) {
+                continue;
+            }
+            const auto job = job_;
+            const uint32_t job_count = job_count_;
+            ++busy_;
+            lock.unlock();
+            DoJobs(*job, job_count);
+            lock.lock();
+            if (--busy_ == 0) {
+                done_cv_.notify_all();
+            }
+        }
+    }
+
+    const uint32_t thread_count_;
+    mutex_t run_lock_;
+    mutex_t lock_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    const std::function<void(uint32_t)>* job_;
+    uint32_t job_count_;
+    std::atomic<uint32_t> next_job_;
+    uint32_t busy_;
+    uint64_t generation_;
+    bool exit_;
+    std::vector<std::thread> threads_;
+};
+
+// Draws are binned into square tiles, and the tiles are rasterized in parallel with every triangle touching them
+//  drawn in order. Depth is worked on as floats in a per-tile buffer, with room for a row's last group of 4 pixels to
+//  hang over the edge.
+static const uint32_t RASTER_TILE_SIZE = 64;
+static const uint32_t RASTER_DEPTH_STRIDE = RASTER_TILE_SIZE + 4;
+
+struct RasterVertex {
+    float clip[4];
+    float u;
+    float v;
+};
+
+// A triangle set up in framebuffer coordinates
+struct RasterTriangle {
+    // Edge i is opposite vertex i. Its function edge_a * (x - origin_x) + edge_b * (y - origin_y) is positive inside,
+    //  and pixel centers exactly on it are only covered if it's a top or left edge.
+    float edge_a[3];
+    float edge_b[3];
+    float edge_origin_x[3];
+    float edge_origin_y[3];
+    bool edge_inclusive[3];
+    float inv_area;
+    float z[3];
+    float inv_w[3];
+    float u_over_w[3];
+    float v_over_w[3];
+    float light;
+    int32_t min_x;
+    int32_t min_y;
+    int32_t max_x;
+    int32_t max_y;
+};
+
+// Everything the tile jobs need for a draw
+struct RasterDraw {
+    GraphicsPipelineState pipeline;
+    bool has_color;
+    RasterImage color;
+    bool has_depth;
+    RasterImage depth;
+    RasterTexture texture;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    std::vector<RasterTriangle> triangles;
+    std::vector<std::vector<uint32_t>> bins;
+};
+
+// Sets up an edge from its lower vertex, so the two triangles sharing an edge compute exactly opposite values along it
+//  and the fill rule leaves neither gaps nor double hits between them
+static void SetupEdge(float x0, float y0, float x1, float y1, RasterTriangle* triangle, uint32_t edge) {
+    const bool flip = (y1 < y0) || (y1 == y0 && x1 < x0);
+    const float start_x = flip ? x1 : x0;
+    const float start_y = flip ? y1 : y0;
+    const float end_x = flip ? x0 : x1;
+    const float end_y = flip ? y0 : y1;
+    triangle->edge_a[edge] = flip ? end_y - start_y : start_y - end_y;
+    triangle->edge_b[edge] = flip ? start_x - end_x : end_x - start_x;
+    triangle->edge_origin_x[edge] = start_x;
+    triangle->edge_origin_y[edge] = start_y;
+    triangle->edge_inclusive[edge] = (y1 < y0) || (y1 == y0 && x1 > x0);
+}
+
+static const float RASTER_LIGHT_DIR[3] = {0.424f, 0.566f, 0.707f};
+
+// Pixel bounds of a triangle whose vertices span [min, max], limited to the rectangle [start, end)
+static void GetTriangleBounds(float min, float max, int32_t start, int32_t end, int32_t* first, int32_t* last) {
+    *first = (int32_t)floorf(std::min(std::max(min, (float)start), (float)end));
+    *last = std::min((int32_t)ceilf(std::min(std::max(max, (float)start), (float)end)), end - 1);
+}
+
+// bounds is the rectangle of pixels the draw is limited to
+static void SetupTriangle(RasterDraw* draw, const VkViewport& viewport, const VkRect2D& bounds, const RasterVertex* v0,
+                          const RasterVertex* v1, const RasterVertex* v2) {
+    const RasterVertex* vertices[3] = {v0, v1, v2};
+    float x[3], y[3], z[3], inv_w[3];
+    for (uint32_t i = 0; i < 3; ++i) {
+        inv_w[i] = 1.0f / vertices[i]->clip[3];
+        x[i] = viewport.x + viewport.width * (vertices[i]->clip[0] * inv_w[i] + 1.0f) * 0.5f;
+        y[i] = viewport.y + viewport.height * (vertices[i]->clip[1] * inv_w[i] + 1.0f) * 0.5f;
+        z[i] = viewport.minDepth + (viewport.maxDepth - viewport.minDepth) * vertices[i]->clip[2] * inv_w[i];
+    }
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    // Degenerate, or with coordinates so wild they overflowed
+    if (!(fabsf(area) > 0.0f && fabsf(area) < 1e30f)) {
+        return;
+    }
+    // Vulkan's signed area has the opposite sign, and is positive for counter-clockwise triangles
+    const bool front_facing = (draw->pipeline.front_face == VK_FRONT_FACE_COUNTER_CLOCKWISE) ? area < 0.0f : area > 0.0f;
+    if (draw->pipeline.cull_mode & (front_facing ? VK_CULL_MODE_FRONT_BIT : VK_CULL_MODE_BACK_BIT)) {
+        return;
+    }
+    // Wind every triangle the same way so its edge functions are positive inside
+    uint32_t order[3] = {0, 1, 2};
+    if (area < 0.0f) {
+        std::swap(order[1], order[2]);
+        area = -area;
+    }
+    RasterTriangle triangle;
+    const float min_x = std::min(std::min(x[0], x[1]), x[2]);
+    const float min_y = std::min(std::min(y[0], y[1]), y[2]);
+    const float max_x = std::max(std::max(x[0], x[1]), x[2]);
+    const float max_y = std::max(std::max(y[0], y[1]), y[2]);
+    GetTriangleBounds(min_x, max_x, bounds.offset.x, bounds.offset.x + (int32_t)bounds.extent.width, &triangle.min_x,
+                      &triangle.max_x);
+    GetTriangleBounds(min_y, max_y, bounds.offset.y, bounds.offset.y + (int32_t)bounds.extent.height, &triangle.min_y,
+                      &triangle.max_y);
+    if (triangle.min_x > triangle.max_x || triangle.min_y > triangle.max_y) {
+        return;
+    }
+    for (uint32_t i = 0; i < 3; ++i) {
+        const uint32_t from = order[(i + 1) % 3];
+        const uint32_t to = order[(i + 2) % 3];
+        SetupEdge(x[from], y[from], x[to], y[to], &triangle, i);
+        const auto vertex = vertices[order[i]];
+        triangle.z[i] = z[order[i]];
+        triangle.inv_w[i] = inv_w[order[i]];
+        triangle.u_over_w[i] = vertex->u * inv_w[order[i]];
+        triangle.v_over_w[i] = vertex->v * inv_w[order[i]];
+    }
+    triangle.inv_area = 1.0f / area;
+    // The fragment shader's normal is the cross product of the screen space derivatives of the clip space position,
+    //  which points the same way as the cross product of the triangle's edges once it's wound positively
+    const float* p0 = vertices[order[0]]->clip;
+    const float* p1 = vertices[order[1]]->clip;
+    const float* p2 = vertices[order[2]]->clip;
+    const float e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+    const float e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+    const float normal[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+    const float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+    const float dot = RASTER_LIGHT_DIR[0] * normal[0] + RASTER_LIGHT_DIR[1] * normal[1] + RASTER_LIGHT_DIR[2] * normal[2];
+    triangle.light = (length > 0.0f) ? std::max(dot / length, 0.0f) : 0.0f;
+    draw->triangles.push_back(triangle);
+}
+
+static RasterVertex LerpVertex(const RasterVertex& from, const RasterVertex& to, float t) {
+    RasterVertex vertex;
+    for (uint32_t i = 0; i < 4; ++i) {
+        vertex.clip[i] = from.clip[i] + (to.clip[i] - from.clip[i]) * t;
+    }
+    vertex.u = from.u + (to.u - from.u) * t;
+    vertex.v = from.v + (to.v - from.v) * t;
+    return vertex;
+}
+
+// Clips a triangle against the near plane, z >= 0 in clip space, and sets up what's left. Triangles reaching past the
+//  far plane are trimmed by the depth range check while rasterizing instead.
+static void ClipAndSetupTriangle(RasterDraw* draw, const VkViewport& viewport, const VkRect2D& bounds,
+                                 const RasterVertex* vertices[3]) {
+    RasterVertex clipped[4];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < 3; ++i) {
+        const RasterVertex& a = *vertices[i];
+        const RasterVertex& b = *vertices[(i + 1) % 3];
+        const bool a_inside = a.clip[2] >= 0.0f;
+        const bool b_inside = b.clip[2] >= 0.0f;
+        if (a_inside) {
+            clipped[count++] = a;
+        }
+        if (a_inside != b_inside) {
+            // Always interpolate from the inside vertex, so neighbors sharing the edge get the same new vertex
+            const RasterVertex& inside = a_inside ? a : b;
+            const RasterVertex& outside = a_inside ? b : a;
+            clipped[count++] = LerpVertex(inside, outside, inside.clip[2] / (inside.clip[2] - outside.clip[2]));
+        }
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        // Anything left with w <= 0 is past the far plane
+        if (!(clipped[i].clip[3] > 0.0f)) {
+            return;
+        }
+    }
+    for (uint32_t i = 2; i < count; ++i) {
+        SetupTriangle(draw, viewport, bounds, &clipped[0], &clipped[i - 1], &clipped[i]);
+    }
+}
+
+static void ShadeFragment(const RasterDraw& draw, const RasterTriangle& triangle, float b0, float b1, float b2, int32_t x,
+                          int32_t y) {
+    const float inv_w = b0 * triangle.inv_w[0] + b1 * triangle.inv_w[1] + b2 * triangle.inv_w[2];
+    const float u = (b0 * triangle.u_over_w[0] + b1 * triangle.u_over_w[1] + b2 * triangle.u_over_w[2]) / inv_w;
+    const float v = (b0 * triangle.v_over_w[0] + b1 * triangle.v_over_w[1] + b2 * triangle.v_over_w[2]) / inv_w;
+    float color[4];
+    SampleTexture(draw.texture, u, v, color);
+    for (uint32_t c = 0; c < 4; ++c) {
+        color[c] *= triangle.light;
+    }
+    const uint32_t packed = PackColor(color, draw.color.format);
+    memcpy(draw.color.data + y * draw.color.row_pitch + x * sizeof(packed), &packed, sizeof(packed));
+}
+
+static bool CompareDepth(VkCompareOp op, float z, float depth) {
+    switch (op) {
+        case VK_COMPARE_OP_NEVER:
+            return false;
+        case VK_COMPARE_OP_LESS:
+            return z < depth;
+        case VK_COMPARE_OP_EQUAL:
+            return z == depth;
+        case VK_COMPARE_OP_LESS_OR_EQUAL:
+            return z <= depth;
+        case VK_COMPARE_OP_GREATER:
+            return z > depth;
+        case VK_COMPARE_OP_NOT_EQUAL:
+            return z != depth;
+        case VK_COMPARE_OP_GREATER_OR_EQUAL:
+            return z >= depth;
+        default:
+            return true;
+    }
+}
+
+#if defined(MOCK_SSE2)
+static __m128 CompareDepth(VkCompareOp op, __m128 z, __m128 depth) {
+    switch (op) {
+        case VK_COMPARE_OP_NEVER:
+            return _mm_setzero_ps();
+        case VK_COMPARE_OP_LESS:
+            return _mm_cmplt_ps(z, depth);
+        case VK_COMPARE_OP_EQUAL:
+            return _mm_cmpeq_ps(z, depth);
+        case VK_COMPARE_OP_LESS_OR_EQUAL:
+            return _mm_cmple_ps(z, depth);
+        case VK_COMPARE_OP_GREATER:
+            return _mm_cmpgt_ps(z, depth);
+        case VK_COMPARE_OP_NOT_EQUAL:
+            return _mm_cmpneq_ps(z, depth);
+        case VK_COMPARE_OP_GREATER_OR_EQUAL:
+            return _mm_cmpge_ps(z, depth);
+        default:
+            return _mm_castsi128_ps(_mm_set1_epi32(-1));
+    }
+}
+#endif
+
+// Rasterizes the part of a triangle inside the tile whose top left pixel is (tile_x, tile_y), four pixels at a time
+//  where SSE2 is available
+static void RasterizeTriangleInTile(const RasterDraw& draw, const RasterTriangle& triangle, int32_t tile_x, int32_t tile_y,
+                                    float* depth) {
+    const auto& pipeline = draw.pipeline;
+    const bool depth_test = draw.has_depth && pipeline.depth_test;
+    const bool depth_write = depth_test && pipeline.depth_write;
+    const float min_depth = std::min(pipeline.viewport.minDepth, pipeline.viewport.maxDepth);
+    const float max_depth = std::max(pipeline.viewport.minDepth, pipeline.viewport.maxDepth);
+    const int32_t x0 = std::max(triangle.min_x, tile_x);
+    const int32_t y0 = std::max(triangle.min_y, tile_y);
+    const int32_t x1 = std::min(triangle.max_x, tile_x + (int32_t)RASTER_TILE_SIZE - 1);
+    const int32_t y1 = std::min(triangle.max_y, tile_y + (int32_t)RASTER_TILE_SIZE - 1);
+#if defined(MOCK_SSE2)
+    const __m128 lane_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 lane_indices = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 all_lanes = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    const __m128 inv_area = _mm_set1_ps(triangle.inv_area);
+    __m128 edge_a[3], edge_origin_x[3], edge_inclusive[3];
+    for (uint32_t i = 0; i < 3; ++i) {
+        edge_a[i] = _mm_set1_ps(triangle.edge_a[i]);
+        edge_origin_x[i] = _mm_set1_ps(triangle.edge_origin_x[i]);
+        edge_inclusive[i] = triangle.edge_inclusive[i] ? all_lanes : zero;
+    }
+    const __m128 z0 = _mm_set1_ps(triangle.z[0]);
+    const __m128 z1 = _mm_set1_ps(triangle.z[1]);
+    const __m128 z2 = _mm_set1_ps(triangle.z[2]);
+    const __m128 depth_min = _mm_set1_ps(min_depth);
+    const __m128 depth_max = _mm_set1_ps(max_depth);
+    for (int32_t y = y0; y <= y1; ++y) {
+        const float py = y + 0.5f;
+        __m128 edge_y[3];
+        for (uint32_t i = 0; i < 3; ++i) {
+            edge_y[i] = _mm_set1_ps(triangle.edge_b[i] * (py - triangle.edge_origin_y[i]));
+        }
+        float* depth_row = depth + (y - tile_y) * RASTER_DEPTH_STRIDE;
+        for (int32_t x = x0; x <= x1; x += 4) {
+            const __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane_offsets);
+            __m128 mask = _mm_cmplt_ps(lane_indices, _mm_set1_ps((float)(x1 - x + 1)));
+            __m128 edges[3];
+            for (uint32_t i = 0; i < 3; ++i) {
+                edges[i] = _mm_add_ps(_mm_mul_ps(edge_a[i], _mm_sub_ps(px, edge_origin_x[i])), edge_y[i]);
+                const __m128 on_edge = _mm_and_ps(_mm_cmpeq_ps(edges[i], zero), edge_inclusive[i]);
+                mask = _mm_and_ps(mask, _mm_or_ps(_mm_cmpgt_ps(edges[i], zero), on_edge));
+            }
+            if (!_mm_movemask_ps(mask)) {
+                continue;
+            }
+            const __m128 b0 = _mm_mul_ps(edges[0], inv_area);
+            const __m128 b1 = _mm_mul_ps(edges[1], inv_area);
+            const __m128 b2 = _mm_mul_ps(edges[2], inv_area);
+            const __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b0, z0), _mm_mul_ps(b1, z1)), _mm_mul_ps(b2, z2));
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(z, depth_min), _mm_cmple_ps(z, depth_max)));
+            if (depth_test) {
+                float* depth_group = depth_row + (x - tile_x);
+                const __m128 stored = _mm_loadu_ps(depth_group);
+                mask = _mm_and_ps(mask, CompareDepth(pipeline.depth_compare_op, z, stored));
+                if (depth_write) {
+                    _mm_storeu_ps(depth_group, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, stored)));
+                }
+            }
+            const int lanes = _mm_movemask_ps(mask);
+            if (!lanes || !draw.has_color) {
+                continue;
+            }
+            float b[3][4];
+            _mm_storeu_ps(b[0], b0);
+            _mm_storeu_ps(b[1], b1);
+            _mm_storeu_ps(b[2], b2);
+            for (int32_t lane = 0; lane < 4; ++lane) {
+                if (lanes & (1 << lane)) {
+                    ShadeFragment(draw, triangle, b[0][lane], b[1][lane], b[2][lane], x + lane, y);
+                }
+            }
+        }
+    }
+#else
+    for (int32_t y = y0; y <= y1; ++y) {
+        const float py = y + 0.5f;
+        for (int32_t x = x0; x <= x1; ++x) {
+            const float px = x + 0.5f;
+            float edges[3];
+            bool inside = true;
+            for (uint32_t i = 0; i < 3; ++i) {
+                edges[i] = triangle.edge_a[i] * (px - triangle.edge_origin_x[i]) +
+                           triangle.edge_b[i] * (py - triangle.edge_origin_y[i]);
+                inside = inside && (edges[i] > 0.0f || (edges[i] == 0.0f && triangle.edge_inclusive[i]));
+            }
+            if (!inside) {
+                continue;
+            }
+            const float b0 = edges[0] * triangle.inv_area;
+            const float b1 = edges[1] * triangle.inv_area;
+            const float b2 = edges[2] * triangle.inv_area;
+            const float z = b0 * triangle.z[0] + b1 * triangle.z[1] + b2 * triangle.z[2];
+            if (z < min_depth || z > max_depth) {
+                continue;
+            }
+            if (depth_test) {
+                float& stored = depth[(y - tile_y) * RASTER_DEPTH_STRIDE + (x - tile_x)];
+                if (!CompareDepth(pipeline.depth_compare_op, z, stored)) {
+                    continue;
+                }
+                if (depth_write) {
+                    stored = z;
+                }
+            }
+            if (draw.has_color) {
+                ShadeFragment(draw, triangle, b0, b1, b2, x, y);
+            }
+        }
+    }
+#endif
+}
+
+static void RasterizeTile(const RasterDraw& draw, uint32_t tile) {
+    const auto& bin = draw.bins[tile];
+    if (bin.empty()) {
+        return;
+    }
+    const int32_t tile_x = (int32_t)((tile % draw.tiles_x) * RASTER_TILE_SIZE);
+    const int32_t tile_y = (int32_t)((tile / draw.tiles_x) * RASTER_TILE_SIZE);
+    const bool depth_test = draw.has_depth && draw.pipeline.depth_test;
+    const bool depth_write = depth_test && draw.pipeline.depth_write;
+    float depth[RASTER_TILE_SIZE * RASTER_DEPTH_STRIDE];
+    const uint32_t width = depth_test ? std::min(RASTER_TILE_SIZE, draw.depth.width - tile_x) : 0;
+    const uint32_t height = depth_test ? std::min(RASTER_TILE_SIZE, draw.depth.height - tile_y) : 0;
+    for (uint32_t y = 0; y < height; ++y) {
+        const uint8_t* row = draw.depth.data + (tile_y + y) * draw.depth.row_pitch + tile_x * draw.depth.texel_size;
+        for (uint32_t x = 0; x < width; ++x) {
+            depth[y * RASTER_DEPTH_STRIDE + x] = LoadDepth(row + x * draw.depth.texel_size, draw.depth.format);
+        }
+    }
+    for (auto index : bin) {
+        RasterizeTriangleInTile(draw, draw.triangles[index], tile_x, tile_y, depth);
+    }
+    for (uint32_t y = 0; depth_write && y < height; ++y) {
+        uint8_t* row = draw.depth.data + (tile_y + y) * draw.depth.row_pitch + tile_x * draw.depth.texel_size;
+        for (uint32_t x = 0; x < width; ++x) {
+            StoreDepth(row + x * draw.depth.texel_size, draw.depth.format, depth[y * RASTER_DEPTH_STRIDE + x]);
+        }
+    }
+}
+
+// Where the executor is in a command buffer, and what's bound
+struct RasterCommandState {
+    DeviceState* device_state;
+    GraphicsPipelineState pipeline;
+    VkDescriptorSet descriptor_set;
+    uint32_t dynamic_offset;  // Applies to binding 0, as the first dynamic offset of set 0 would
+    VkViewport viewport;
+    VkRect2D scissor;
+    VkBuffer index_buffer;
+    VkDeviceSize index_offset;
+    VkIndexType index_type;
+    // Set inside the first subpass of a render pass whose attachments could be resolved
+    bool in_subpass;
+    VkRect2D render_area;
+    RasterDraw draw;
+    std::vector<uint32_t> vertex_indices;
+    std::vector<float> uniforms;
+    std::vector<RasterVertex> vertices;
+};
+
+// Fills the area with a single texel, a band of rows per job
+static void FillRasterImage(WorkerPool* pool, const RasterImage& image, const VkRect2D& area, const uint8_t* texel) {
+    const uint32_t bands = (area.extent.height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    pool->Run(bands, [&](uint32_t band) {
+        const uint32_t y_end = std::min((band + 1) * RASTER_TILE_SIZE, area.extent.height);
+        for (uint32_t y = band * RASTER_TILE_SIZE; y < y_end; ++y) {
+            uint8_t* row = image.data + (area.offset.y + y) * image.row_pitch + area.offset.x * image.texel_size;
+            for (uint32_t x = 0; x < area.extent.width; ++x) {
+                memcpy(row + x * image.texel_size, texel, image.texel_size);
+            }
+        }
+    });
+}
+
+static VkRect2D IntersectRect(const VkRect2D& a, const VkRect2D& b) {
+    const int32_t x0 = std::max(a.offset.x, b.offset.x);
+    const int32_t y0 = std::max(a.offset.y, b.offset.y);
+    const int64_t x1 = std::min<int64_t>((int64_t)a.offset.x + a.extent.width, (int64_t)b.offset.x + b.extent.width);
+    const int64_t y1 = std::min<int64_t>((int64_t)a.offset.y + a.extent.height, (int64_t)b.offset.y + b.extent.height);
+    VkRect2D rect = {{x0, y0}, {0, 0}};
+    if (x1 > x0 && y1 > y0) {
+        rect.extent.width = (uint32_t)(x1 - x0);
+        rect.extent.height = (uint32_t)(y1 - y0);
+    }
+    return rect;
+}
+
+static void BeginRasterRenderPass(RasterCommandState* state, const VkRenderPassBeginInfo& begin_info) {
+    state->in_subpass = false;
+    auto& draw = state->draw;
+    unique_lock_t lock(global_lock);
+    auto render_pass = render_pass_map.find(begin_info.renderPass);
+    auto framebuffer = framebuffer_map.find(begin_info.framebuffer);
+    if (render_pass == render_pass_map.end() || framebuffer == framebuffer_map.end()) {
+        return;
+    }
+    const auto& attachments = render_pass->second.attachments;
+    const auto& views = framebuffer->second.attachments;
+    const uint32_t color_attachment = render_pass->second.color_attachment;
+    const uint32_t depth_attachment = render_pass->second.depth_attachment;
+    const size_t attachment_count = std::min(attachments.size(), views.size());
+    draw.has_color = color_attachment < attachment_count && GetRasterImage(views[color_attachment], &draw.color) &&
+                     IsRasterColorFormat(draw.color.format);
+    draw.has_depth = depth_attachment < attachment_count && GetRasterImage(views[depth_attachment], &draw.depth) &&
+                     IsRasterDepthFormat(draw.depth.format);
+    const bool clear_color = draw.has_color && attachments[color_attachment].loadOp == VK_ATTACHMENT_LOAD_OP_CLEAR &&
+                             color_attachment < begin_info.clearValueCount;
+    const bool clear_depth = draw.has_depth && attachments[depth_attachment].loadOp == VK_ATTACHMENT_LOAD_OP_CLEAR &&
+                             depth_attachment < begin_info.clearValueCount;
+    VkRect2D target = {{0, 0}, {framebuffer->second.width, framebuffer->second.height}};
+    lock.unlock();
+    if (!draw.has_color && !draw.has_depth) {
+        return;
+    }
+    if (draw.has_color) {
+        target = IntersectRect(target, VkRect2D{{0, 0}, {draw.color.width, draw.color.height}});
+    }
+    if (draw.has_depth) {
+        target = IntersectRect(target, VkRect2D{{0, 0}, {draw.depth.width, draw.depth.height}});
+    }
+    state->render_area = IntersectRect(begin_info.renderArea, target);
+    state->in_subpass = true;
+    draw.tiles_x = (target.extent.width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    draw.tiles_y = (target.extent.height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    auto pool = state->device_state->worker_pool;
+    if (clear_color) {
+        const uint32_t texel = PackColor(begin_info.pClearValues[color_attachment].color.float32, draw.color.format);
+        FillRasterImage(pool, draw.color, state->render_area, reinterpret_cast<const uint8_t*>(&texel));
+    }
+    if (clear_depth) {
+        uint8_t texel[8] = {};
+        StoreDepth(texel, draw.depth.format, begin_info.pClearValues[depth_attachment].depthStencil.depth);
+        FillRasterImage(pool, draw.depth, state->render_area, texel);
+    }
+}
+
+// Runs the vertices through the contract's vertex shader, then sets up, bins and rasterizes the triangles
+static void ExecuteRasterDraw(RasterCommandState* state) {
+    auto& draw = state->draw;
+    if (!state->in_subpass || !state->pipeline.drawable || state->vertex_indices.size() < 3) {
+        return;
+    }
+    draw.pipeline = state->pipeline;
+    if (draw.pipeline.dynamic_viewport) {
+        draw.pipeline.viewport = state->viewport;
+    }
+    if (draw.pipeline.dynamic_scissor) {
+        draw.pipeline.scissor = state->scissor;
+    }
+    {
+        unique_lock_t lock(global_lock);
+        auto set = descriptor_set_map.find(state->descriptor_set);
+        if (set == descriptor_set_map.end()) {
+            return;
+        }
+        auto uniform_buffer = set->second.bindings.find(0);
+        if (uniform_buffer == set->second.bindings.end() ||
+            (uniform_buffer->second.type != VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER &&
+             uniform_buffer->second.type != VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC)) {
+            return;
+        }
+        const auto& descriptor = uniform_buffer->second;
+        VkDeviceSize offset = descriptor.offset;
+        if (descriptor.type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC) {
+            offset += state->dynamic_offset;
+        }
+        VkDeviceSize range = descriptor.range;
+        if (range == VK_WHOLE_SIZE) {
+            BufferState buffer;
+            range = (buffer_map.Find(descriptor.buffer, &buffer) && buffer.size > offset) ? buffer.size - offset : 0;
+        }
+        const uint8_t* data = GetBufferData(descriptor.buffer, offset, range);
+        if (!data) {
+            return;
+        }
+        // Copied out so the app can't change it halfway through the draw
+        state->uniforms.resize((size_t)(range / sizeof(float)));
+        memcpy(state->uniforms.data(), data, state->uniforms.size() * sizeof(float));
+        draw.texture.valid = false;
+        auto texture = set->second.bindings.find(1);
+        if (texture != set->second.bindings.end() && texture->second.type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
+            draw.texture.valid = sampler_map.Find(texture->second.sampler, &draw.texture.sampler) &&
+                                 GetRasterImage(texture->second.image_view, &draw.texture.image) &&
+                                 IsRasterColorFormat(draw.texture.image.format);
+        }
+    }
+    // mat4 mvp, then vec4 position[N] and vec4 attr[N]
+    const auto& uniforms = state->uniforms;
+    if (uniforms.size() < 16 + 8) {
+        return;
+    }
+    const size_t vertex_count = (uniforms.size() - 16) / 8;
+    const float* mvp = &uniforms[0];
+    const float* positions = &uniforms[16];
+    const float* attrs = &uniforms[16 + 4 * vertex_count];
+    state->vertices.resize(vertex_count);
+    for (size_t i = 0; i < vertex_count; ++i) {
+        auto& vertex = state->vertices[i];
+        const float* position = positions + 4 * i;
+        // Column major, as std140 lays out a mat4
+        for (uint32_t row = 0; row < 4; ++row) {
+            vertex.clip[row] = mvp[row] * position[0] + mvp[4 + row] * position[1] + mvp[8 + row] * position[2] +
+                               mvp[12 + row] * position[3];
+        }
+        vertex.u = attrs[4 * i];
+        vertex.v = attrs[4 * i + 1];
+    }
+    const VkRect2D bounds = IntersectRect(state->render_area, draw.pipeline.scissor);
+    if (!bounds.extent.width || !bounds.extent.height) {
+        return;
+    }
+    draw.triangles.clear();
+    const auto& indices = state->vertex_indices;
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        if (indices[i] >= vertex_count || indices[i + 1] >= vertex_count || indices[i + 2] >= vertex_count) {
+            continue;
+        }
+        const RasterVertex* triangle[3] = {&state->vertices[indices[i]], &state->vertices[indices[i + 1]],
+                                           &state->vertices[indices[i + 2]]};
+        ClipAndSetupTriangle(&draw, draw.pipeline.viewport, bounds, triangle);
+    }
+    draw.bins.resize(draw.tiles_x * draw.tiles_y);
+    for (auto& bin : draw.bins) {
+        bin.clear();
+    }
+    for (uint32_t i = 0; i < draw.triangles.size(); ++i) {
+        const auto& triangle = draw.triangles[i];
+        for (int32_t y = triangle.min_y / (int32_t)RASTER_TILE_SIZE; y <= triangle.max_y / (int32_t)RASTER_TILE_SIZE; ++y) {
+            for (int32_t x = triangle.min_x / (int32_t)RASTER_TILE_SIZE; x <= triangle.max_x / (int32_t)RASTER_TILE_SIZE; ++x) {
+                draw.bins[y * draw.tiles_x + x].push_back(i);
+            }
+        }
+    }
+    state->device_state->worker_pool->Run((uint32_t)draw.bins.size(), [&draw](uint32_t tile) { RasterizeTile(draw, tile); });
+}
+
+// Transfer execution. Copies, updates, fills and clears are carried out on the memory bound to their buffers and images
+//  as their command buffers are submitted, whether or not the rasterizer is enabled. Each command gathers the ranges it
+//  moves into a TransferBatch, which hands them to the device's worker pool in jobs of about TRANSFER_JOB_SIZE bytes, so
+//  large uploads use every core while small ones stay on the submitting thread. Images are linear, see
+//  GetSubresourceOffset(), so copies between buffers and images move a row at a time, or a whole slice when the buffer
+//  packs its rows the same way. Combined depth/stencil images aren't copied, since buffers hold their aspects apart.
+static const size_t TRANSFER_JOB_SIZE = 256 * 1024;
+
+// Repeats a pattern of 1 to 16 bytes over dst, starting with its first byte
+static void FillPattern(uint8_t* dst, size_t size, const uint8_t* pattern, uint32_t pattern_size) {
+    bool uniform = true;
+    for (uint32_t i = 1; i < pattern_size; ++i) {
+        uniform &= pattern[i] == pattern[0];
+    }
+    if (uniform) {
+        memset(dst, pattern[0], size);
+        return;
+    }
+    uint8_t block[16];
+    for (uint32_t i = 0; i < sizeof(block); ++i) {
+        block[i] = pattern[i % pattern_size];
+    }
+#if defined(MOCK_SSE2)
+    if (sizeof(block) % pattern_size == 0) {
+        const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+        size_t offset = 0;
+        for (; offset + 64 <= size; offset += 64) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + offset), value);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + offset + 16), value);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + offset + 32), value);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + offset + 48), value);
+        }
+        for (; offset + 16 <= size; offset += 16) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + offset), value);
+        }
+        memcpy(dst + offset, block, size - offset);
+        return;
+    }
+#endif
+    // Copies what's been written so far onward, in steps that grow up to a few KiB so the source stays in cache
+    size_t step = std::min<size_t>(sizeof(block) - sizeof(block) % pattern_size, size);
+    memcpy(dst, block, step);
+    for (size_t offset = step; offset < size;) {
+        const size_t count = std::min(step, size - offset);
+        memcpy(dst + offset, dst, count);
+        offset += count;
+        if (step < 4096) {
+            step = offset;
+        }
+    }
+}
+
+// The ranges one transfer command moves. Fills repeat a pattern instead of copying from a source.
+class TransferBatch {
+   public:
+    TransferBatch() : pattern_size_(0), bytes_(0), job_bytes_(0) {}
+
+    // Fill ranges added from here on must be whole multiples of the pattern
+    void SetPattern(const uint8_t* pattern, uint32_t size) {
+        memcpy(pattern_, pattern, size);
+        pattern_size_ = size;
+    }
+    void Add(uint8_t* dst, const uint8_t* src, size_t size) {
+        // Ranges bigger than a job are cut where the pattern repeats, so every piece starts at the pattern's first byte
+        const size_t piece_size = pattern_size_ ? TRANSFER_JOB_SIZE - TRANSFER_JOB_SIZE % pattern_size_ : TRANSFER_JOB_SIZE;
+        for (size_t offset = 0; offset < size; offset += piece_size) {
+            if (job_starts_.empty() || job_bytes_ >= TRANSFER_JOB_SIZE) {
+                job_starts_.push_back(ranges_.size());
+                job_bytes_ = 0;
+            }
+            const TransferRange range = {dst + offset, src ? src + offset : nullptr, std::min(piece_size, size - offset)};
+            ranges_.push_back(range);
+            job_bytes_ += range.size;
+            bytes_ += range.size;
+        }
+    }
+    void Run(WorkerPool* pool) {
+        if (ranges_.empty()) {
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        if (job_starts_.size() > 1) {
+            pool->Run((uint32_t)job_starts_.size(), [this](uint32_t job) { RunJob(job); });
+        } else {
+            RunJob(0);
+        }
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        transfer_bytes.fetch_add(bytes_, std::memory_order_relaxed);
+        transfer_ns.fetch_add((uint64_t)ns.count(), std::memory_order_relaxed);
+    }
+
+   private:
+    struct TransferRange {
+        uint8_t* dst;
+        const uint8_t* src;
+        size_t size;
+    };
+
+    void RunJob(uint32_t job) {
+        const size_t end = (job + 1 < job_starts_.size()) ? job_starts_[job + 1] : ranges_.size();
+        for (size_t i = job_starts_[job]; i < end; ++i) {
+            const auto& range = ranges_[i];
+            if (range.src) {
+                memcpy(range.dst, range.src, range.size);
+            } else {
+                FillPattern(range.dst, range.size, pattern_, pattern_size_);
+            }
+        }
+    }
+
+    uint8_t pattern_[16];
+    uint32_t pattern_size_;
+    std::vector<TransferRange> ranges_;
+    // Index of the first range of each job
+    std::vector<size_t> job_starts_;
+    uint64_t bytes_;
+    size_t job_bytes_;
+};
+
+// An image and the host memory bound to it
+struct TransferImage {
+    VkImageCreateInfo create_info;
+    uint8_t* data;
+    VkDeviceSize size;  // Bytes of memory from data on
+};
+
+static bool GetTransferImage(VkImage image, TransferImage* transfer_image) {
+    ImageState image_state;
+    DeviceMemoryState memory;
+    if (!image_map.Find(image, &image_state) || !device_memory_map.Find(image_state.memory, &memory) || !memory.data ||
+        image_state.memory_offset > memory.size) {
+        return false;
+    }
+    transfer_image->create_info = image_state.create_info;
+    transfer_image->data = static_cast<uint8_t*>(memory.data) + image_state.memory_offset;
+    transfer_image->size = memory.size - image_state.memory_offset;
+    return true;
+}
+
+// Returns null if the subresource doesn't exist or doesn't fit in the memory bound to the image
+static uint8_t* GetTransferSubresource(const TransferImage& image, uint32_t mip_level, uint32_t array_layer) {
+    const auto& create_info = image.create_info;
+    if (mip_level >= create_info.mipLevels || array_layer >= create_info.arrayLayers) {
+        return nullptr;
+    }
+    const VkDeviceSize offset = GetSubresourceOffset(create_info, mip_level, array_layer);
+    if (offset + GetSubresourceSize(create_info, mip_level) > image.size) {
+        return nullptr;
+    }
+    return image.data + offset;
+}
+
+static bool IsCombinedDepthStencilFormat(VkFormat format) {
+    return format == VK_FORMAT_D16_UNORM_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT ||
+           format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+}
+
+// Adds the rows of a region copied between a buffer and an image, in either direction
+static void AddBufferImageCopy(TransferBatch* batch, VkBuffer buffer, const TransferImage& image,
+                               const VkBufferImageCopy& region, bool to_image) {
+    const auto& create_info = image.create_info;
+    const auto& subresource = region.imageSubresource;
+    const auto& offset = region.imageOffset;
+    const auto& extent = region.imageExtent;
+    const uint32_t mip = subresource.mipLevel;
+    if (IsCombinedDepthStencilFormat(create_info.format) || mip >= create_info.mipLevels || offset.x < 0 || offset.y < 0 ||
+        offset.z < 0 || !extent.width || !extent.height || !extent.depth || !subresource.layerCount) {
+        return;
+    }
+    const uint32_t width = std::max(create_info.extent.width >> mip, 1u);
+    const uint32_t height = std::max(create_info.extent.height >> mip, 1u);
+    const uint32_t depth = std::max(create_info.extent.depth >> mip, 1u);
+    if ((uint64_t)offset.x + extent.width > width || (uint64_t)offset.y + extent.height > height ||
+        (uint64_t)offset.z + extent.depth > depth) {
+        return;
+    }
+    // Compressed formats move whole blocks, so rows are rows of blocks
+    const FormatBlockInfo block = GetFormatBlockInfo(create_info.format);
+    const VkDeviceSize row_size = (VkDeviceSize)(extent.width + block.width - 1) / block.width * block.size;
+    const uint32_t rows = (extent.height + block.height - 1) / block.height;
+    const VkDeviceSize image_row_pitch = GetSubresourceRowPitch(create_info, mip);
+    const VkDeviceSize image_slice_pitch = GetSubresourceDepthPitch(create_info, mip);
+    const VkDeviceSize image_start = offset.z * image_slice_pitch + offset.y / block.height * image_row_pitch +
+                                     (VkDeviceSize)(offset.x / block.width) * block.size;
+    // A row length or image height of 0 means the buffer is packed as tightly as the region
+    const uint32_t buffer_row_length = region.bufferRowLength ? region.bufferRowLength : extent.width;
+    const uint32_t buffer_image_height = region.bufferImageHeight ? region.bufferImageHeight : extent.height;
+    const VkDeviceSize buffer_row_pitch = (VkDeviceSize)(buffer_row_length + block.width - 1) / block.width * block.size;
+    const VkDeviceSize buffer_slice_pitch =
+        (VkDeviceSize)(buffer_image_height + block.height - 1) / block.height * buffer_row_pitch;
+    const uint64_t slice_count = (uint64_t)subresource.layerCount * extent.depth;
+    uint8_t* buffer_data = GetBufferData(buffer, region.bufferOffset,
+                                         (slice_count - 1) * buffer_slice_pitch + (rows - 1) * buffer_row_pitch + row_size);
+    if (!buffer_data || row_size > buffer_row_pitch) {
+        return;
+    }
+    // Slices whose rows are packed the same way on both sides move in one piece
+    const bool packed = row_size == image_row_pitch && row_size == buffer_row_pitch;
+    const uint32_t range_count = packed ? 1 : rows;
+    const size_t range_size = (size_t)(packed ? row_size * rows : row_size);
+    for (uint32_t layer = 0; layer < subresource.layerCount; ++layer) {
+        uint8_t* subresource_data = GetTransferSubresource(image, mip, subresource.baseArrayLayer + layer);
+        if (!subresource_data) {
+            continue;
+        }
+        for (uint32_t z = 0; z < extent.depth; ++z) {
+            uint8_t* image_slice = subresource_data + image_start + z * image_slice_pitch;
+            uint8_t* buffer_slice = buffer_data + ((uint64_t)layer * extent.depth + z) * buffer_slice_pitch;
+            for (uint32_t row = 0; row < range_count; ++row) {
+                uint8_t* image_row = image_slice + row * image_row_pitch;
+                uint8_t* buffer_row = buffer_slice + row * buffer_row_pitch;
+                if (to_image) {
+                    batch->Add(image_row, buffer_row, range_size);
+                } else {
+                    batch->Add(buffer_row, image_row, range_size);
+                }
+            }
+        }
+    }
+}
+
+// Packs a clear color into a texel of the format and returns its size, or 0 if the format can't be cleared. That's the
+//  formats the rasterizer draws to, and formats made of 32 bit components, whose texels are the clear color's own bits.
+static uint32_t PackClearColor(VkFormat format, const VkClearColorValue& color, uint8_t texel[16]) {
+    if (IsRasterColorFormat(format)) {
+        const uint32_t packed = PackColor(color.float32, format);
+        memcpy(texel, &packed, sizeof(packed));
+        return sizeof(packed);
+    }
+    if (format >= VK_FORMAT_R32_UINT && format <= VK_FORMAT_R32G32B32A32_SFLOAT) {
+        const uint32_t size = GetFormatBlockInfo(format).size;
+        memcpy(texel, color.uint32, size);
+        return size;
+    }
+    return 0;
+}
+
+// Adds every subresource in the range to a batch whose pattern is the clear color
+static void AddClearColorImage(TransferBatch* batch, const TransferImage& image, const VkImageSubresourceRange& range) {
+    const auto& create_info = image.create_info;
+    const uint32_t level_end =
+        (uint32_t)std::min<uint64_t>((uint64_t)range.baseMipLevel + range.levelCount, create_info.mipLevels);
+    const uint32_t layer_end =
+        (uint32_t)std::min<uint64_t>((uint64_t)range.baseArrayLayer + range.layerCount, create_info.arrayLayers);
+    for (uint32_t layer = range.baseArrayLayer; layer < layer_end; ++layer) {
+        for (uint32_t mip = range.baseMipLevel; mip < level_end; ++mip) {
+            uint8_t* data = GetTransferSubresource(image, mip, layer);
+            if (data) {
+                batch->Add(data, nullptr, (size_t)GetSubresourceSize(create_info, mip));
+            }
+        }
+    }
+}
+
+static void ExecuteCommands(RasterCommandState* state, VkCommandBuffer command_buffer) {
+    WorkerPool* pool = state->device_state->worker_pool;
+    CommandReader reader(GetCommandBufferState(command_buffer));
+    EntrypointId id;
+    while (reader.Next(&id)) {
+        switch (id) {
+            case ENTRYPOINT_ID_vkCmdBindPipeline: {
+                const auto bind_point = reader.Read<VkPipelineBindPoint>();
+                const auto pipeline = reader.Read<VkPipeline>();
+                if (bind_point == VK_PIPELINE_BIND_POINT_GRAPHICS) {
+                    unique_lock_t lock(global_lock);
+                    auto pipeline_state = pipeline_map.find(pipeline);
+                    state->pipeline.drawable = false;
+                    if (pipeline_state != pipeline_map.end()) {
+                        state->pipeline = pipeline_state->second;
+                    }
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdBindDescriptorSets: {
+                const auto bind_point = reader.Read<VkPipelineBindPoint>();
+                reader.Read<VkPipelineLayout>();
+                const auto first_set = reader.Read<uint32_t>();
+                reader.Read<uint32_t>();
+                uint64_t set_count, dynamic_offset_count;
+                const VkDescriptorSet* sets = reader.ReadArray<VkDescriptorSet>(&set_count);
+                reader.Read<uint32_t>();
+                const uint32_t* dynamic_offsets = reader.ReadArray<uint32_t>(&dynamic_offset_count);
+                if (bind_point == VK_PIPELINE_BIND_POINT_GRAPHICS && first_set == 0 && set_count) {
+                    state->descriptor_set = sets[0];
+                    state->dynamic_offset = dynamic_offset_count ? dynamic_offsets[0] : 0;
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdSetViewport: {
+                const auto first_viewport = reader.Read<uint32_t>();
+                reader.Read<uint32_t>();
+                uint64_t count;
+                const VkViewport* viewports = reader.ReadArray<VkViewport>(&count);
+                if (first_viewport == 0 && count) {
+                    state->viewport = viewports[0];
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdSetScissor: {
+                const auto first_scissor = reader.Read<uint32_t>();
+                reader.Read<uint32_t>();
+                uint64_t count;
+                const VkRect2D* scissors = reader.ReadArray<VkRect2D>(&count);
+                if (first_scissor == 0 && count) {
+                    state->scissor = scissors[0];
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdBindIndexBuffer: {
+                state->index_buffer = reader.Read<VkBuffer>();
+                state->index_offset = reader.Read<VkDeviceSize>();
+                state->index_type = reader.Read<VkIndexType>();
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdBeginRenderPass: {
+                uint64_t count;
+                const VkRenderPassBeginInfo* begin_info = reader.ReadArray<VkRenderPassBeginInfo>(&count);
+                if (count && settings.rasterize) {
+                    BeginRasterRenderPass(state, *begin_info);
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdNextSubpass:
+            case ENTRYPOINT_ID_vkCmdEndRenderPass:
+                state->in_subpass = false;
+                break;
+            case ENTRYPOINT_ID_vkCmdDraw: {
+                if (!state->in_subpass || !state->pipeline.drawable) {
+                    break;
+                }
+                const auto vertex_count = reader.Read<uint32_t>();
+                const auto instance_count = reader.Read<uint32_t>();
+                const auto first_vertex = reader.Read<uint32_t>();
+                // Instances can't differ under the contract, so drawing one is as good as drawing them all
+                state->vertex_indices.clear();
+                for (uint32_t i = 0; instance_count && i < vertex_count; ++i) {
+                    state->vertex_indices.push_back(first_vertex + i);
+                }
+                ExecuteRasterDraw(state);
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdDrawIndexed: {
+                if (!state->in_subpass || !state->pipeline.drawable) {
+                    break;
+                }
+                const auto index_count = reader.Read<uint32_t>();
+                const auto instance_count = reader.Read<uint32_t>();
+                const auto first_index = reader.Read<uint32_t>();
+                const auto vertex_offset = reader.Read<int32_t>();
+                const VkDeviceSize index_size = (state->index_type == VK_INDEX_TYPE_UINT16) ? 2 : 4;
+                state->vertex_indices.clear();
+                const uint8_t* indices = GetBufferData(state->index_buffer, state->index_offset + first_index * index_size,
+                                                       index_count * index_size);
+                for (uint32_t i = 0; indices && instance_count && i < index_count; ++i) {
+                    uint32_t index = 0;
+                    memcpy(&index, indices + i * index_size, (size_t)index_size);
+                    state->vertex_indices.push_back(index + vertex_offset);
+                }
+                ExecuteRasterDraw(state);
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdExecuteCommands: {
+                reader.Read<uint32_t>();
+                uint64_t count;
+                const VkCommandBuffer* command_buffers = reader.ReadArray<VkCommandBuffer>(&count);
+                // Secondary command buffers carry on with the primary's state
+                for (uint64_t i = 0; i < count; ++i) {
+                    ExecuteCommands(state, command_buffers[i]);
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdCopyBuffer: {
+                const auto src_buffer = reader.Read<VkBuffer>();
+                const auto dst_buffer = reader.Read<VkBuffer>();
+                reader.Read<uint32_t>();
+                uint64_t count;
+                const VkBufferCopy* regions = reader.ReadArray<VkBufferCopy>(&count);
+                TransferBatch batch;
+                for (uint64_t i = 0; i < count; ++i) {
+                    const uint8_t* src = GetBufferData(src_buffer, regions[i].srcOffset, regions[i].size);
+                    uint8_t* dst = GetBufferData(dst_buffer, regions[i].dstOffset, regions[i].size);
+                    if (src && dst) {
+                        batch.Add(dst, src, (size_t)regions[i].size);
+                    }
+                }
+                batch.Run(pool);
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdCopyBufferToImage:
+            case ENTRYPOINT_ID_vkCmdCopyImageToBuffer: {
+                const bool to_image = id == ENTRYPOINT_ID_vkCmdCopyBufferToImage;
+                // The buffer comes first when copying to the image, and after the image's layout otherwise
+                VkBuffer buffer = to_image ? reader.Read<VkBuffer>() : VK_NULL_HANDLE;
+                const auto image = reader.Read<VkImage>();
+                reader.Read<VkImageLayout>();
+                if (!to_image) {
+                    buffer = reader.Read<VkBuffer>();
+                }
+                reader.Read<uint32_t>();
+                uint64_t count;
+                const VkBufferImageCopy* regions = reader.ReadArray<VkBufferImageCopy>(&count);
+                TransferImage transfer_image;
+                if (!GetTransferImage(image, &transfer_image)) {
+                    break;
+                }
+                TransferBatch batch;
+                for (uint64_t i = 0; i < count; ++i) {
+                    AddBufferImageCopy(&batch, buffer, transfer_image, regions[i], to_image);
+                }
+                batch.Run(pool);
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdUpdateBuffer: {
+                const auto dst_buffer = reader.Read<VkBuffer>();
+                const auto dst_offset = reader.Read<VkDeviceSize>();
+                reader.Read<VkDeviceSize>();
+                uint64_t size;
+                const uint8_t* data = reader.ReadArray<uint8_t>(&size);
+                uint8_t* dst = GetBufferData(dst_buffer, dst_offset, size);
+                if (data && dst) {
+                    TransferBatch batch;
+                    batch.Add(dst, data, (size_t)size);
+                    batch.Run(pool);
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdFillBuffer: {
+                const auto dst_buffer = reader.Read<VkBuffer>();
+                const auto dst_offset = reader.Read<VkDeviceSize>();
+                auto size = reader.Read<VkDeviceSize>();
+                const auto data = reader.Read<uint32_t>();
+                if (size == VK_WHOLE_SIZE) {
+                    // Whole size fills stop at the last whole word of the buffer
+                    BufferState buffer_state;
+                    if (!buffer_map.Find(dst_buffer, &buffer_state) || dst_offset > buffer_state.size) {
+                        break;
+                    }
+                    size = (buffer_state.size - dst_offset) & ~(VkDeviceSize)3;
+                }
+                uint8_t* dst = GetBufferData(dst_buffer, dst_offset, size);
+                if (dst) {
+                    TransferBatch batch;
+                    batch.SetPattern(reinterpret_cast<const uint8_t*>(&data), sizeof(data));
+                    batch.Add(dst, nullptr, (size_t)(size & ~(VkDeviceSize)3));
+                    batch.Run(pool);
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdClearColorImage: {
+                const auto image = reader.Read<VkImage>();
+                reader.Read<VkImageLayout>();
+                uint64_t color_count, range_count;
+                const VkClearColorValue* color = reader.ReadArray<VkClearColorValue>(&color_count);
+                reader.Read<uint32_t>();
+                const VkImageSubresourceRange* ranges = reader.ReadArray<VkImageSubresourceRange>(&range_count);
+                TransferImage transfer_image;
+                uint8_t texel[16];
+                uint32_t texel_size = 0;
+                if (!color || !GetTransferImage(image, &transfer_image) ||
+                    !(texel_size = PackClearColor(transfer_image.create_info.format, *color, texel))) {
+                    break;
+                }
+                TransferBatch batch;
+                batch.SetPattern(texel, texel_size);
+                for (uint64_t i = 0; i < range_count; ++i) {
+                    AddClearColorImage(&batch, transfer_image, ranges[i]);
+                }
+                batch.Run(pool);
+                break;
+            }
+            // Events change state as the walk gets to them, so the host sees them in order with the transfers
+            case ENTRYPOINT_ID_vkCmdSetEvent:
+            case ENTRYPOINT_ID_vkCmdResetEvent: {
+                SetEventState(reader.Read<VkEvent>(), id == ENTRYPOINT_ID_vkCmdSetEvent);
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdWaitEvents: {
+                // Only a queue worker can wait for the host to set an event. Without the simulated timeline the walk
+                //  runs inside vkQueueSubmit, on the very thread that would have to set it.
+                if (!settings.simulate_queues) {
+                    break;
+                }
+                reader.Read<uint32_t>();
+                uint64_t event_count;
+                const VkEvent* events = reader.ReadArray<VkEvent>(&event_count);
+                unique_lock_t lock(sync_lock);
+                sync_cv.wait(lock, [events, event_count] {
+                    for (uint64_t i = 0; i < event_count; ++i) {
+                        auto event_state = event_map.find(events[i]);
+                        if (event_state != event_map.end() && !event_state->second.signaled) {
+                            return false;
+                        }
+                    }
+                    return true;
+                });
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+static void ExecuteCommandBuffer(DeviceState* device_state, VkCommandBuffer command_buffer) {
+    const auto command_buffer_state = GetCommandBufferState(command_buffer);
+    if (!settings.rasterize && !command_buffer_state->has_transfers && !command_buffer_state->has_events) {
+        return;
+    }
+    RasterCommandState state = {};
+    state.device_state = device_state;
+    ExecuteCommands(&state, command_buffer);
+}
+
+// Query execution. Command buffers that touch queries are walked once the timeline is done with them, so their queries
+//  become available along with the rest of the work. Shaders are never looked at, so draws are counted as triangle
+//  lists, each compute workgroup as a single invocation, and no samples ever pass an occlusion query.
+struct ActiveQuery {
+    VkQueryPool pool;
+    uint32_t query;
+    uint64_t counters[PIPELINE_STATISTIC_COUNT];  // The counters when the query began
+};
+
+struct QueryCommandState {
+    // What the commands walked so far did, by pipeline statistic bit index
+    uint64_t counters[PIPELINE_STATISTIC_COUNT];
+    std::vector<ActiveQuery> active_queries;
+};
+
+static void CountQueryDraw(QueryCommandState* state, uint64_t vertex_count, uint64_t instance_count) {
+    const uint64_t vertices = vertex_count * instance_count;
+    const uint64_t primitives = vertex_count / 3 * instance_count;
+    state->counters[0] += vertices;    // VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_VERTICES_BIT
+    state->counters[1] += primitives;  // VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT
+    state->counters[2] += vertices;    // VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT
+    state->counters[5] += primitives;  // VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT
+    state->counters[6] += primitives;  // VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT
+}
+
+// The draw parameters of indirect draws, whose vertex or index count and instance count come first either way
+static void CountQueryIndirectDraws(QueryCommandState* state, VkBuffer buffer, VkDeviceSize offset, uint32_t draw_count,
+                                    uint32_t stride) {
+    for (uint32_t i = 0; i < draw_count; ++i) {
+        const uint8_t* data = GetBufferData(buffer, offset + (VkDeviceSize)i * stride, 2 * sizeof(uint32_t));
+        if (data) {
+            uint32_t counts[2];
+            memcpy(counts, data, sizeof(counts));
+            CountQueryDraw(state, counts[0], counts[1]);
+        }
+    }
+}
+
+static QueryState* GetQuery(VkQueryPool query_pool, uint32_t query) {
+    auto pool_state = query_pool_map.find(query_pool);
+    if (pool_state == query_pool_map.end() || query >= pool_state->second.queries.size()) {
+        return nullptr;
+    }
+    return &pool_state->second.queries[query];
+}
+
+// Must be called with query_lock held
+static void ExecuteQueryCommands(QueryCommandState* state, VkCommandBuffer command_buffer, uint64_t begin_ns) {
+    CommandReader reader(GetCommandBufferState(command_buffer));
+    // Each command starts once the ones before it have taken their cost of the timeline
+    uint64_t time_ns = begin_ns;
+    EntrypointId id;
+    while (reader.Next(&id)) {
+        const uint64_t command_begin_ns = time_ns;
+        time_ns += settings.command_costs_ns[id];
+        switch (id) {
+            case ENTRYPOINT_ID_vkCmdResetQueryPool: {
+                const auto query_pool = reader.Read<VkQueryPool>();
+                const auto first_query = reader.Read<uint32_t>();
+                const auto query_count = reader.Read<uint32_t>();
+                for (uint32_t i = 0; i < query_count; ++i) {
+                    QueryState* query = GetQuery(query_pool, first_query + i);
+                    if (query) {
+                        *query = QueryState();
+                    }
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdBeginQuery: {
+                ActiveQuery active_query;
+                active_query.pool = reader.Read<VkQueryPool>();
+                active_query.query = reader.Read<uint32_t>();
+                memcpy(active_query.counters, state->counters, sizeof(state->counters));
+                QueryState* query = GetQuery(active_query.pool, active_query.query);
+                if (query) {
+                    *query = QueryState();
+                    state->active_queries.push_back(active_query);
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdEndQuery: {
+                const auto query_pool = reader.Read<VkQueryPool>();
+                const auto query_index = reader.Read<uint32_t>();
+                QueryState* query = GetQuery(query_pool, query_index);
+                for (auto active_query = state->active_queries.begin(); query && active_query != state->active_queries.end();
+                     ++active_query) {
+                    if (active_query->pool == query_pool && active_query->query == query_index) {
+                        for (uint32_t i = 0; i < PIPELINE_STATISTIC_COUNT; ++i) {
+                            query->values[i] = state->counters[i] - active_query->counters[i];
+                        }
+                        // Occlusion queries share values[0] with the input assembly vertices, but no samples pass
+                        if (query_pool_map[query_pool].type != VK_QUERY_TYPE_PIPELINE_STATISTICS) {
+                            query->values[0] = 0;
+                        }
+                        query->available = true;
+                        state->active_queries.erase(active_query);
+                        break;
+                    }
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdWriteTimestamp: {
+                reader.Read<VkPipelineStageFlagBits>();
+                const auto query_pool = reader.Read<VkQueryPool>();
+                QueryState* query = GetQuery(query_pool, reader.Read<uint32_t>());
+                if (query) {
+                    query->values[0] = begin_ns ? command_begin_ns : GetSteadyClockNs();
+                    query->available = true;
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdCopyQueryPoolResults: {
+                const auto query_pool = reader.Read<VkQueryPool>();
+                const auto first_query = reader.Read<uint32_t>();
+                const auto query_count = reader.Read<uint32_t>();
+                const auto dst_buffer = reader.Read<VkBuffer>();
+                const auto dst_offset = reader.Read<VkDeviceSize>();
+                const auto stride = reader.Read<VkDeviceSize>();
+                const auto flags = reader.Read<VkQueryResultFlags>();
+                auto pool_state = query_pool_map.find(query_pool);
+                if (pool_state == query_pool_map.end() || !query_count) {
+                    break;
+                }
+                const VkDeviceSize size = (query_count - 1) * stride + GetQueryResultSize(pool_state->second, flags);
+                uint8_t* data = GetBufferData(dst_buffer, dst_offset, size);
+                if (data) {
+                    WriteQueryResults(pool_state->second, first_query, query_count, data, size, stride, flags);
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdDraw:
+            case ENTRYPOINT_ID_vkCmdDrawIndexed: {
+                const auto count = reader.Read<uint32_t>();
+                CountQueryDraw(state, count, reader.Read<uint32_t>());
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdDrawIndirect:
+            case ENTRYPOINT_ID_vkCmdDrawIndexedIndirect: {
+                const auto buffer = reader.Read<VkBuffer>();
+                const auto offset = reader.Read<VkDeviceSize>();
+                const auto draw_count = reader.Read<uint32_t>();
+                CountQueryIndirectDraws(state, buffer, offset, draw_count, reader.Read<uint32_t>());
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdDispatch: {
+                const uint64_t x = reader.Read<uint32_t>();
+                const uint64_t y = reader.Read<uint32_t>();
+                // VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT
+                state->counters[10] += x * y * reader.Read<uint32_t>();
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdDispatchIndirect: {
+                const auto buffer = reader.Read<VkBuffer>();
+                const auto offset = reader.Read<VkDeviceSize>();
+                const uint8_t* data = GetBufferData(buffer, offset, sizeof(VkDispatchIndirectCommand));
+                if (data) {
+                    VkDispatchIndirectCommand command;
+                    memcpy(&command, data, sizeof(command));
+                    state->counters[10] += (uint64_t)command.x * command.y * command.z;  // Compute shader invocations
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdExecuteCommands: {
+                reader.Read<uint32_t>();
+                uint64_t count;
+                const VkCommandBuffer* command_buffers = reader.ReadArray<VkCommandBuffer>(&count);
+                // Secondary command buffers run one after the other once the command's own cost is paid
+                for (uint64_t i = 0; i < count; ++i) {
+                    ExecuteQueryCommands(state, command_buffers[i], begin_ns ? time_ns : 0);
+                    time_ns += GetCommandBufferCost(command_buffers[i]);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+static void ExecuteQueryCommands(VkCommandBuffer command_buffer, uint64_t begin_ns) {
+    if (!GetCommandBufferState(command_buffer)->has_queries) {
+        return;
+    }
+    QueryCommandState state = {};
+    {
+        lock_guard_t lock(query_lock);
+        ExecuteQueryCommands(&state, command_buffer, begin_ns);
+    }
+    query_cv.notify_all();
+}
+
+// Performance lint. With VK_MOCK_LINT_FILE set, every command buffer is walked as it's ended for state it binds again
+//  while it's still bound and for barriers that stall the whole pipeline, and memory calls are watched for remapping
+//  and for small allocations, which use up maxMemoryAllocationCount. Findings are totaled for each kind, command buffer
+//  recording and frame, and written to the file ranked by count when the instance is destroyed.
+enum LintKind {
+    LINT_REDUNDANT_PIPELINE_BIND,
+    LINT_REDUNDANT_DESCRIPTOR_SET_BIND,
+    LINT_REDUNDANT_VERTEX_BUFFER_BIND,
+    LINT_REDUNDANT_INDEX_BUFFER_BIND,
+    LINT_ALL_COMMANDS_BARRIER,
+    LINT_BOTTOM_OF_PIPE_BARRIER,
+    LINT_REPEATED_MEMORY_MAP,
+    LINT_SMALL_MEMORY_ALLOCATION,
+    LINT_KIND_COUNT
+};
+
+struct LintKindInfo {
+    const char* name;
+    const char* description;
+};
+static const LintKindInfo lint_kinds[LINT_KIND_COUNT] = {
+    {"redundant_pipeline_bind", "vkCmdBindPipeline of the pipeline that's already bound"},
+    {"redundant_descriptor_set_bind", "vkCmdBindDescriptorSets of sets already bound with the same layout"},
+    {"redundant_vertex_buffer_bind", "vkCmdBindVertexBuffers of buffers and offsets already bound"},
+    {"redundant_index_buffer_bind", "vkCmdBindIndexBuffer of the index buffer already bound"},
+    {"all_commands_barrier", "vkCmdPipelineBarrier with ALL_COMMANDS or ALL_GRAPHICS stages, draining the pipeline"},
+    {"bottom_of_pipe_barrier", "vkCmdPipelineBarrier with BOTTOM_OF_PIPE stages, which waits for all prior work"},
+    {"repeated_memory_map", "vkMapMemory of memory mapped before, which could have stayed mapped"},
+    {"small_memory_allocation", "vkAllocateMemory of less than 1 MiB, instead of suballocating from a larger block"},
+};
+
+static const VkDeviceSize LINT_SMALL_ALLOCATION_SIZE = 1024 * 1024;
+// Recordings and frames listed for each kind in the report
+static const size_t LINT_WORST_COUNT = 5;
+
+struct LintRecording {
+    uint64_t command_buffer;
+    uint64_t frame;
+    uint64_t count;
+};
+
+struct LintKindStats {
+    uint64_t count;
+    uint64_t command_buffers;  // Recordings with at least one
+    std::vector<LintRecording> worst_recordings;
+    std::map<uint64_t, uint64_t> frame_counts;
+};
+
+// All lint state is guarded by lint_lock
+static mutex_t lint_lock;
+static LintKindStats lint_stats[LINT_KIND_COUNT];
+// Memory that has been mapped, and the live allocations and their peak for each device
+static unordered_map<VkDeviceMemory, VkDevice> lint_mapped_memory;
+static unordered_map<VkDevice, uint64_t> lint_live_allocations;
+static uint64_t lint_peak_allocations = 0;
+static uint64_t lint_allocation_limit = 0;
+
+// Must be called with lint_lock held
+static void AddLintFindings(LintKind kind, uint64_t command_buffer, uint64_t count) {
+    if (!count) {
+        return;
+    }
+    auto& stats = lint_stats[kind];
+    const uint64_t frame = presented_frames.load();
+    stats.count += count;
+    stats.frame_counts[frame] += count;
+    if (!command_buffer) {
+        return;
+    }
+    ++stats.command_buffers;
+    // Kept sorted, worst first
+    auto& worst = stats.worst_recordings;
+    LintRecording recording = {command_buffer, frame, count};
+    auto position =
+        std::find_if(worst.begin(), worst.end(), [count](const LintRecording& other) { return other.count < count; });
+    if (worst.size() < LINT_WORST_COUNT || position != worst.end()) {
+        worst.insert(position, recording);
+        if (worst.size() > LINT_WORST_COUNT) {
+            worst.pop_back();
+        }
+    }
+}
+
+// What the commands walked so far have bound, for one bind point
+struct LintBindings {
+    VkPipeline pipeline;
+    std::vector<std::pair<VkPipelineLayout, VkDescriptorSet>> descriptor_sets;
+};
+
+static void LintCommandBuffer(VkCommandBuffer command_buffer) {
+    uint64_t counts[LINT_KIND_COUNT] = {};
+    // Graphics and compute
+    LintBindings bindings[2] = {};
+    std::vector<std::pair<VkBuffer, VkDeviceSize>> vertex_buffers;
+    VkBuffer index_buffer = VK_NULL_HANDLE;
+    VkDeviceSize index_offset = 0;
+    VkIndexType index_type = VK_INDEX_TYPE_UINT16;
+    CommandReader reader(GetCommandBufferState(command_buffer));
+    EntrypointId id;
+    while (reader.Next(&id)) {
+        switch (id) {
+            case ENTRYPOINT_ID_vkCmdBindPipeline: {
+                const auto bind_point = reader.Read<VkPipelineBindPoint>();
+                const auto pipeline = reader.Read<VkPipeline>();
+                if (bind_point > VK_PIPELINE_BIND_POINT_COMPUTE) {
+                    break;
+                }
+                counts[LINT_REDUNDANT_PIPELINE_BIND] += bindings[bind_point].pipeline == pipeline;
+                bindings[bind_point].pipeline = pipeline;
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdBindDescriptorSets: {
+                const auto bind_point = reader.Read<VkPipelineBindPoint>();
+                const auto layout = reader.Read<VkPipelineLayout>();
+                const auto first_set = reader.Read<uint32_t>();
+                reader.Read<uint32_t>();
+                uint64_t set_count, dynamic_offset_count;
+                const VkDescriptorSet* sets = reader.ReadArray<VkDescriptorSet>(&set_count);
+                reader.Read<uint32_t>();
+                reader.ReadArray<uint32_t>(&dynamic_offset_count);
+                if (bind_point > VK_PIPELINE_BIND_POINT_COMPUTE || !set_count) {
+                    break;
+                }
+                auto& bound = bindings[bind_point].descriptor_sets;
+                if (bound.size() < first_set + set_count) {
+                    bound.resize((size_t)(first_set + set_count));
+                }
+                // New dynamic offsets are a change of state even with the same sets
+                bool redundant = !dynamic_offset_count;
+                for (uint64_t i = 0; i < set_count; ++i) {
+                    const auto binding = std::make_pair(layout, sets[i]);
+                    redundant = redundant && bound[first_set + i] == binding;
+                    bound[first_set + i] = binding;
+                }
+                counts[LINT_REDUNDANT_DESCRIPTOR_SET_BIND] += redundant;
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdBindVertexBuffers: {
+                const auto first_binding = reader.Read<uint32_t>();
+                reader.Read<uint32_t>();
+                uint64_t buffer_count, offset_count;
+                const VkBuffer* buffers = reader.ReadArray<VkBuffer>(&buffer_count);
+                const VkDeviceSize* offsets = reader.ReadArray<VkDeviceSize>(&offset_count);
+                const uint64_t count = std::min(buffer_count, offset_count);
+                if (!count) {
+                    break;
+                }
+                if (vertex_buffers.size() < first_binding + count) {
+                    vertex_buffers.resize((size_t)(first_binding + count));
+                }
+                bool redundant = true;
+                for (uint64_t i = 0; i < count; ++i) {
+                    const auto binding = std::make_pair(buffers[i], offsets[i]);
+                    redundant = redundant && binding.first != VK_NULL_HANDLE && vertex_buffers[first_binding + i] == binding;
+                    vertex_buffers[first_binding + i] = binding;
+                }
+                counts[LINT_REDUNDANT_VERTEX_BUFFER_BIND] += redundant;
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdBindIndexBuffer: {
+                const auto buffer = reader.Read<VkBuffer>();
+                const auto offset = reader.Read<VkDeviceSize>();
+                const auto index_type_read = reader.Read<VkIndexType>();
+                counts[LINT_REDUNDANT_INDEX_BUFFER_BIND] += buffer != VK_NULL_HANDLE && buffer == index_buffer &&
+                                                            offset == index_offset && index_type_read == index_type;
+                index_buffer = buffer;
+                index_offset = offset;
+                index_type = index_type_read;
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdPipelineBarrier: {
+                const auto src_stages = reader.Read<VkPipelineStageFlags>();
+                const auto dst_stages = reader.Read<VkPipelineStageFlags>();
+                const VkPipelineStageFlags stages = src_stages | dst_stages;
+                if (stages & (VK_PIPELINE_STAGE_ALL_COMMANDS_BIT | VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT)) {
+                    ++counts[LINT_ALL_COMMANDS_BARRIER];
+                } else if (stages & VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT) {
+                    ++counts[LINT_BOTTOM_OF_PIPE_BARRIER];
+                }
+                break;
+            }
+            case ENTRYPOINT_ID_vkCmdExecuteCommands: {
+                // Secondary command buffers are linted as they're ended, and leave the bindings undefined
+                for (auto& bind_point_bindings : bindings) {
+                    bind_point_bindings.pipeline = VK_NULL_HANDLE;
+                    bind_point_bindings.descriptor_sets.clear();
+                }
+                vertex_buffers.clear();
+                index_buffer = VK_NULL_HANDLE;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    lock_guard_t lock(lint_lock);
+    for (uint32_t kind = 0; kind < LINT_KIND_COUNT; ++kind) {
+        AddLintFindings((LintKind)kind, (uint64_t)(uintptr_t)command_buffer, counts[kind]);
+    }
+}
+
+static void LintMapMemory(VkDevice device, VkDeviceMemory memory) {
+    lock_guard_t lock(lint_lock);
+    if (!lint_mapped_memory.insert(std::make_pair(memory, device)).second) {
+        AddLintFindings(LINT_REPEATED_MEMORY_MAP, 0, 1);
+    }
+}
+
+static void LintAllocateMemory(VkDevice device, VkDeviceSize size) {
+    const uint64_t limit = GetDeviceState(device)->profile->properties.limits.maxMemoryAllocationCount;
+    lock_guard_t lock(lint_lock);
+    const uint64_t live_allocations = ++lint_live_allocations[device];
+    // The peak that came closest to its device's limit
+    if (!lint_allocation_limit || live_allocations * lint_allocation_limit > lint_peak_allocations * limit) {
+        lint_peak_allocations = live_allocations;
+        lint_allocation_limit = limit;
+    }
+    if (size < LINT_SMALL_ALLOCATION_SIZE) {
+        AddLintFindings(LINT_SMALL_MEMORY_ALLOCATION, 0, 1);
+    }
+}
+
+static void LintFreeMemory(VkDevice device, VkDeviceMemory memory) {
+    lock_guard_t lock(lint_lock);
+    lint_mapped_memory.erase(memory);
+    auto live_allocations = lint_live_allocations.find(device);
+    if (live_allocations != lint_live_allocations.end() && live_allocations->second) {
+        --live_allocations->second;
+    }
+}
+
+// Writes the findings so far as JSON to VK_MOCK_LINT_FILE, most frequent first
+static void WriteLintReport() {
+    lock_guard_t lock(lint_lock);
+    FILE* file = fopen(settings.lint_file.c_str(), "w");
+    if (!file) {
+        return;
+    }
+    const uint64_t frames = presented_frames.load();
+    std::vector<uint32_t> kinds;
+    for (uint32_t kind = 0; kind < LINT_KIND_COUNT; ++kind) {
+        if (lint_stats[kind].count) {
+            kinds.push_back(kind);
+        }
+    }
+    std::stable_sort(kinds.begin(), kinds.end(),
+                     [](uint32_t a, uint32_t b) { return lint_stats[a].count > lint_stats[b].count; });
+    fprintf(file, "{\\n    \\"frames\\": %llu,\\n", (unsigned long long)frames);
+    fprintf(file, "    \\"memory_allocations\\": {\\"peak\\": %llu, \\"limit\\": %llu},\\n",
+            (unsigned long long)lint_peak_allocations, (unsigned long long)lint_allocation_limit);
+    fprintf(file, "    \\"findings\\": [");
+    for (size_t i = 0; i < kinds.size(); ++i) {
+        const auto& stats = lint_stats[kinds[i]];
+        uint64_t max_per_frame = 0;
+        for (const auto& frame_count : stats.frame_counts) {
+            max_per_frame = std::max(max_per_frame, frame_count.second);
+        }
+        // Frames are counted by presents, so findings before the first present are in frame 0
+        fprintf(file, "%s\\n        {\\"rank\\": %u, \\"kind\\": \\"%s\\", \\"description\\": \\"%s\\", \\"count\\": %llu, ", i ? "," : "",
+                (uint32_t)(i + 1), lint_kinds[kinds[i]].name, lint_kinds[kinds[i]].description, (unsigned long long)stats.count);
+        fprintf(file, "\\"per_frame\\": %.3f, \\"frames\\": %llu, \\"max_per_frame\\": %llu, \\"command_buffers\\": %llu,",
+                frames ? (double)stats.count / frames : 0.0, (unsigned long long)stats.frame_counts.size(),
+                (unsigned long long)max_per_frame, (unsigned long long)stats.command_buffers);
+        fprintf(file, "\\n         \\"worst_command_buffers\\": [");
+        for (size_t j = 0; j < stats.worst_recordings.size(); ++j) {
+            const auto& recording = stats.worst_recordings[j];
+            fprintf(file, "%s{\\"command_buffer\\": \\"0x%llx\\", \\"frame\\": %llu, \\"count\\": %llu}", j ? ", " : "",
+                    (unsigned long long)recording.command_buffer, (unsigned long long)recording.frame,
+                    (unsigned long long)recording.count);
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> worst_frames(stats.frame_counts.begin(), stats.frame_counts.end());
+        std::stable_sort(worst_frames.begin(), worst_frames.end(),
+                         [](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+                             return a.second > b.second;
+                         });
+        worst_frames.resize(std::min(worst_frames.size(), LINT_WORST_COUNT));
+        fprintf(file, "],\\n         \\"worst_frames\\": [");
+        for (size_t j = 0; j < worst_frames.size(); ++j) {
+            fprintf(file, "%s{\\"frame\\": %llu, \\"count\\": %llu}", j ? ", " : "", (unsigned long long)worst_frames[j].first,
+                    (unsigned long long)worst_frames[j].second);
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "\\n    ]\\n}\\n");
+    fclose(file);
+}
+'''
+
+# Structs device profiles can set members of by name, and the ProfileField tables generated for them
+PROFILE_FIELD_TABLES = [
+    ('VkPhysicalDeviceProperties', 'physical_device_properties_fields'),
+    ('VkPhysicalDeviceLimits', 'physical_device_limits_fields'),
+    ('VkPhysicalDeviceSparseProperties', 'physical_device_sparse_properties_fields'),
+    ('VkPhysicalDeviceFeatures', 'physical_device_features_fields'),
+    ('VkMemoryHeap', 'memory_heap_fields'),
+    ('VkMemoryType', 'memory_type_fields'),
+    ('VkQueueFamilyProperties', 'queue_family_properties_fields'),
+    ('VkExtent3D', 'extent_3d_fields'),
+    ('VkFormatProperties', 'format_properties_fields'),
+]
+
+# Commands that make submitting a command buffer walk it for its queries
+QUERY_COMMANDS = [
+    'vkCmdResetQueryPool',
+    'vkCmdBeginQuery',
+    'vkCmdEndQuery',
+    'vkCmdWriteTimestamp',
+    'vkCmdCopyQueryPoolResults',
+]
+
+# Commands that make submitting a command buffer walk it to execute its transfers
+TRANSFER_COMMANDS = [
+    'vkCmdCopyBuffer',
+    'vkCmdCopyBufferToImage',
+    'vkCmdCopyImageToBuffer',
+    'vkCmdUpdateBuffer',
+    'vkCmdFillBuffer',
+    'vkCmdClearColorImage',
+]
+
+# Commands that make submitting a command buffer walk it to set, reset and wait on events
+EVENT_COMMANDS = [
+    'vkCmdSetEvent',
+    'vkCmdResetEvent',
+    'vkCmdWaitEvents',
+]
+
+# Intercepts that aren't traced: the loader calls them for itself, and the replayer has no use for their results
+TRACE_UNTRACED_COMMANDS = [
+    'vkGetInstanceProcAddr',
+    'vkGetDeviceProcAddr',
+]
+
+# Manual code at the top of the trace replayer, after the entrypoint ids and trace format
+REPLAY_CPP_PREFIX = '''
+// mock_icd_replay plays back API traces that the mock ICD captured with VK_MOCK_TRACE_FILE, through the Vulkan loader and
+//  whichever ICD it loads. Calls are replayed on one thread in the order the app made them, as fast as they'll go, so
+//  the time a replay takes is the API overhead of the ICD under the traced workload, without the app. The trace is
+//  mapped copy-on-write and calls are handed pointers straight into it, with handles swapped for the ones the replayed
+//  calls returned. Anything the app wrote through memory mappings isn't in the trace, and calls whose parameters hold
+//  function pointers into the app are skipped.
+struct TraceChunkView {
+    uint8_t* data;
+    size_t size;
+};
+
+// Walks one thread's packets, reading items by the same rules TraceWriter wrote them with
+class TraceReader {
+   public:
+    explicit TraceReader(const std::vector<TraceChunkView>* chunks)
+        : chunks_(chunks), chunk_(0), offset_(0), next_chunk_(0), next_offset_(0) {}
+
+    bool Next(TracePacketHeader* header) {
+        chunk_ = next_chunk_;
+        offset_ = next_offset_;
+        const TracePacketHeader* next = ReadItems<TracePacketHeader>(1);
+        if (!next) {
+            return false;
+        }
+        *header = *next;
+        next_chunk_ = next->end_chunk;
+        next_offset_ = next->end_offset;
+        return true;
+    }
+    template <typename T>
+    T Read() {
+        const T* value = ReadItems<T>(1);
+        return value ? *value : T();
+    }
+    // Returns null for empty arrays. Arrays can be written to, so the pointers and handles in them can be fixed up.
+    template <typename T>
+    T* ReadArray(uint64_t* count = nullptr) {
+        const uint64_t size = Read<uint64_t>();
+        if (count) {
+            *count = size;
+        }
+        return size ? ReadItems<T>(size) : nullptr;
+    }
+    const char* ReadString() { return ReadArray<char>(); }
+
+   private:
+    template <typename T>
+    T* ReadItems(uint64_t count) {
+        const size_t size = GetTraceItemSize((size_t)(sizeof(T) * count));
+        if (chunk_ < chunks_->size() && offset_ + size > (*chunks_)[chunk_].size) {
+            ++chunk_;
+            offset_ = 0;
+        }
+        if (chunk_ >= chunks_->size() || offset_ + size > (*chunks_)[chunk_].size) {
+            return nullptr;
+        }
+        T* data = reinterpret_cast<T*>((*chunks_)[chunk_].data + offset_);
+        offset_ += size;
+        return data;
+    }
+
+    const std::vector<TraceChunkView>* chunks_;
+    size_t chunk_;
+    uint64_t offset_;
+    size_t next_chunk_;
+    uint64_t next_offset_;
+};
+
+// Zeroed memory for what a call writes to, and for the string arrays it reads, handed out again for the next call
+class ReplayScratch {
+   public:
+    ReplayScratch() : block_(0), used_(0) {}
+
+    template <typename T>
+    T* Allocate(uint64_t count) {
+        const size_t size = GetTraceItemSize((size_t)(sizeof(T) * count));
+        uint8_t* data = nullptr;
+        if (size > REPLAY_SCRATCH_BLOCK_SIZE) {
+            large_blocks_.emplace_back(new uint8_t[size]);
+            data = large_blocks_.back().get();
+        } else {
+            if (block_ < blocks_.size() && used_ + size > REPLAY_SCRATCH_BLOCK_SIZE) {
+                ++block_;
+                used_ = 0;
+            }
+            if (block_ == blocks_.size()) {
+                blocks_.emplace_back(new uint8_t[REPLAY_SCRATCH_BLOCK_SIZE]);
+            }
+            data = blocks_[block_].get() + used_;
+            used_ += size;
+        }
+        memset(data, 0, size);
+        return reinterpret_cast<T*>(data);
+    }
+    void Reset() {
+        block_ = 0;
+        used_ = 0;
+        large_blocks_.clear();
+    }
+
+   private:
+    static const size_t REPLAY_SCRATCH_BLOCK_SIZE = 64 * 1024;
+
+    std::vector<std::unique_ptr<uint8_t[]>> blocks_;
+    std::vector<std::unique_ptr<uint8_t[]>> large_blocks_;
+    size_t block_;
+    size_t used_;
+};
+
+// Outputs only have their size in the trace. Null ones have UINT64_MAX.
+template <typename T>
+static T* ReadOutput(TraceReader* reader, ReplayScratch* scratch) {
+    const uint64_t count = reader->Read<uint64_t>();
+    return count == UINT64_MAX ? nullptr : scratch->Allocate<T>(std::max<uint64_t>(count, 1));
+}
+
+static const char** ReadStringArray(TraceReader* reader, ReplayScratch* scratch) {
+    const uint64_t count = reader->Read<uint64_t>();
+    const char** strings = count ? scratch->Allocate<const char*>(count) : nullptr;
+    for (uint64_t i = 0; i < count; ++i) {
+        strings[i] = reader->ReadString();
+    }
+    return strings;
+}
+
+// Traced handles, 64-bit whatever their type, and the replayed handles they stand for
+static std::unordered_map<uint64_t, uint64_t> handle_map;
+
+// Handles that weren't returned by a replayed call come out null
+template <typename T>
+static T MapHandle(T handle) {
+    uint64_t value = 0;
+    memcpy(&value, &handle, sizeof(T));
+    if (value) {
+        auto replayed = handle_map.find(value);
+        value = (replayed != handle_map.end()) ? replayed->second : 0;
+    }
+    T mapped;
+    memcpy(&mapped, &value, sizeof(T));
+    return mapped;
+}
+
+// Pairs the handles the call returned when traced with the ones it returned now
+template <typename T>
+static void ReadOutputHandles(TraceReader* reader, const T* handles, uint64_t count) {
+    uint64_t traced_count = 0;
+    const uint64_t* traced = reader->ReadArray<uint64_t>(&traced_count);
+    for (uint64_t i = 0; traced && handles && i < std::min(traced_count, count); ++i) {
+        uint64_t value = 0;
+        memcpy(&value, &handles[i], sizeof(T));
+        if (traced[i]) {
+            handle_map[traced[i]] = value;
+        }
+    }
+}
+
+static uint64_t failed_calls = 0;
+
+static void CountReplayResult(VkResult result) {
+    if (result < 0) {
+        ++failed_calls;
+    }
+}
+
+// Commands are called through the loader's entrypoints, which dispatch on their first parameter, so a single table
+//  serves every instance and device in the trace
+template <typename T>
+static void LoadReplayFunction(T* function, VkInstance instance, const char* name) {
+    const PFN_vkVoidFunction address = vkGetInstanceProcAddr(instance, name);
+    if (address) {
+        *function = reinterpret_cast<T>(address);
+    }
+}
+'''
+
+# Manual code at the end of the trace replayer, after ReplayPacket()
+REPLAY_CPP_POSTFIX = '''
+struct TraceFile {
+#if defined(_WIN32)
+    std::vector<uint8_t> contents;
+#endif
+    uint8_t* data;
+    size_t size;
+    // Chunks of each thread, in the order the thread filled them
+    std::vector<std::vector<TraceChunkView>> threads;
+};
+
+static bool LoadTraceFile(const char* path, TraceFile* trace) {
+    trace->data = nullptr;
+    trace->size = 0;
+    trace->threads.clear();
+#if defined(_WIN32)
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Can't open %s\\n", path);
+        return false;
+    }
+    trace->contents.clear();
+    uint8_t buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        trace->contents.insert(trace->contents.end(), buffer, buffer + count);
+    }
+    fclose(file);
+    trace->data = trace->contents.data();
+    trace->size = trace->contents.size();
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s\\n", path);
+        return false;
+    }
+    struct stat file_stat;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        // Private and writable, so pointers and handles can be fixed up in place without touching the file
+        data = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s\\n", path);
+        return false;
+    }
+    trace->data = static_cast<uint8_t*>(data);
+    trace->size = (size_t)file_stat.st_size;
+#endif
+    TraceFileHeader header;
+    if (trace->size < sizeof(header)) {
+        fprintf(stderr, "%s is not a trace\\n", path);
+        return false;
+    }
+    memcpy(&header, trace->data, sizeof(header));
+    if (memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_FILE_VERSION) {
+        fprintf(stderr, "%s is not a trace, or is from another version of the mock ICD\\n", path);
+        return false;
+    }
+    if (header.pointer_size != sizeof(void*) || header.entrypoint_count != ENTRYPOINT_ID_COUNT ||
+        header.entrypoint_name_hash != GetEntrypointNameHash()) {
+        fprintf(stderr, "%s was traced by a mock ICD built for another platform or Vulkan version\\n", path);
+        return false;
+    }
+    size_t offset = sizeof(header);
+    while (trace->size - offset >= sizeof(TraceBlockHeader)) {
+        TraceBlockHeader block;
+        memcpy(&block, trace->data + offset, sizeof(block));
+        offset += sizeof(block);
+        if (block.size > trace->size - offset) {
+            fprintf(stderr, "%s is truncated, replaying what's there\\n", path);
+            break;
+        }
+        if (block.thread_index >= trace->threads.size()) {
+            trace->threads.resize(block.thread_index + 1);
+        }
+        TraceChunkView chunk = {trace->data + offset, block.size};
+        trace->threads[block.thread_index].push_back(chunk);
+        offset += block.size;
+    }
+    return true;
+}
+
+static void UnloadTraceFile(TraceFile* trace) {
+#if defined(_WIN32)
+    trace->contents.clear();
+#else
+    if (trace->data) {
+        munmap(trace->data, trace->size);
+    }
+#endif
+    trace->data = nullptr;
+}
+
+// Whether both paths name the same file, as far as can be told
+static bool IsSameFile(const char* path, const char* other_path) {
+#if defined(_WIN32)
+    char full_path[_MAX_PATH];
+    char full_other_path[_MAX_PATH];
+    return _fullpath(full_path, path, _MAX_PATH) && _fullpath(full_other_path, other_path, _MAX_PATH) &&
+           _stricmp(full_path, full_other_path) == 0;
+#else
+    struct stat file_stat;
+    struct stat other_file_stat;
+    return stat(path, &file_stat) == 0 && stat(other_path, &other_file_stat) == 0 &&
+           file_stat.st_dev == other_file_stat.st_dev && file_stat.st_ino == other_file_stat.st_ino;
+#endif
+}
+
+struct ReplayStats {
+    uint64_t calls;
+    uint64_t skipped_calls;
+};
+
+// Replays the packets of all threads by sequence number
+static void ReplayTrace(const TraceFile& trace, ReplayStats* stats) {
+    std::vector<TraceReader> readers;
+    std::vector<TracePacketHeader> packets(trace.threads.size());
+    std::vector<bool> pending(trace.threads.size());
+    for (size_t i = 0; i < trace.threads.size(); ++i) {
+        readers.emplace_back(&trace.threads[i]);
+        pending[i] = readers[i].Next(&packets[i]);
+    }
+    ReplayScratch scratch;
+    while (true) {
+        size_t next = trace.threads.size();
+        for (size_t i = 0; i < trace.threads.size(); ++i) {
+            if (pending[i] && (next == trace.threads.size() || packets[i].sequence < packets[next].sequence)) {
+                next = i;
+            }
+        }
+        if (next == trace.threads.size()) {
+            return;
+        }
+        if (ReplayPacket(packets[next].id, &readers[next], &scratch)) {
+            ++stats->calls;
+        } else {
+            ++stats->skipped_calls;
+        }
+        scratch.Reset();
+        pending[next] = readers[next].Next(&packets[next]);
+    }
+}
+
+} // namespace vkmock
+
+int main(int argc, char** argv) {
+    using namespace vkmock;
+    uint32_t loops = 1;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--loops") && i + 1 < argc) {
+            loops = (uint32_t)std::max(strtoul(argv[++i], nullptr, 0), 1ul);
+        } else if (!path && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            path = nullptr;
+            break;
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "Usage: %s [--loops <count>] <trace file>\\n", argv[0]);
+        return 1;
+    }
+    // A mock ICD tracing the replay to the trace being replayed would overwrite it as the replay starts
+    const char* trace_file = getenv("VK_MOCK_TRACE_FILE");
+    if (trace_file && *trace_file && IsSameFile(path, trace_file)) {
+        fprintf(stderr, "VK_MOCK_TRACE_FILE names %s, the trace to replay. Unset it or trace to another file.\\n", path);
+        return 1;
+    }
+    LoadReplayDispatch(VK_NULL_HANDLE);
+    // Every loop maps the trace afresh, since replaying fixes up the mapping in place
+    for (uint32_t loop = 0; loop < loops; ++loop) {
+        TraceFile trace;
+        if (!LoadTraceFile(path, &trace)) {
+            UnloadTraceFile(&trace);
+            return 1;
+        }
+        ReplayStats stats = {};
+        failed_calls = 0;
+        handle_map.clear();
+        const auto start = std::chrono::steady_clock::now();
+        ReplayTrace(trace, &stats);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        UnloadTraceFile(&trace);
+        printf("Loop %u: replayed %llu calls in %.3f ms, %.0f calls/s (%llu skipped, %llu failed)\\n", loop + 1,
+               (unsigned long long)stats.calls, seconds * 1000.0, seconds > 0.0 ? stats.calls / seconds : 0.0,
+               (unsigned long long)stats.skipped_calls, (unsigned long long)failed_calls);
+    }
+    return 0;
+}
+'''
+
+# The entrypoint lookup benchmark, after the entrypoint ids
+PROC_ADDR_CPP_CODE = '''
+// Lookup timings for the perfect hash behind the mock ICD's vkGetInstanceProcAddr and vkGetDeviceProcAddr: every name
+//  the ICD intercepts, then each name with a character added so the lookup has to turn it away. The loader would answer
+//  most lookups itself, so the ICD library is loaded and called directly.
+
+#if defined(_WIN32)
+static const char* const ICD_LIBRARY_NAME = "VkICD_mock_icd.dll";
+#elif defined(__APPLE__)
+static const char* const ICD_LIBRARY_NAME = "libVkICD_mock_icd.dylib";
+#else
+static const char* const ICD_LIBRARY_NAME = "libVkICD_mock_icd.so";
+#endif
+
+static void* LoadIcdLibrary(const std::string& path) {
+#if defined(_WIN32)
+    return (void*)LoadLibraryA(path.c_str());
+#else
+    return dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif
 }
-'''
 
-# Manual code at the top of the cpp source file
-SOURCE_CPP_PREFIX = '''
-using std::unordered_map;
+static void* GetIcdSymbol(void* library, const char* name) {
+#if defined(_WIN32)
+    return (void*)GetProcAddress((HMODULE)library, name);
+#else
+    return dlsym(library, name);
+#endif
+}
 
-// Map device memory handle to any mapped allocations that we'll need to free on unmap
-static unordered_map<VkDeviceMemory, std::vector<void*>> mapped_memory_map;
+static void UnloadIcdLibrary(void* library) {
+#if defined(_WIN32)
+    FreeLibrary((HMODULE)library);
+#else
+    dlclose(library);
+#endif
+}
 
-static VkPhysicalDevice physical_device = nullptr;
-static unordered_map<VkDevice, unordered_map<uint32_t, unordered_map<uint32_t, VkQueue>>> queue_map;
+struct LookupResult {
+    double seconds;
+    uint32_t found;  // Names that resolved in one pass
+};
 
-// TODO: Would like to codegen this but limits aren't in XML
-static VkPhysicalDeviceLimits SetLimits(VkPhysicalDeviceLimits *limits) {
-    limits->maxImageDimension1D = 4096;
-    limits->maxImageDimension2D = 4096;
-    limits->maxImageDimension3D = 256;
-    limits->maxImageDimensionCube = 4096;
-    limits->maxImageArrayLayers = 256;
-    limits->maxTexelBufferElements = 65536;
-    limits->maxUniformBufferRange = 16384;
-    limits->maxStorageBufferRange = 134217728;
-    limits->maxPushConstantsSize = 128;
-    limits->maxMemoryAllocationCount = 4096;
-    limits->maxSamplerAllocationCount = 4000;
-    limits->bufferImageGranularity = 1;
-    limits->sparseAddressSpaceSize = 2147483648;
-    limits->maxBoundDescriptorSets = 4;
-    limits->maxPerStageDescriptorSamplers = 16;
-    limits->maxPerStageDescriptorUniformBuffers = 12;
-    limits->maxPerStageDescriptorStorageBuffers = 4;
-    limits->maxPerStageDescriptorSampledImages = 16;
-    limits->maxPerStageDescriptorStorageImages = 4;
-    limits->maxPerStageDescriptorInputAttachments = 4;
-    limits->maxPerStageResources = 128^2;
-    limits->maxDescriptorSetSamplers = 96^8;
-    limits->maxDescriptorSetUniformBuffers = 72^8;
-    limits->maxDescriptorSetUniformBuffersDynamic = 8;
-    limits->maxDescriptorSetStorageBuffers = 24^8;
-    limits->maxDescriptorSetStorageBuffersDynamic = 4;
-    limits->maxDescriptorSetSampledImages = 96^8;
-    limits->maxDescriptorSetStorageImages = 24^8;
-    limits->maxDescriptorSetInputAttachments = 4;
-    limits->maxVertexInputAttributes = 16;
-    limits->maxVertexInputBindings = 16;
-    limits->maxVertexInputAttributeOffset = 2047;
-    limits->maxVertexInputBindingStride = 2048;
-    limits->maxVertexOutputComponents = 64;
-    limits->maxTessellationGenerationLevel = 64;
-    limits->maxTessellationPatchSize = 32;
-    limits->maxTessellationControlPerVertexInputComponents = 64;
-    limits->maxTessellationControlPerVertexOutputComponents = 64;
-    limits->maxTessellationControlPerPatchOutputComponents = 120;
-    limits->maxTessellationControlTotalOutputComponents = 2048;
-    limits->maxTessellationEvaluationInputComponents = 64;
-    limits->maxTessellationEvaluationOutputComponents = 64;
-    limits->maxGeometryShaderInvocations = 32;
-    limits->maxGeometryInputComponents = 64;
-    limits->maxGeometryOutputComponents = 64;
-    limits->maxGeometryOutputVertices = 256;
-    limits->maxGeometryTotalOutputComponents = 1024;
-    limits->maxFragmentInputComponents = 64;
-    limits->maxFragmentOutputAttachments = 4;
-    limits->maxFragmentDualSrcAttachments = 1;
-    limits->maxFragmentCombinedOutputResources = 4;
-    limits->maxComputeSharedMemorySize = 16384;
-    limits->maxComputeWorkGroupCount[0] = 65535;
-    limits->maxComputeWorkGroupCount[1] = 65535;
-    limits->maxComputeWorkGroupCount[2] = 65535;
-    limits->maxComputeWorkGroupInvocations = 128;
-    limits->maxComputeWorkGroupSize[0] = 128;
-    limits->maxComputeWorkGroupSize[1] = 128;
-    limits->maxComputeWorkGroupSize[2] = 64;
-    limits->subPixelPrecisionBits = 4;
-    limits->subTexelPrecisionBits = 4;
-    limits->mipmapPrecisionBits = 4;
-    limits->maxDrawIndexedIndexValue = (2^32) - 1;
-    limits->maxDrawIndirectCount = (2^16) - 1;
-    limits->maxSamplerLodBias = 2.0f;
-    limits->maxSamplerAnisotropy = 16;
-    limits->maxViewports = 16;
-    limits->maxViewportDimensions[0] = 4096;
-    limits->maxViewportDimensions[1] = 4096;
-    limits->viewportBoundsRange[0] = -8192;
-    limits->viewportBoundsRange[1] = 8191;
-    limits->viewportSubPixelBits = 0;
-    limits->minMemoryMapAlignment = 64;
-    limits->minTexelBufferOffsetAlignment = 16;
-    limits->minUniformBufferOffsetAlignment = 16;
-    limits->minStorageBufferOffsetAlignment = 16;
-    limits->minTexelOffset = -8;
-    limits->maxTexelOffset = 7;
-    limits->minTexelGatherOffset = -8;
-    limits->maxTexelGatherOffset = 7;
-    limits->minInterpolationOffset = 0.0f;
-    limits->maxInterpolationOffset = 0.5f;
-    limits->subPixelInterpolationOffsetBits = 4;
-    limits->maxFramebufferWidth = 4096;
-    limits->maxFramebufferHeight = 4096;
-    limits->maxFramebufferLayers = 256;
-    limits->framebufferColorSampleCounts = 0x7F;
-    limits->framebufferDepthSampleCounts = 0x7F;
-    limits->framebufferStencilSampleCounts = 0x7F;
-    limits->framebufferNoAttachmentsSampleCounts = 0x7F;
-    limits->maxColorAttachments = 4;
-    limits->sampledImageColorSampleCounts = 0x7F;
-    limits->sampledImageIntegerSampleCounts = 0x7F;
-    limits->sampledImageDepthSampleCounts = 0x7F;
-    limits->sampledImageStencilSampleCounts = 0x7F;
-    limits->storageImageSampleCounts = 0x7F;
-    limits->maxSampleMaskWords = 1;
-    limits->timestampComputeAndGraphics = VK_TRUE;
-    limits->timestampPeriod = 1;
-    limits->maxClipDistances = 8;
-    limits->maxCullDistances = 8;
-    limits->maxCombinedClipAndCullDistances = 8;
-    limits->discreteQueuePriorities = 2;
-    limits->pointSizeRange[0] = 1.0f;
-    limits->pointSizeRange[1] = 64.0f;
-    limits->lineWidthRange[0] = 1.0f;
-    limits->lineWidthRange[1] = 8.0f;
-    limits->pointSizeGranularity = 1.0f;
-    limits->lineWidthGranularity = 1.0f;
-    limits->strictLines = VK_TRUE;
-    limits->standardSampleLocations = VK_TRUE;
-    limits->optimalBufferCopyOffsetAlignment = 1;
-    limits->optimalBufferCopyRowPitchAlignment = 1;
-    limits->nonCoherentAtomSize = 256;
+// Looks every name up iterations times through lookup, which is called as lookup(object, name)
+template <typename Object, typename Lookup>
+static LookupResult TimeLookups(Lookup lookup, Object object, const std::vector<const char*>& names, uint32_t iterations) {
+    LookupResult result = {0.0, 0};
+    uint64_t found = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        for (auto name : names) {
+            found += lookup(object, name) != nullptr;
+        }
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.found = (uint32_t)(found / iterations);
+    return result;
+}
 
-    return *limits;
+static void PrintLookups(const char* label, const LookupResult& result, size_t name_count, uint32_t iterations) {
+    const double lookups = (double)name_count * iterations;
+    printf("%-38s %10u %12.1f %14.0f\\n", label, result.found, result.seconds * 1e9 / lookups, lookups / result.seconds);
 }
 
-void SetBoolArrayTrue(VkBool32* bool_array, uint32_t num_bools)
-{
-    for (uint32_t i = 0; i < num_bools; ++i) {
-        bool_array[i] = VK_TRUE;
+} // namespace vkmock
+
+int main(int argc, char** argv) {
+    using namespace vkmock;
+    uint32_t iterations = 1000;
+    std::string icd_path;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--icd") && i + 1 < argc) {
+            icd_path = argv[++i];
+        } else if (!ParseCountOption(argc, argv, &i, "--iterations", &iterations)) {
+            fprintf(stderr, "Usage: %s [--iterations <count>] [--icd <mock ICD library>]\\n", argv[0]);
+            return 1;
+        }
+    }
+    if (icd_path.empty()) {
+        // The ICD is built next to this tool
+        const std::string tool_path = argv[0];
+        const size_t separator = tool_path.find_last_of("/\\\\");
+        icd_path = (separator == std::string::npos) ? "" : tool_path.substr(0, separator + 1);
+        icd_path += ICD_LIBRARY_NAME;
+    }
+
+    void* library = LoadIcdLibrary(icd_path);
+    if (!library) {
+        fprintf(stderr, "Can't load %s\\n", icd_path.c_str());
+        return 1;
+    }
+    auto negotiate = (PFN_vkNegotiateLoaderICDInterfaceVersion)GetIcdSymbol(library, "vk_icdNegotiateLoaderICDInterfaceVersion");
+    auto get_instance_proc_addr = (PFN_vkGetInstanceProcAddr)GetIcdSymbol(library, "vk_icdGetInstanceProcAddr");
+    if (!negotiate || !get_instance_proc_addr) {
+        fprintf(stderr, "%s is not an ICD\\n", icd_path.c_str());
+        UnloadIcdLibrary(library);
+        return 1;
+    }
+    uint32_t interface_version = 5;
+    negotiate(&interface_version);
+
+    // The ICD's dispatchable handles don't need a loader's dispatch table, so its entrypoints can be called directly
+    BenchmarkDevice bench;
+    if (!CreateBenchmarkDevice(get_instance_proc_addr, "mock_icd_proc_addr", &bench)) {
+        UnloadIcdLibrary(library);
+        return 1;
     }
+
+    std::vector<const char*> names(entrypoint_names, entrypoint_names + ENTRYPOINT_ID_COUNT);
+    std::vector<std::string> miss_strings;
+    for (auto name : names) {
+        miss_strings.push_back(std::string(name) + "X");
+    }
+    std::vector<const char*> misses;
+    for (const auto& miss : miss_strings) {
+        misses.push_back(miss.c_str());
+    }
+
+    printf("%u entrypoint names\\n", (uint32_t)names.size());
+    printf("%-38s %10s %12s %14s\\n", "Lookup", "Found", "ns/lookup", "lookups/s");
+    PrintLookups("vkGetInstanceProcAddr", TimeLookups(get_instance_proc_addr, bench.instance, names, iterations),
+                 names.size(), iterations);
+    PrintLookups("vkGetInstanceProcAddr, unknown names",
+                 TimeLookups(get_instance_proc_addr, bench.instance, misses, iterations), misses.size(), iterations);
+    PrintLookups("vkGetDeviceProcAddr", TimeLookups(bench.GetDeviceProcAddr, bench.device, names, iterations),
+                 names.size(), iterations);
+    PrintLookups("vkGetDeviceProcAddr, unknown names",
+                 TimeLookups(bench.GetDeviceProcAddr, bench.device, misses, iterations), misses.size(), iterations);
+
+    DestroyBenchmarkDevice(&bench);
+    UnloadIcdLibrary(library);
+    return 0;
 }
 '''
 
@@ -193,12 +5751,8 @@ SOURCE_CPP_POSTFIX = '''
 
 static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL GetPhysicalDeviceProcAddr(VkInstance instance, const char *funcName) {
     // TODO: This function should only care about physical device functions and return nullptr for other functions
-    const auto &item = name_to_funcptr_map.find(funcName);
-    if (item != name_to_funcptr_map.end()) {
-        return reinterpret_cast<PFN_vkVoidFunction>(item->second);
-    }
-    // Mock should intercept all functions so if we get here just return null
-    return nullptr;
+    // Mock should intercept all functions so if it isn't found just return null
+    return reinterpret_cast<PFN_vkVoidFunction>(FindEntrypoint(instance_entrypoint_table, funcName));
 }
 
 } // namespace vkmock
@@ -395,6 +5949,18 @@ EXPORT VKAPI_ATTR VkResult VKAPI_CALL vkGetPhysicalDeviceSurfaceCapabilities2EXT
     return vkmock::GetPhysicalDeviceSurfaceCapabilities2EXT(physicalDevice, surface, pSurfaceCapabilities);
 }
 
+#ifdef VK_EXT_headless_surface
+
+EXPORT VKAPI_ATTR VkResult VKAPI_CALL vkCreateHeadlessSurfaceEXT(
+    VkInstance                                  instance,
+    const VkHeadlessSurfaceCreateInfoEXT*       pCreateInfo,
+    const VkAllocationCallbacks*                pAllocator,
+    VkSurfaceKHR*                               pSurface)
+{
+    return vkmock::CreateHeadlessSurfaceEXT(instance, pCreateInfo, pAllocator, pSurface);
+}
+#endif /* VK_EXT_headless_surface */
+
 #ifdef VK_USE_PLATFORM_IOS_MVK
 
 EXPORT VKAPI_ATTR VkResult VKAPI_CALL vkCreateIOSSurfaceMVK(
@@ -431,58 +5997,396 @@ CUSTOM_C_INTERCEPTS = {
     if (loader_interface_version <= 4) {
         return VK_ERROR_INCOMPATIBLE_DRIVER;
     }
-    *pInstance = (VkInstance)CreateDispObjHandle();
-    // TODO: If emulating specific device caps, will need to add intelligence here
+    auto instance_state = new InstanceState;
+    for (uint32_t i = 0; i < settings.physical_device_count; ++i) {
+        auto physical_device_state = new PhysicalDeviceState;
+        physical_device_state->index = i;
+        physical_device_state->profile = GetPhysicalDeviceProfileAt(i);
+        for (auto& heap_usage : physical_device_state->heap_usage) {
+            heap_usage = 0;
+        }
+        auto physical_device = reinterpret_cast<DispObj*>(CreateDispObjHandle());
+        physical_device->state = physical_device_state;
+        instance_state->physical_devices.push_back(reinterpret_cast<VkPhysicalDevice>(physical_device));
+    }
+    auto instance = reinterpret_cast<DispObj*>(CreateDispObjHandle());
+    instance->state = instance_state;
+    *pInstance = reinterpret_cast<VkInstance>(instance);
+#if !defined(_WIN32)
+    if (!settings.profile_file.empty()) {
+        InstallProfileSignalHandler();
+    }
+#endif
+    // TODO: If emulating specific device caps, will need to add intelligence here
+    return VK_SUCCESS;
+''',
+'vkDestroyInstance': '''
+    if (instance) {
+        auto instance_state = GetInstanceState(instance);
+        for (auto physical_device : instance_state->physical_devices) {
+            delete GetPhysicalDeviceState(physical_device);
+            DestroyDispObjHandle((void*)physical_device);
+        }
+        delete instance_state;
+        DestroyDispObjHandle((void*)instance);
+    }
+
+    if (!settings.profile_file.empty()) {
+        WriteProfileReport();
+    }
+    if (!settings.lint_file.empty()) {
+        WriteLintReport();
+    }
+''',
+'vkEnumeratePhysicalDevices': '''
+    const auto& physical_devices = GetInstanceState(instance)->physical_devices;
+    if (!pPhysicalDevices) {
+        *pPhysicalDeviceCount = (uint32_t)physical_devices.size();
+        return VK_SUCCESS;
+    }
+    const uint32_t count = std::min(*pPhysicalDeviceCount, (uint32_t)physical_devices.size());
+    std::copy(physical_devices.begin(), physical_devices.begin() + count, pPhysicalDevices);
+    *pPhysicalDeviceCount = count;
+    return (count < physical_devices.size()) ? VK_INCOMPLETE : VK_SUCCESS;
+''',
+'vkEnumeratePhysicalDeviceGroupsKHR': '''
+    // Physical devices are grouped in enumeration order, device_group_size at a time
+    const auto& physical_devices = GetInstanceState(instance)->physical_devices;
+    const uint32_t group_size = settings.device_group_size;
+    const uint32_t group_count = ((uint32_t)physical_devices.size() + group_size - 1) / group_size;
+    if (!pPhysicalDeviceGroupProperties) {
+        *pPhysicalDeviceGroupCount = group_count;
+        return VK_SUCCESS;
+    }
+    const uint32_t count = std::min(*pPhysicalDeviceGroupCount, group_count);
+    for (uint32_t i = 0; i < count; ++i) {
+        auto& group = pPhysicalDeviceGroupProperties[i];
+        const uint32_t first = i * group_size;
+        group.physicalDeviceCount = std::min(group_size, (uint32_t)physical_devices.size() - first);
+        std::copy(physical_devices.begin() + first, physical_devices.begin() + first + group.physicalDeviceCount,
+                  group.physicalDevices);
+        group.subsetAllocation = (group.physicalDeviceCount > 1) ? VK_TRUE : VK_FALSE;
+    }
+    *pPhysicalDeviceGroupCount = count;
+    return (count < group_count) ? VK_INCOMPLETE : VK_SUCCESS;
+''',
+'vkCreateDevice': '''
+    auto device_state = new DeviceState;
+    device_state->physical_device_state = GetPhysicalDeviceState(physicalDevice);
+    device_state->profile = &GetPhysicalDeviceProfile(physicalDevice);
+    device_state->disp_obj_pool = new DispObjPool;
+    device_state->worker_pool = new WorkerPool(settings.raster_threads);
+    // Lay out every requested queue in one flat array so GetDeviceQueue is a plain indexed load
+    for (uint32_t i = 0; i < pCreateInfo->queueCreateInfoCount; ++i) {
+        const auto &queue_create_info = pCreateInfo->pQueueCreateInfos[i];
+        if (queue_create_info.queueFamilyIndex >= device_state->queue_family_counts.size()) {
+            device_state->queue_family_counts.resize(queue_create_info.queueFamilyIndex + 1, 0);
+        }
+        auto &count = device_state->queue_family_counts[queue_create_info.queueFamilyIndex];
+        count = std::max(count, queue_create_info.queueCount);
+    }
+    uint32_t queue_count = 0;
+    for (auto count : device_state->queue_family_counts) {
+        device_state->queue_family_offsets.push_back(queue_count);
+        queue_count += count;
+    }
+    for (uint32_t i = 0; i < queue_count; ++i) {
+        device_state->queues.push_back(CreateQueue(device_state));
+    }
+    auto device = reinterpret_cast<DispObj*>(CreateDispObjHandle());
+    device->state = device_state;
+    *pDevice = reinterpret_cast<VkDevice>(device);
+    // TODO: If emulating specific device caps, will need to add intelligence here
+    return VK_SUCCESS;
+''',
+'vkDestroyDevice': '''
+    if (!device) {
+        return;
+    }
+    // First destroy sub-device objects
+    // Queues and any command buffers the app didn't free are released along with the device's pool, once the queues
+    //  have finished their work
+    auto device_state = GetDeviceState(device);
+    ForEachDeviceQueue(device_state, [](VkQueue queue) { delete GetQueueState(queue); });
+    DestroyDispObjPool(device_state->disp_obj_pool);
+    delete device_state->worker_pool;
+    delete device_state;
+    // Now destroy device
+    DestroyDispObjHandle((void*)device);
+    // TODO: If emulating specific device caps, will need to add intelligence here
+''',
+'vkGetDeviceQueue': '''
+    auto device_state = GetDeviceState(device);
+    if (queueFamilyIndex < device_state->queue_family_counts.size() &&
+        queueIndex < device_state->queue_family_counts[queueFamilyIndex]) {
+        *pQueue = device_state->queues[device_state->queue_family_offsets[queueFamilyIndex] + queueIndex];
+        return;
+    }
+    // Not a queue requested at device creation. Still hand out a stable handle rather than crash the caller.
+    lock_guard_t lock(device_state->extra_queue_lock);
+    auto &queue = device_state->extra_queues[(uint64_t(queueFamilyIndex) << 32) | queueIndex];
+    if (!queue) {
+        queue = CreateQueue(device_state);
+    }
+    *pQueue = queue;
+    // TODO: If emulating specific device caps, will need to add intelligence here
+    return;
+''',
+'vkDeviceWaitIdle': '''
+    ForEachDeviceQueue(GetDeviceState(device), WaitQueueIdle);
+    return VK_SUCCESS;
+''',
+'vkQueueWaitIdle': '''
+    WaitQueueIdle(queue);
+    return VK_SUCCESS;
+''',
+'vkQueueSubmit': '''
+    for (uint32_t i = 0; i < submitCount; ++i) {
+        const auto& submit = pSubmits[i];
+        QueueSubmission submission;
+        submission.wait_semaphores.assign(submit.pWaitSemaphores, submit.pWaitSemaphores + submit.waitSemaphoreCount);
+        submission.command_buffers.assign(submit.pCommandBuffers, submit.pCommandBuffers + submit.commandBufferCount);
+        submission.signal_semaphores.assign(submit.pSignalSemaphores, submit.pSignalSemaphores + submit.signalSemaphoreCount);
+        // The fence covers all of the batches, so it goes with the last one
+        submission.fence = (i + 1 == submitCount) ? fence : VK_NULL_HANDLE;
+        SubmitToQueue(queue, std::move(submission));
+    }
+    if (!submitCount && fence != VK_NULL_HANDLE) {
+        QueueSubmission submission;
+        submission.fence = fence;
+        SubmitToQueue(queue, std::move(submission));
+    }
+    return VK_SUCCESS;
+''',
+'vkQueueBindSparse': '''
+    // Binding is free, but the waits and signals still go through the queue in order
+    for (uint32_t i = 0; i < bindInfoCount; ++i) {
+        const auto& bind_info = pBindInfo[i];
+        QueueSubmission submission;
+        submission.wait_semaphores.assign(bind_info.pWaitSemaphores, bind_info.pWaitSemaphores + bind_info.waitSemaphoreCount);
+        submission.signal_semaphores.assign(bind_info.pSignalSemaphores, bind_info.pSignalSemaphores + bind_info.signalSemaphoreCount);
+        submission.fence = (i + 1 == bindInfoCount) ? fence : VK_NULL_HANDLE;
+        SubmitToQueue(queue, std::move(submission));
+    }
+    if (!bindInfoCount && fence != VK_NULL_HANDLE) {
+        QueueSubmission submission;
+        submission.fence = fence;
+        SubmitToQueue(queue, std::move(submission));
+    }
+    return VK_SUCCESS;
+''',
+'vkQueuePresentKHR': '''
+    presented_frames.fetch_add(1);
+    // Presentation waits behind earlier work on the queue, but costs nothing itself
+    QueueSubmission submission;
+    submission.wait_semaphores.assign(pPresentInfo->pWaitSemaphores, pPresentInfo->pWaitSemaphores + pPresentInfo->waitSemaphoreCount);
+    submission.fence = VK_NULL_HANDLE;
+    const auto *present_times = lvl_find_in_chain<VkPresentTimesInfoGOOGLE>(pPresentInfo->pNext);
+    for (uint32_t i = 0; i < pPresentInfo->swapchainCount; ++i) {
+        PresentRequest present = {pPresentInfo->pSwapchains[i], pPresentInfo->pImageIndices[i], 0, 0, 0, 0};
+        if (present_times && present_times->pTimes && i < present_times->swapchainCount) {
+            present.present_id = present_times->pTimes[i].presentID;
+            present.desired_present_time = present_times->pTimes[i].desiredPresentTime;
+        }
+        // The app gives the image up now, even if the engine only sees it once the queue gets to the present
+        lock_guard_t lock(present_lock);
+        auto engine = present_engine_map.find(present.swapchain);
+        if (engine != present_engine_map.end() && present.image_index < engine->second.images.size() &&
+            engine->second.images[present.image_index] == PRESENT_IMAGE_ACQUIRED) {
+            engine->second.images[present.image_index] = PRESENT_IMAGE_PRESENTED;
+            submission.presents.push_back(present);
+        }
+    }
+    SubmitToQueue(queue, std::move(submission));
+    if (pPresentInfo->pResults) {
+        for (uint32_t i = 0; i < pPresentInfo->swapchainCount; ++i) {
+            pPresentInfo->pResults[i] = VK_SUCCESS;
+        }
+    }
+    return VK_SUCCESS;
+''',
+'vkCreateFence': '''
+    *pFence = (VkFence)NewNonDispHandle();
+    unique_lock_t lock(sync_lock);
+    fence_map[*pFence].signaled = (pCreateInfo->flags & VK_FENCE_CREATE_SIGNALED_BIT) != 0;
+    return VK_SUCCESS;
+''',
+'vkDestroyFence': '''
+    unique_lock_t lock(sync_lock);
+    fence_map.erase(fence);
+''',
+'vkResetFences': '''
+    unique_lock_t lock(sync_lock);
+    for (uint32_t i = 0; i < fenceCount; ++i) {
+        fence_map[pFences[i]].signaled = false;
+    }
+    return VK_SUCCESS;
+''',
+'vkGetFenceStatus': '''
+    unique_lock_t lock(sync_lock);
+    return IsFenceSignaled(fence) ? VK_SUCCESS : VK_NOT_READY;
+''',
+'vkWaitForFences': '''
+    // Without the simulated timeline, submitted work completes inside vkQueueSubmit, so only fences that were never
+    //  submitted, or that another thread has yet to submit, are waited on
+    const bool wait_all = waitAll == VK_TRUE;
+    unique_lock_t lock(sync_lock);
+    const bool signaled = WaitForSync(lock, timeout, [fenceCount, pFences, wait_all] {
+        return AreFencesSignaled(fenceCount, pFences, wait_all);
+    });
+    return signaled ? VK_SUCCESS : VK_TIMEOUT;
+''',
+'vkCreateSemaphore': '''
+    *pSemaphore = (VkSemaphore)NewNonDispHandle();
+    unique_lock_t lock(sync_lock);
+    semaphore_map[*pSemaphore].signaled = false;
+    return VK_SUCCESS;
+''',
+'vkDestroySemaphore': '''
+    unique_lock_t lock(sync_lock);
+    semaphore_map.erase(semaphore);
+''',
+'vkCreateEvent': '''
+    *pEvent = (VkEvent)NewNonDispHandle();
+    unique_lock_t lock(sync_lock);
+    event_map[*pEvent].signaled = false;
+    return VK_SUCCESS;
+''',
+'vkDestroyEvent': '''
+    unique_lock_t lock(sync_lock);
+    event_map.erase(event);
+''',
+'vkSetEvent': '''
+    SetEventState(event, true);
+    return VK_SUCCESS;
+''',
+'vkResetEvent': '''
+    SetEventState(event, false);
+    return VK_SUCCESS;
+''',
+'vkGetEventStatus': '''
+    unique_lock_t lock(sync_lock);
+    auto event_state = event_map.find(event);
+    return (event_state != event_map.end() && event_state->second.signaled) ? VK_EVENT_SET : VK_EVENT_RESET;
+''',
+'vkCreateQueryPool': '''
+    *pQueryPool = (VkQueryPool)NewNonDispHandle();
+    unique_lock_t lock(query_lock);
+    auto& pool_state = query_pool_map[*pQueryPool];
+    pool_state.type = pCreateInfo->queryType;
+    pool_state.statistics = pCreateInfo->pipelineStatistics;
+    pool_state.queries.assign(pCreateInfo->queryCount, QueryState());
+    return VK_SUCCESS;
+''',
+'vkDestroyQueryPool': '''
+    unique_lock_t lock(query_lock);
+    query_pool_map.erase(queryPool);
+''',
+'vkGetQueryPoolResults': '''
+    unique_lock_t lock(query_lock);
+    auto pool_it = query_pool_map.find(queryPool);
+    if (pool_it == query_pool_map.end()) {
+        return VK_SUCCESS;
+    }
+    // Elements of the map stay put when other pools are added while waiting
+    const auto& pool_state = pool_it->second;
+    if (flags & VK_QUERY_RESULT_WAIT_BIT) {
+        // Queries no submission is going to make available would never become available, so stop waiting for them once
+        //  the simulated queues run dry
+        query_cv.wait(lock, [&pool_state, firstQuery, queryCount] {
+            return !in_flight_submissions || AreQueriesAvailable(pool_state, firstQuery, queryCount);
+        });
+    }
+    const bool available =
+        WriteQueryResults(pool_state, firstQuery, queryCount, static_cast<uint8_t*>(pData), dataSize, stride, flags);
+    return (available || (flags & VK_QUERY_RESULT_WAIT_BIT)) ? VK_SUCCESS : VK_NOT_READY;
+''',
+'vkCreateCommandPool': '''
+    *pCommandPool = (VkCommandPool)NewNonDispHandle();
+    command_pool_map.Insert(*pCommandPool, new CommandPoolState);
+    return VK_SUCCESS;
+''',
+'vkDestroyCommandPool': '''
+    CommandPoolState* pool_state = nullptr;
+    if (!command_pool_map.Erase(commandPool, &pool_state)) {
+        return;
+    }
+    // Command buffers still allocated from the pool are freed along with it
+    for (auto command_buffer : pool_state->command_buffers) {
+        auto command_buffer_state = GetCommandBufferState(command_buffer);
+        command_buffer_state->Reset();
+        delete command_buffer_state;
+        DestroyDispObjHandle((void*)command_buffer);
+    }
+    delete pool_state;
+''',
+'vkResetCommandPool': '''
+    CommandPoolState* pool_state = nullptr;
+    if (!command_pool_map.Find(commandPool, &pool_state)) {
+        return VK_SUCCESS;
+    }
+    for (auto command_buffer : pool_state->command_buffers) {
+        GetCommandBufferState(command_buffer)->Reset();
+    }
+    if (flags & VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT) {
+        pool_state->Trim();
+    }
+    return VK_SUCCESS;
+''',
+'vkTrimCommandPoolKHR': '''
+    CommandPoolState* pool_state = nullptr;
+    if (command_pool_map.Find(commandPool, &pool_state)) {
+        pool_state->Trim();
+    }
+''',
+'vkAllocateCommandBuffers': '''
+    auto pool = GetDeviceState(device)->disp_obj_pool;
+    CommandPoolState* pool_state = nullptr;
+    command_pool_map.Find(pAllocateInfo->commandPool, &pool_state);
+    for (uint32_t i = 0; i < pAllocateInfo->commandBufferCount; ++i) {
+        auto command_buffer = reinterpret_cast<DispObj*>(CreateDispObjHandle(pool));
+        auto command_buffer_state = new CommandBufferState;
+        command_buffer_state->pool = pool_state;
+        command_buffer_state->cost_ns = 0;
+        command_buffer_state->out_of_memory = false;
+        command_buffer_state->has_queries = false;
+        command_buffer_state->has_transfers = false;
+        command_buffer_state->has_events = false;
+        command_buffer->state = command_buffer_state;
+        pCommandBuffers[i] = reinterpret_cast<VkCommandBuffer>(command_buffer);
+        pool_state->command_buffers.push_back(pCommandBuffers[i]);
+    }
     return VK_SUCCESS;
 ''',
-'vkDestroyInstance': '''
-    // Destroy physical device
-    DestroyDispObjHandle((void*)physical_device);
-
-    DestroyDispObjHandle((void*)instance);
-''',
-'vkEnumeratePhysicalDevices': '''
-    if (pPhysicalDevices) {
-        if (!physical_device) {
-            physical_device = (VkPhysicalDevice)CreateDispObjHandle();
+'vkFreeCommandBuffers': '''
+    for (uint32_t i = 0; i < commandBufferCount; ++i) {
+        if (pCommandBuffers[i]) {
+            auto command_buffer_state = GetCommandBufferState(pCommandBuffers[i]);
+            auto& pool_command_buffers = command_buffer_state->pool->command_buffers;
+            pool_command_buffers.erase(std::find(pool_command_buffers.begin(), pool_command_buffers.end(), pCommandBuffers[i]));
+            command_buffer_state->Reset();
+            delete command_buffer_state;
+            DestroyDispObjHandle((void*)pCommandBuffers[i]);
         }
-        *pPhysicalDevices = physical_device;
-    } else {
-        *pPhysicalDeviceCount = 1;
     }
-    return VK_SUCCESS;
 ''',
-'vkCreateDevice': '''
-    *pDevice = (VkDevice)CreateDispObjHandle();
-    // TODO: If emulating specific device caps, will need to add intelligence here
+'vkBeginCommandBuffer': '''
+    // Beginning a command buffer implicitly resets it
+    GetCommandBufferState(commandBuffer)->Reset();
     return VK_SUCCESS;
 ''',
-'vkDestroyDevice': '''
-    unique_lock_t lock(global_lock);
-    // First destroy sub-device objects
-    // Destroy Queues
-    for (auto dev_queue_map_pair : queue_map) {
-        for (auto queue_family_map_pair : queue_map[dev_queue_map_pair.first]) {
-            for (auto index_queue_pair : queue_map[dev_queue_map_pair.first][queue_family_map_pair.first]) {
-                DestroyDispObjHandle((void*)index_queue_pair.second);
-            }
-        }
+'vkEndCommandBuffer': '''
+    if (GetCommandBufferState(commandBuffer)->out_of_memory) {
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
     }
-    queue_map.clear();
-    // Now destroy device
-    DestroyDispObjHandle((void*)device);
-    // TODO: If emulating specific device caps, will need to add intelligence here
-''',
-'vkGetDeviceQueue': '''
-    unique_lock_t lock(global_lock);
-    auto queue = queue_map[device][queueFamilyIndex][queueIndex];
-    if (queue) {
-        *pQueue = queue;
-    } else {
-        *pQueue = queue_map[device][queueFamilyIndex][queueIndex] = (VkQueue)CreateDispObjHandle();
+    if (!settings.lint_file.empty()) {
+        LintCommandBuffer(commandBuffer);
     }
-    // TODO: If emulating specific device caps, will need to add intelligence here
-    return;
+    return VK_SUCCESS;
+''',
+'vkResetCommandBuffer': '''
+    GetCommandBufferState(commandBuffer)->Reset();
+    return VK_SUCCESS;
 ''',
 'vkGetDeviceQueue2': '''
     GetDeviceQueue(device, pQueueInfo->queueFamilyIndex, pQueueInfo->queueIndex, pQueue);
@@ -659,54 +6563,54 @@ CUSTOM_C_INTERCEPTS = {
     if (!negotiate_loader_icd_interface_called) {
         loader_interface_version = 0;
     }
-    const auto &item = name_to_funcptr_map.find(pName);
-    if (item != name_to_funcptr_map.end()) {
-        return reinterpret_cast<PFN_vkVoidFunction>(item->second);
-    }
-    // Mock should intercept all functions so if we get here just return null
-    return nullptr;
+    // Mock should intercept all functions so if it isn't found just return null
+    return reinterpret_cast<PFN_vkVoidFunction>(FindEntrypoint(instance_entrypoint_table, pName));
 ''',
 'vkGetDeviceProcAddr': '''
-    return GetInstanceProcAddr(nullptr, pName);
+    // Only device-level entrypoints are in this table, as the spec requires
+    return reinterpret_cast<PFN_vkVoidFunction>(FindEntrypoint(device_entrypoint_table, pName));
 ''',
 'vkGetPhysicalDeviceMemoryProperties': '''
-    pMemoryProperties->memoryTypeCount = 2;
-    pMemoryProperties->memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    pMemoryProperties->memoryTypes[0].heapIndex = 0;
-    pMemoryProperties->memoryTypes[1].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    pMemoryProperties->memoryTypes[1].heapIndex = 1;
-    pMemoryProperties->memoryHeapCount = 2;
-    pMemoryProperties->memoryHeaps[0].flags = 0;
-    pMemoryProperties->memoryHeaps[0].size = 8000000000;
-    pMemoryProperties->memoryHeaps[1].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
-    pMemoryProperties->memoryHeaps[1].size = 8000000000;
+    *pMemoryProperties = GetPhysicalDeviceProfile(physicalDevice).memory_properties;
 ''',
 'vkGetPhysicalDeviceMemoryProperties2KHR': '''
     GetPhysicalDeviceMemoryProperties(physicalDevice, &pMemoryProperties->memoryProperties);
+#ifdef VK_EXT_memory_budget
+    const auto *budget_props = lvl_find_in_chain<VkPhysicalDeviceMemoryBudgetPropertiesEXT>(pMemoryProperties->pNext);
+    if (budget_props) {
+        auto budget = const_cast<VkPhysicalDeviceMemoryBudgetPropertiesEXT*>(budget_props);
+        const auto& memory_properties = pMemoryProperties->memoryProperties;
+        const auto physical_device_state = GetPhysicalDeviceState(physicalDevice);
+        for (uint32_t i = 0; i < VK_MAX_MEMORY_HEAPS; ++i) {
+            const bool valid = i < memory_properties.memoryHeapCount;
+            budget->heapBudget[i] = valid ? GetHeapBudget(memory_properties.memoryHeaps[i]) : 0;
+            budget->heapUsage[i] = valid ? physical_device_state->heap_usage[i].load() : 0;
+        }
+    }
+#endif /* VK_EXT_memory_budget */
 ''',
 'vkGetPhysicalDeviceQueueFamilyProperties': '''
+    const auto& profile = GetPhysicalDeviceProfile(physicalDevice);
     if (!pQueueFamilyProperties) {
-        *pQueueFamilyPropertyCount = 1;
+        *pQueueFamilyPropertyCount = profile.queue_family_count;
     } else {
-        if (*pQueueFamilyPropertyCount) {
-            pQueueFamilyProperties[0].queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT | VK_QUEUE_SPARSE_BINDING_BIT;
-            pQueueFamilyProperties[0].queueCount = 1;
-            pQueueFamilyProperties[0].timestampValidBits = 0;
-            pQueueFamilyProperties[0].minImageTransferGranularity = {1,1,1};
-        }
+        *pQueueFamilyPropertyCount = std::min(*pQueueFamilyPropertyCount, profile.queue_family_count);
+        std::copy(profile.queue_families, profile.queue_families + *pQueueFamilyPropertyCount, pQueueFamilyProperties);
     }
 ''',
 'vkGetPhysicalDeviceQueueFamilyProperties2KHR': '''
-    if (pQueueFamilyPropertyCount && pQueueFamilyProperties) {
-        GetPhysicalDeviceQueueFamilyProperties(physicalDevice, pQueueFamilyPropertyCount, &pQueueFamilyProperties->queueFamilyProperties);
+    const auto& profile = GetPhysicalDeviceProfile(physicalDevice);
+    if (!pQueueFamilyProperties) {
+        *pQueueFamilyPropertyCount = profile.queue_family_count;
     } else {
-        GetPhysicalDeviceQueueFamilyProperties(physicalDevice, pQueueFamilyPropertyCount, nullptr);
+        *pQueueFamilyPropertyCount = std::min(*pQueueFamilyPropertyCount, profile.queue_family_count);
+        for (uint32_t i = 0; i < *pQueueFamilyPropertyCount; ++i) {
+            pQueueFamilyProperties[i].queueFamilyProperties = profile.queue_families[i];
+        }
     }
 ''',
 'vkGetPhysicalDeviceFeatures': '''
-    uint32_t num_bools = sizeof(VkPhysicalDeviceFeatures) / sizeof(VkBool32);
-    VkBool32 *bool_array = &pFeatures->robustBufferAccess;
-    SetBoolArrayTrue(bool_array, num_bools);
+    *pFeatures = GetPhysicalDeviceProfile(physicalDevice).features;
 ''',
 'vkGetPhysicalDeviceFeatures2KHR': '''
     GetPhysicalDeviceFeatures(physicalDevice, &pFeatures->features);
@@ -728,12 +6632,7 @@ CUSTOM_C_INTERCEPTS = {
     }
 ''',
 'vkGetPhysicalDeviceFormatProperties': '''
-    if (VK_FORMAT_UNDEFINED == format) {
-        *pFormatProperties = { 0x0, 0x0, 0x0 };
-    } else {
-        // TODO: Just returning full support for everything initially
-        *pFormatProperties = { 0x00FFFFFF, 0x00FFFFFF, 0x00FFFFFF };
-    }
+    *pFormatProperties = GetProfileFormatProperties(GetPhysicalDeviceProfile(physicalDevice), format);
 ''',
 'vkGetPhysicalDeviceFormatProperties2KHR': '''
     GetPhysicalDeviceFormatProperties(physicalDevice, format, &pFormatProperties->formatProperties);
@@ -756,20 +6655,22 @@ CUSTOM_C_INTERCEPTS = {
 ''',
 'vkGetPhysicalDeviceImageFormatProperties2KHR': '''
     GetPhysicalDeviceImageFormatProperties(physicalDevice, pImageFormatInfo->format, pImageFormatInfo->type, pImageFormatInfo->tiling, pImageFormatInfo->usage, pImageFormatInfo->flags, &pImageFormatProperties->imageFormatProperties);
+    const auto *external_info = lvl_find_in_chain<VkPhysicalDeviceExternalImageFormatInfo>(pImageFormatInfo->pNext);
+    const auto *external_props = lvl_find_in_chain<VkExternalImageFormatProperties>(pImageFormatProperties->pNext);
+    if (external_info && external_info->handleType) {
+        VkExternalMemoryProperties memory_properties;
+        GetExternalMemoryProperties(external_info->handleType, &memory_properties);
+        if (!memory_properties.compatibleHandleTypes) {
+            return VK_ERROR_FORMAT_NOT_SUPPORTED;
+        }
+        if (external_props) {
+            const_cast<VkExternalImageFormatProperties*>(external_props)->externalMemoryProperties = memory_properties;
+        }
+    }
     return VK_SUCCESS;
 ''',
 'vkGetPhysicalDeviceProperties': '''
-    // TODO: Just hard-coding some values for now
-    pProperties->apiVersion = VK_API_VERSION_1_0;
-    pProperties->driverVersion = 1;
-    pProperties->vendorID = 0xba5eba11;
-    pProperties->deviceID = 0xf005ba11;
-    pProperties->deviceType = VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU;
-    //std::string devName = "Vulkan Mock Device";
-    strcpy(pProperties->deviceName, "Vulkan Mock Device");
-    pProperties->pipelineCacheUUID[0] = 18;
-    pProperties->limits = SetLimits(&pProperties->limits);
-    pProperties->sparseProperties = { VK_TRUE, VK_TRUE, VK_TRUE, VK_TRUE, VK_TRUE };
+    *pProperties = GetPhysicalDeviceProfile(physicalDevice).properties;
 ''',
 'vkGetPhysicalDeviceProperties2KHR': '''
     GetPhysicalDeviceProperties(physicalDevice, &pProperties->properties);
@@ -806,6 +6707,14 @@ CUSTOM_C_INTERCEPTS = {
         VkPhysicalDevicePushDescriptorPropertiesKHR* write_props = (VkPhysicalDevicePushDescriptorPropertiesKHR*)push_descriptor_props;
         write_props->maxPushDescriptors = 256;
     }
+
+#ifdef VK_EXT_external_memory_host
+    const auto *host_memory_props = lvl_find_in_chain<VkPhysicalDeviceExternalMemoryHostPropertiesEXT>(pProperties->pNext);
+    if (host_memory_props) {
+        VkPhysicalDeviceExternalMemoryHostPropertiesEXT* write_props = (VkPhysicalDeviceExternalMemoryHostPropertiesEXT*)host_memory_props;
+        write_props->minImportedHostPointerAlignment = HOST_POINTER_ALIGNMENT;
+    }
+#endif /* VK_EXT_external_memory_host */
 ''',
 'vkGetPhysicalDeviceExternalSemaphoreProperties':'''
     // Hard code support for all handle types and features
@@ -826,70 +6735,653 @@ CUSTOM_C_INTERCEPTS = {
     GetPhysicalDeviceExternalFenceProperties(physicalDevice, pExternalFenceInfo, pExternalFenceProperties);
 ''',
 'vkGetPhysicalDeviceExternalBufferProperties':'''
-    // Hard-code support for all handle types and features
-    pExternalBufferProperties->externalMemoryProperties.externalMemoryFeatures = 0x7;
-    pExternalBufferProperties->externalMemoryProperties.exportFromImportedHandleTypes = 0x1FF;
-    pExternalBufferProperties->externalMemoryProperties.compatibleHandleTypes = 0x1FF;
+    GetExternalMemoryProperties(pExternalBufferInfo->handleType, &pExternalBufferProperties->externalMemoryProperties);
 ''',
 'vkGetPhysicalDeviceExternalBufferPropertiesKHR':'''
     GetPhysicalDeviceExternalBufferProperties(physicalDevice, pExternalBufferInfo, pExternalBufferProperties);
 ''',
+'vkCreateBuffer': '''
+    BufferState buffer_state = {pCreateInfo->size, pCreateInfo->usage};
+    *pBuffer = (VkBuffer)NewNonDispHandle();
+    buffer_map.Insert(*pBuffer, buffer_state);
+    return VK_SUCCESS;
+''',
+'vkDestroyBuffer': '''
+    buffer_map.Erase(buffer);
+''',
+'vkCreateImage': '''
+    ImageState image_state = {*pCreateInfo};
+    image_state.create_info.pNext = nullptr;
+    image_state.create_info.queueFamilyIndexCount = 0;
+    image_state.create_info.pQueueFamilyIndices = nullptr;
+    *pImage = (VkImage)NewNonDispHandle();
+    image_map.Insert(*pImage, image_state);
+    return VK_SUCCESS;
+''',
+'vkDestroyImage': '''
+    image_map.Erase(image);
+''',
+'vkBindBufferMemory': '''
+    buffer_map.Update(buffer, [memory, memoryOffset](BufferState& buffer_state) {
+        buffer_state.memory = memory;
+        buffer_state.memory_offset = memoryOffset;
+    });
+    return VK_SUCCESS;
+''',
+'vkBindBufferMemory2KHR': '''
+    for (uint32_t i = 0; i < bindInfoCount; ++i) {
+        BindBufferMemory(device, pBindInfos[i].buffer, pBindInfos[i].memory, pBindInfos[i].memoryOffset);
+    }
+    return VK_SUCCESS;
+''',
+'vkBindImageMemory': '''
+    image_map.Update(image, [memory, memoryOffset](ImageState& image_state) {
+        image_state.memory = memory;
+        image_state.memory_offset = memoryOffset;
+    });
+    return VK_SUCCESS;
+''',
+'vkBindImageMemory2KHR': '''
+    for (uint32_t i = 0; i < bindInfoCount; ++i) {
+        BindImageMemory(device, pBindInfos[i].image, pBindInfos[i].memory, pBindInfos[i].memoryOffset);
+    }
+    return VK_SUCCESS;
+''',
+'vkCreateImageView': '''
+    *pView = (VkImageView)NewNonDispHandle();
+    if (settings.rasterize) {
+        const auto& range = pCreateInfo->subresourceRange;
+        ImageViewState view_state = {pCreateInfo->image, pCreateInfo->format, range.baseMipLevel, range.baseArrayLayer};
+        image_view_map.Insert(*pView, view_state);
+    }
+    return VK_SUCCESS;
+''',
+'vkDestroyImageView': '''
+    image_view_map.Erase(imageView);
+''',
+'vkCreateSampler': '''
+    *pSampler = (VkSampler)NewNonDispHandle();
+    if (settings.rasterize) {
+        SamplerState sampler_state = {pCreateInfo->magFilter, pCreateInfo->addressModeU, pCreateInfo->addressModeV};
+        sampler_map.Insert(*pSampler, sampler_state);
+    }
+    return VK_SUCCESS;
+''',
+'vkDestroySampler': '''
+    sampler_map.Erase(sampler);
+''',
+'vkCreateRenderPass': '''
+    *pRenderPass = (VkRenderPass)NewNonDispHandle();
+    if (settings.rasterize) {
+        RenderPassState render_pass_state;
+        render_pass_state.attachments.assign(pCreateInfo->pAttachments, pCreateInfo->pAttachments + pCreateInfo->attachmentCount);
+        render_pass_state.color_attachment = VK_ATTACHMENT_UNUSED;
+        render_pass_state.depth_attachment = VK_ATTACHMENT_UNUSED;
+        if (pCreateInfo->subpassCount) {
+            const auto& subpass = pCreateInfo->pSubpasses[0];
+            if (subpass.colorAttachmentCount) {
+                render_pass_state.color_attachment = subpass.pColorAttachments[0].attachment;
+            }
+            if (subpass.pDepthStencilAttachment) {
+                render_pass_state.depth_attachment = subpass.pDepthStencilAttachment->attachment;
+            }
+        }
+        unique_lock_t lock(global_lock);
+        render_pass_map[*pRenderPass] = render_pass_state;
+    }
+    return VK_SUCCESS;
+''',
+'vkDestroyRenderPass': '''
+    unique_lock_t lock(global_lock);
+    render_pass_map.erase(renderPass);
+''',
+'vkCreateFramebuffer': '''
+    *pFramebuffer = (VkFramebuffer)NewNonDispHandle();
+    if (settings.rasterize) {
+        FramebufferState framebuffer_state;
+        framebuffer_state.attachments.assign(pCreateInfo->pAttachments, pCreateInfo->pAttachments + pCreateInfo->attachmentCount);
+        framebuffer_state.width = pCreateInfo->width;
+        framebuffer_state.height = pCreateInfo->height;
+        unique_lock_t lock(global_lock);
+        framebuffer_map[*pFramebuffer] = framebuffer_state;
+    }
+    return VK_SUCCESS;
+''',
+'vkDestroyFramebuffer': '''
+    unique_lock_t lock(global_lock);
+    framebuffer_map.erase(framebuffer);
+''',
+'vkCreateShaderModule': '''
+    *pShaderModule = (VkShaderModule)NewNonDispHandle();
+    PipelineHasher hasher;
+    hasher.Add(pCreateInfo->pCode, pCreateInfo->codeSize);
+    unique_lock_t lock(global_lock);
+    shader_module_map[*pShaderModule] = hasher.Get();
+    return VK_SUCCESS;
+''',
+'vkDestroyShaderModule': '''
+    unique_lock_t lock(global_lock);
+    shader_module_map.erase(shaderModule);
+''',
+'vkCreatePipelineCache': '''
+    auto cache = new PipelineCacheState;
+    cache->profile = GetDeviceState(device)->profile;
+    LoadPipelineCacheData(cache, static_cast<const uint8_t*>(pCreateInfo->pInitialData), pCreateInfo->initialDataSize);
+    *pPipelineCache = (VkPipelineCache)NewNonDispHandle();
+    unique_lock_t lock(global_lock);
+    pipeline_cache_map[*pPipelineCache] = cache;
+    return VK_SUCCESS;
+''',
+'vkDestroyPipelineCache': '''
+    unique_lock_t lock(global_lock);
+    auto cache = pipeline_cache_map.find(pipelineCache);
+    if (cache != pipeline_cache_map.end()) {
+        delete cache->second;
+        pipeline_cache_map.erase(cache);
+    }
+''',
+'vkGetPipelineCacheData': '''
+    PipelineCacheState* cache = nullptr;
+    {
+        unique_lock_t lock(global_lock);
+        auto cache_it = pipeline_cache_map.find(pipelineCache);
+        if (cache_it != pipeline_cache_map.end()) {
+            cache = cache_it->second;
+        }
+    }
+    if (!cache) {
+        *pDataSize = 0;
+        return VK_SUCCESS;
+    }
+    lock_guard_t lock(cache->lock);
+    bool complete;
+    *pDataSize = StorePipelineCacheData(cache, static_cast<uint8_t*>(pData), *pDataSize, &complete);
+    return complete ? VK_SUCCESS : VK_INCOMPLETE;
+''',
+'vkMergePipelineCaches': '''
+    PipelineCacheState* dst_cache = nullptr;
+    std::vector<PipelineCacheState*> src_caches;
+    {
+        unique_lock_t lock(global_lock);
+        auto cache_it = pipeline_cache_map.find(dstCache);
+        if (cache_it == pipeline_cache_map.end()) {
+            return VK_SUCCESS;
+        }
+        dst_cache = cache_it->second;
+        for (uint32_t i = 0; i < srcCacheCount; ++i) {
+            cache_it = pipeline_cache_map.find(pSrcCaches[i]);
+            if (cache_it != pipeline_cache_map.end() && cache_it->second != dst_cache) {
+                src_caches.push_back(cache_it->second);
+            }
+        }
+    }
+    // Only one cache is locked at a time, so merges going opposite ways can't deadlock
+    for (auto src_cache : src_caches) {
+        std::map<uint64_t, std::vector<uint64_t>> entries;
+        {
+            lock_guard_t lock(src_cache->lock);
+            entries = src_cache->entries;
+        }
+        lock_guard_t lock(dst_cache->lock);
+        dst_cache->entries.insert(entries.begin(), entries.end());
+    }
+    return VK_SUCCESS;
+''',
+'vkCreateComputePipelines': '''
+    for (uint32_t i = 0; i < createInfoCount; ++i) {
+        pPipelines[i] = (VkPipeline)NewNonDispHandle();
+        std::vector<uint64_t> code_hashes;
+        const uint64_t key = GetComputePipelineKey(pCreateInfos[i], &code_hashes);
+        CompilePipeline(pipelineCache, key, std::move(code_hashes));
+    }
+    return VK_SUCCESS;
+''',
+'vkCreateGraphicsPipelines': '''
+    for (uint32_t i = 0; i < createInfoCount; ++i) {
+        pPipelines[i] = (VkPipeline)NewNonDispHandle();
+        std::vector<uint64_t> code_hashes;
+        const uint64_t key = GetGraphicsPipelineKey(pCreateInfos[i], &code_hashes);
+        CompilePipeline(pipelineCache, key, std::move(code_hashes));
+        if (settings.rasterize) {
+            const auto pipeline_state = GetGraphicsPipelineState(pCreateInfos[i]);
+            unique_lock_t lock(global_lock);
+            pipeline_map[pPipelines[i]] = pipeline_state;
+        }
+    }
+    return VK_SUCCESS;
+''',
+'vkDestroyPipeline': '''
+    unique_lock_t lock(global_lock);
+    pipeline_map.erase(pipeline);
+''',
+'vkAllocateDescriptorSets': '''
+    for (uint32_t i = 0; i < pAllocateInfo->descriptorSetCount; ++i) {
+        pDescriptorSets[i] = (VkDescriptorSet)NewNonDispHandle();
+    }
+    if (settings.rasterize) {
+        unique_lock_t lock(global_lock);
+        for (uint32_t i = 0; i < pAllocateInfo->descriptorSetCount; ++i) {
+            descriptor_set_map[pDescriptorSets[i]].pool = pAllocateInfo->descriptorPool;
+        }
+    }
+    return VK_SUCCESS;
+''',
+'vkFreeDescriptorSets': '''
+    unique_lock_t lock(global_lock);
+    for (uint32_t i = 0; i < descriptorSetCount; ++i) {
+        descriptor_set_map.erase(pDescriptorSets[i]);
+    }
+    return VK_SUCCESS;
+''',
+'vkResetDescriptorPool': '''
+    unique_lock_t lock(global_lock);
+    ForgetDescriptorPoolSets(descriptorPool);
+    return VK_SUCCESS;
+''',
+'vkDestroyDescriptorPool': '''
+    unique_lock_t lock(global_lock);
+    ForgetDescriptorPoolSets(descriptorPool);
+''',
+'vkUpdateDescriptorSets': '''
+    if (!settings.rasterize) {
+        return;
+    }
+    unique_lock_t lock(global_lock);
+    for (uint32_t i = 0; i < descriptorWriteCount; ++i) {
+        const auto& write = pDescriptorWrites[i];
+        auto set = descriptor_set_map.find(write.dstSet);
+        if (set == descriptor_set_map.end() || write.dstArrayElement || !write.descriptorCount) {
+            continue;
+        }
+        DescriptorState descriptor = {};
+        descriptor.type = write.descriptorType;
+        switch (write.descriptorType) {
+            case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+            case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+            case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+            case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+                descriptor.buffer = write.pBufferInfo[0].buffer;
+                descriptor.offset = write.pBufferInfo[0].offset;
+                descriptor.range = write.pBufferInfo[0].range;
+                break;
+            case VK_DESCRIPTOR_TYPE_SAMPLER:
+            case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+            case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+                descriptor.image_view = write.pImageInfo[0].imageView;
+                descriptor.sampler = write.pImageInfo[0].sampler;
+                break;
+            default:
+                continue;
+        }
+        set->second.bindings[write.dstBinding] = descriptor;
+    }
+    for (uint32_t i = 0; i < descriptorCopyCount; ++i) {
+        const auto& copy = pDescriptorCopies[i];
+        auto src_set = descriptor_set_map.find(copy.srcSet);
+        auto dst_set = descriptor_set_map.find(copy.dstSet);
+        if (src_set == descriptor_set_map.end() || dst_set == descriptor_set_map.end() || copy.srcArrayElement ||
+            copy.dstArrayElement || !copy.descriptorCount) {
+            continue;
+        }
+        auto descriptor = src_set->second.bindings.find(copy.srcBinding);
+        if (descriptor != src_set->second.bindings.end()) {
+            dst_set->second.bindings[copy.dstBinding] = descriptor->second;
+        }
+    }
+''',
 'vkGetBufferMemoryRequirements': '''
-    // TODO: Just hard-coding reqs for now
-    pMemoryRequirements->size = 4096;
-    pMemoryRequirements->alignment = 1;
-    pMemoryRequirements->memoryTypeBits = 0xFFFF;
+    BufferState buffer_state = {4096};
+    buffer_map.Find(buffer, &buffer_state);
+    pMemoryRequirements->alignment = settings.buffer_alignment;
+    pMemoryRequirements->size = AlignUp(buffer_state.size, pMemoryRequirements->alignment);
+    pMemoryRequirements->memoryTypeBits = GetMemoryTypeBits(*GetDeviceState(device)->profile);
 ''',
 'vkGetBufferMemoryRequirements2KHR': '''
     GetBufferMemoryRequirements(device, pInfo->buffer, &pMemoryRequirements->memoryRequirements);
 ''',
 'vkGetImageMemoryRequirements': '''
-    // TODO: Just hard-coding reqs for now
+    const auto& profile = *GetDeviceState(device)->profile;
+    ImageState image_state;
+    if (image_map.Find(image, &image_state)) {
+        *pMemoryRequirements = GetImageMemoryRequirementsFromCreateInfo(image_state.create_info, profile);
+        return;
+    }
+    // Not an image we created, e.g. a swapchain image
     pMemoryRequirements->size = 4096;
-    pMemoryRequirements->alignment = 1;
-
-    // Here we hard-code that the memory type at index 3 doesn't support this image.
-    pMemoryRequirements->memoryTypeBits = 0xFFFF & ~(0x1 << 3);
+    pMemoryRequirements->alignment = settings.image_alignment;
+    pMemoryRequirements->memoryTypeBits = GetMemoryTypeBits(profile);
 ''',
 'vkGetImageMemoryRequirements2KHR': '''
     GetImageMemoryRequirements(device, pInfo->image, &pMemoryRequirements->memoryRequirements);
 ''',
+'vkAllocateMemory': '''
+    DeviceMemoryState memory_state = {};
+    memory_state.size = pAllocateInfo->allocationSize;
+    auto device_state = GetDeviceState(device);
+    const auto& memory_properties = device_state->profile->memory_properties;
+    // Profiles are rejected as they're loaded if a memory type names a heap they don't have. Should one get through anyway,
+    //  its allocations just aren't counted against a heap.
+    const uint32_t heap_index = (pAllocateInfo->memoryTypeIndex < memory_properties.memoryTypeCount)
+                                    ? memory_properties.memoryTypes[pAllocateInfo->memoryTypeIndex].heapIndex
+                                    : VK_MAX_MEMORY_HEAPS;
+    if (heap_index < memory_properties.memoryHeapCount) {
+        const auto& heap = memory_properties.memoryHeaps[heap_index];
+        memory_state.heap_usage = &device_state->physical_device_state->heap_usage[heap_index];
+        if (!ReserveHeapMemory(memory_state.heap_usage, heap.size, memory_state.size)) {
+            return (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? VK_ERROR_OUT_OF_DEVICE_MEMORY : VK_ERROR_OUT_OF_HOST_MEMORY;
+        }
+    }
+    memory_state.fd = -1;
+    const auto* export_info = lvl_find_in_chain<VkExportMemoryAllocateInfo>(pAllocateInfo->pNext);
+    const auto* import_fd_info = lvl_find_in_chain<VkImportMemoryFdInfoKHR>(pAllocateInfo->pNext);
+#ifdef VK_EXT_external_memory_host
+    const auto* import_host_info = lvl_find_in_chain<VkImportMemoryHostPointerInfoEXT>(pAllocateInfo->pNext);
+    if (import_host_info && import_host_info->handleType) {
+        // The app's memory is the backing store as is, and stays the app's to free
+        const uint64_t address = (uint64_t)(uintptr_t)import_host_info->pHostPointer;
+        if ((address | memory_state.size) % HOST_POINTER_ALIGNMENT) {
+            ReleaseHeapMemory(memory_state);
+            return VK_ERROR_INVALID_EXTERNAL_HANDLE;
+        }
+        memory_state.data = import_host_info->pHostPointer;
+        memory_state.host_pointer = true;
+    } else
+#endif /* VK_EXT_external_memory_host */
+    if (import_fd_info && import_fd_info->handleType) {
+#if defined(_WIN32)
+        ReleaseHeapMemory(memory_state);
+        return VK_ERROR_INVALID_EXTERNAL_HANDLE;
+#else
+        if (import_fd_info->handleType != VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT ||
+            !MapSharedMemoryFile(import_fd_info->fd, &memory_state)) {
+            ReleaseHeapMemory(memory_state);
+            return VK_ERROR_INVALID_EXTERNAL_HANDLE;
+        }
+#endif
+    } else if (export_info && export_info->handleTypes) {
+#if defined(_WIN32)
+        ReleaseHeapMemory(memory_state);
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+#else
+        const int fd = CreateSharedMemoryFile(memory_state.size);
+        if (fd < 0 || !MapSharedMemoryFile(fd, &memory_state)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            ReleaseHeapMemory(memory_state);
+            return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+        }
+#endif
+    } else if (!AllocateBackingStore(&memory_state)) {
+        ReleaseHeapMemory(memory_state);
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+    *pMemory = (VkDeviceMemory)NewNonDispHandle();
+    device_memory_map.Insert(*pMemory, memory_state);
+    if (!settings.lint_file.empty()) {
+        LintAllocateMemory(device, memory_state.size);
+    }
+    return VK_SUCCESS;
+''',
+'vkFreeMemory': '''
+    DeviceMemoryState memory_state = {};
+    if (!device_memory_map.Erase(memory, &memory_state)) {
+        return;
+    }
+    ReleaseHeapMemory(memory_state);
+    FreeBackingStore(memory_state);
+    if (!settings.lint_file.empty()) {
+        LintFreeMemory(device, memory);
+    }
+''',
 'vkMapMemory': '''
-    unique_lock_t lock(global_lock);
-    // TODO: Just hard-coding 64k whole size for now
-    if (VK_WHOLE_SIZE == size)
-        size = 0x10000;
-    void* map_addr = malloc((size_t)size);
-    mapped_memory_map[memory].push_back(map_addr);
-    *ppData = map_addr;
+    DeviceMemoryState memory_state;
+    if (!device_memory_map.Find(memory, &memory_state)) {
+        return VK_ERROR_MEMORY_MAP_FAILED;
+    }
+    // Mappings are persistent views of the backing store, no copy and no allocation
+    *ppData = static_cast<char*>(memory_state.data) + offset;
+    if (!settings.lint_file.empty()) {
+        LintMapMemory(device, memory);
+    }
     return VK_SUCCESS;
 ''',
 'vkUnmapMemory': '''
-    unique_lock_t lock(global_lock);
-    for (auto map_addr : mapped_memory_map[memory]) {
-        free(map_addr);
+    // The backing store stays put until the memory is freed, so there's nothing to release here
+''',
+'vkGetMemoryFdKHR': '''
+    *pFd = -1;
+#if defined(_WIN32)
+    return VK_ERROR_TOO_MANY_OBJECTS;
+#else
+    DeviceMemoryState memory_state;
+    if (!device_memory_map.Find(pGetFdInfo->memory, &memory_state) || memory_state.fd < 0) {
+        return VK_ERROR_TOO_MANY_OBJECTS;
     }
-    mapped_memory_map.erase(memory);
+    // Each export is a new reference to the same file, the app closes it or hands it over by importing it
+    *pFd = dup(memory_state.fd);
+    return (*pFd >= 0) ? VK_SUCCESS : VK_ERROR_TOO_MANY_OBJECTS;
+#endif
+''',
+'vkGetMemoryFdPropertiesKHR': '''
+    // Opaque fds are the only type, and those aren't queried this way
+    pMemoryFdProperties->memoryTypeBits = 0;
+    return VK_ERROR_INVALID_EXTERNAL_HANDLE;
+''',
+'vkGetMemoryHostPointerPropertiesEXT': '''
+    // Any host visible type can take host memory, since every type is backed by host memory anyway
+    pMemoryHostPointerProperties->memoryTypeBits = 0;
+    if ((uint64_t)(uintptr_t)pHostPointer % HOST_POINTER_ALIGNMENT) {
+        return VK_ERROR_INVALID_EXTERNAL_HANDLE;
+    }
+    const auto& memory_properties = GetDeviceState(device)->profile->memory_properties;
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
+        if (memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            pMemoryHostPointerProperties->memoryTypeBits |= 1u << i;
+        }
+    }
+    return VK_SUCCESS;
 ''',
 'vkGetImageSubresourceLayout': '''
-    // Need safe values. Callers are computing memory offsets from pLayout, with no return code to flag failure. 
-    *pLayout = VkSubresourceLayout(); // Default constructor zero values.
+    // Need safe values. Callers are computing memory offsets from pLayout, with no return code to flag failure, so
+    //  subresources that don't exist get a zeroed layout.
+    *pLayout = VkSubresourceLayout();
+    ImageState image_state;
+    if (!image_map.Find(image, &image_state) || pSubresource->mipLevel >= image_state.create_info.mipLevels ||
+        pSubresource->arrayLayer >= image_state.create_info.arrayLayers) {
+        return;
+    }
+    // Aspects of depth/stencil and multi-planar formats aren't stored apart, so every aspect gets the same layout
+    const auto& create_info = image_state.create_info;
+    pLayout->offset = GetSubresourceOffset(create_info, pSubresource->mipLevel, pSubresource->arrayLayer);
+    pLayout->size = GetSubresourceSize(create_info, pSubresource->mipLevel);
+    pLayout->rowPitch = GetSubresourceRowPitch(create_info, pSubresource->mipLevel);
+    pLayout->depthPitch = GetSubresourceDepthPitch(create_info, pSubresource->mipLevel);
+    pLayout->arrayPitch = GetLayerSize(create_info);
 ''',
-'vkGetSwapchainImagesKHR': '''
-    if (!pSwapchainImages) {
-        *pSwapchainImageCount = 1;
-    } else if (*pSwapchainImageCount > 0) {
-        pSwapchainImages[0] = (VkImage)global_unique_handle++;
-        if (*pSwapchainImageCount != 1) {
-            return VK_INCOMPLETE;
+'vkCreateSwapchainKHR': '''
+    VkImageCreateInfo image_create_info = {};
+    image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_create_info.imageType = VK_IMAGE_TYPE_2D;
+    image_create_info.format = pCreateInfo->imageFormat;
+    image_create_info.extent = {pCreateInfo->imageExtent.width, pCreateInfo->imageExtent.height, 1};
+    image_create_info.mipLevels = 1;
+    image_create_info.arrayLayers = pCreateInfo->imageArrayLayers;
+    image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_create_info.usage = pCreateInfo->imageUsage;
+    image_create_info.sharingMode = pCreateInfo->imageSharingMode;
+    image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // The engine keeps an image on screen, so the app needs at least one more to draw into
+    const uint32_t image_count = std::max(pCreateInfo->minImageCount, 2u);
+    SwapchainState swapchain_state;
+    std::vector<DeviceMemoryState> memory_states;
+    if (settings.rasterize) {
+        const VkDeviceSize size =
+            GetImageMemoryRequirementsFromCreateInfo(image_create_info, *GetDeviceState(device)->profile).size;
+        for (uint32_t i = 0; i < image_count; ++i) {
+            DeviceMemoryState memory_state = {};
+            memory_state.size = size;
+            memory_state.fd = -1;
+            if (!AllocateBackingStore(&memory_state)) {
+                for (const auto& allocated : memory_states) {
+                    FreeBackingStore(allocated);
+                }
+                return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+            }
+            memory_states.push_back(memory_state);
+            swapchain_state.memories.push_back((VkDeviceMemory)NewNonDispHandle());
+        }
+    }
+    for (uint32_t i = 0; i < image_count; ++i) {
+        swapchain_state.images.push_back((VkImage)NewNonDispHandle());
+    }
+    *pSwapchain = (VkSwapchainKHR)NewNonDispHandle();
+    {
+        unique_lock_t lock(global_lock);
+        for (uint32_t i = 0; i < image_count; ++i) {
+            ImageState image_state = {image_create_info};
+            if (settings.rasterize) {
+                image_state.memory = swapchain_state.memories[i];
+                device_memory_map.Insert(image_state.memory, memory_states[i]);
+            }
+            image_map.Insert(swapchain_state.images[i], image_state);
         }
+        swapchain_map[*pSwapchain] = swapchain_state;
     }
+    PresentEngineState engine;
+    engine.present_mode = pCreateInfo->presentMode;
+    engine.retired = false;
+    engine.images.assign(image_count, PRESENT_IMAGE_AVAILABLE);
+    for (uint32_t i = 0; i < image_count; ++i) {
+        engine.available.push_back(i);
+    }
+    engine.displayed = UINT32_MAX;
+    engine.next_vblank = GetNextVblank(GetSteadyClockNs() + 1);
+    lock_guard_t lock(present_lock);
+    auto old_engine = present_engine_map.find(pCreateInfo->oldSwapchain);
+    if (old_engine != present_engine_map.end()) {
+        old_engine->second.retired = true;
+    }
+    present_engine_map[*pSwapchain] = std::move(engine);
     return VK_SUCCESS;
 ''',
+'vkDestroySwapchainKHR': '''
+    {
+        lock_guard_t lock(present_lock);
+        present_engine_map.erase(swapchain);
+    }
+    std::vector<DeviceMemoryState> memory_states;
+    {
+        unique_lock_t lock(global_lock);
+        auto swapchain_state = swapchain_map.find(swapchain);
+        if (swapchain_state == swapchain_map.end()) {
+            return;
+        }
+        for (auto image : swapchain_state->second.images) {
+            image_map.Erase(image);
+        }
+        for (auto memory : swapchain_state->second.memories) {
+            DeviceMemoryState memory_state;
+            if (device_memory_map.Erase(memory, &memory_state)) {
+                memory_states.push_back(memory_state);
+            }
+        }
+        swapchain_map.erase(swapchain_state);
+    }
+    for (const auto& memory_state : memory_states) {
+        FreeBackingStore(memory_state);
+    }
+''',
+'vkGetSwapchainImagesKHR': '''
+    unique_lock_t lock(global_lock);
+    auto swapchain_state = swapchain_map.find(swapchain);
+    const uint32_t image_count = (swapchain_state != swapchain_map.end()) ? (uint32_t)swapchain_state->second.images.size() : 0;
+    if (!pSwapchainImages) {
+        *pSwapchainImageCount = image_count;
+        return VK_SUCCESS;
+    }
+    const uint32_t count = std::min(*pSwapchainImageCount, image_count);
+    for (uint32_t i = 0; i < count; ++i) {
+        pSwapchainImages[i] = swapchain_state->second.images[i];
+    }
+    *pSwapchainImageCount = count;
+    return (count < image_count) ? VK_INCOMPLETE : VK_SUCCESS;
+''',
 'vkAcquireNextImagesKHR': '''
     *pImageIndex = 0;
     return VK_SUCCESS;
 ''',
+'vkAcquireNextImageKHR': '''
+    unique_lock_t lock(present_lock);
+    auto engine_it = present_engine_map.find(swapchain);
+    if (engine_it == present_engine_map.end() || engine_it->second.retired) {
+        return VK_ERROR_OUT_OF_DATE_KHR;
+    }
+    auto engine = &engine_it->second;
+    // Timeouts that run past the end of the clock wait forever
+    const uint64_t start = GetSteadyClockNs();
+    const uint64_t deadline = (timeout > UINT64_MAX - start) ? UINT64_MAX : start + timeout;
+    while (true) {
+        const uint64_t now = GetSteadyClockNs();
+        AdvancePresentEngine(engine, now);
+        if (!engine->available.empty()) {
+            break;
+        }
+        // With every image held by the app, none is coming back
+        const bool all_acquired = (size_t)std::count(engine->images.begin(), engine->images.end(), PRESENT_IMAGE_ACQUIRED) ==
+                                  engine->images.size();
+        if (all_acquired || now >= deadline) {
+            return timeout ? VK_TIMEOUT : VK_NOT_READY;
+        }
+        // An image comes back at the next vertical blank if there's one to put on screen, or else once the engine gets
+        //  another present
+        const uint64_t wake = engine->queued.empty() ? deadline : std::min(deadline, engine->next_vblank);
+        if (wake == UINT64_MAX) {
+            present_cv.wait(lock);
+        } else {
+            present_cv.wait_until(lock, GetSteadyClockTime(wake));
+        }
+    }
+    *pImageIndex = engine->available.front();
+    engine->available.pop_front();
+    engine->images[*pImageIndex] = PRESENT_IMAGE_ACQUIRED;
+    lock.unlock();
+    // The engine is done with the image as soon as it's acquired
+    if (semaphore != VK_NULL_HANDLE) {
+        SignalSemaphores(std::vector<VkSemaphore>(1, semaphore));
+    }
+    SignalFence(fence);
+    return VK_SUCCESS;
+''',
+'vkAcquireNextImage2KHR': '''
+    return AcquireNextImageKHR(device, pAcquireInfo->swapchain, pAcquireInfo->timeout, pAcquireInfo->semaphore,
+                               pAcquireInfo->fence, pImageIndex);
+''',
+'vkGetRefreshCycleDurationGOOGLE': '''
+    pDisplayTimingProperties->refreshDuration = GetRefreshDurationNs();
+    return VK_SUCCESS;
+''',
+'vkGetPastPresentationTimingGOOGLE': '''
+    lock_guard_t lock(present_lock);
+    auto engine_it = present_engine_map.find(swapchain);
+    if (engine_it == present_engine_map.end()) {
+        *pPresentationTimingCount = 0;
+        return VK_SUCCESS;
+    }
+    auto engine = &engine_it->second;
+    AdvancePresentEngine(engine, GetSteadyClockNs());
+    if (!pPresentationTimings) {
+        *pPresentationTimingCount = (uint32_t)engine->timings.size();
+        return VK_SUCCESS;
+    }
+    // Timings are only reported once
+    const uint32_t count = std::min(*pPresentationTimingCount, (uint32_t)engine->timings.size());
+    std::copy(engine->timings.begin(), engine->timings.begin() + count, pPresentationTimings);
+    engine->timings.erase(engine->timings.begin(), engine->timings.begin() + count);
+    *pPresentationTimingCount = count;
+    return engine->timings.empty() ? VK_SUCCESS : VK_INCOMPLETE;
+''',
 }
 
 # MockICDGeneratorOptions - subclass of GeneratorOptions.
@@ -1000,6 +7492,9 @@ class MockICDOutputGenerator(OutputGenerator):
         # Internal state - accumulators for different inner block text
         self.sections = dict([(section, []) for section in self.ALL_SECTIONS])
         self.intercepts = []
+        self.device_intercepts = []
+        # (name, protect, case lines) of each command the replayer replays
+        self.replay_commands = []
 
     # Check if the parameter passed in is a pointer to an array
     def paramIsArray(self, param):
@@ -1046,16 +7541,75 @@ class MockICDOutputGenerator(OutputGenerator):
         if (genOpts.prefixText):
             for s in genOpts.prefixText:
                 write(s, file=self.outFile)
+        # The trace replayer is generated from the same registry, so it numbers entrypoints the way the ICD does
+        self.replay = (self.genOpts.filename == 'mock_icd_replay.cpp')
+        # The entrypoint lookup benchmark is generated from the same registry, but only needs the entrypoint names
+        self.proc_addr = (self.genOpts.filename == 'mock_icd_proc_addr.cpp')
         if self.header:
             write('#include <unordered_map>', file=self.outFile)
             write('#include <mutex>', file=self.outFile)
+            write('#include <atomic>', file=self.outFile)
+            write('#include <vector>', file=self.outFile)
             write('#include <string>', file=self.outFile)
             write('#include <cstring>', file=self.outFile)
+            write('#include <cstddef>', file=self.outFile)
+            write('#include "vulkan/vk_icd.h"', file=self.outFile)
+        elif self.replay:
+            write('#include <stdio.h>', file=self.outFile)
+            write('#include <stdlib.h>', file=self.outFile)
+            write('#include <string.h>', file=self.outFile)
+            write('#include <algorithm>', file=self.outFile)
+            write('#include <chrono>', file=self.outFile)
+            write('#include <memory>', file=self.outFile)
+            write('#include <unordered_map>', file=self.outFile)
+            write('#include <vector>', file=self.outFile)
+            write('#if !defined(_WIN32)', file=self.outFile)
+            write('#include <fcntl.h>', file=self.outFile)
+            write('#include <sys/mman.h>', file=self.outFile)
+            write('#include <sys/stat.h>', file=self.outFile)
+            write('#include <unistd.h>', file=self.outFile)
+            write('#endif', file=self.outFile)
+            write('#include <vulkan/vulkan.h>', file=self.outFile)
+        elif self.proc_addr:
+            write('#include "mock_icd_benchmark.h"', file=self.outFile)
+            write('#include <chrono>', file=self.outFile)
+            write('#include <string>', file=self.outFile)
+            write('#include <vector>', file=self.outFile)
+            write('#if defined(_WIN32)', file=self.outFile)
+            write('#include <windows.h>', file=self.outFile)
+            write('#else', file=self.outFile)
+            write('#include <dlfcn.h>', file=self.outFile)
+            write('#endif', file=self.outFile)
             write('#include "vulkan/vk_icd.h"', file=self.outFile)
         else:
             write('#include "mock_icd.h"', file=self.outFile)
+            write('#include <stdio.h>', file=self.outFile)
             write('#include <stdlib.h>', file=self.outFile)
+            write('#include <ctype.h>', file=self.outFile)
+            write('#include <math.h>', file=self.outFile)
             write('#include <vector>', file=self.outFile)
+            write('#include <algorithm>', file=self.outFile)
+            write('#include <chrono>', file=self.outFile)
+            write('#include <condition_variable>', file=self.outFile)
+            write('#include <deque>', file=self.outFile)
+            write('#include <functional>', file=self.outFile)
+            write('#include <map>', file=self.outFile)
+            write('#include <thread>', file=self.outFile)
+            write('#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)', file=self.outFile)
+            write('#define MOCK_SSE2', file=self.outFile)
+            write('#include <emmintrin.h>', file=self.outFile)
+            write('#endif', file=self.outFile)
+            write('#if defined(_WIN32)', file=self.outFile)
+            write('#include <malloc.h>', file=self.outFile)
+            write('#include <process.h>', file=self.outFile)
+            write('#else', file=self.outFile)
+            write('#include <fcntl.h>', file=self.outFile)
+            write('#include <signal.h>', file=self.outFile)
+            write('#include <sys/mman.h>', file=self.outFile)
+            write('#include <sys/stat.h>', file=self.outFile)
+            write('#include <sys/syscall.h>', file=self.outFile)
+            write('#include <unistd.h>', file=self.outFile)
+            write('#endif', file=self.outFile)
             write('#include "vk_typemap_helper.h"', file=self.outFile)
 
         write('namespace vkmock {', file=self.outFile)
@@ -1084,7 +7638,7 @@ class MockICDOutputGenerator(OutputGenerator):
             write('\n'.join(device_exts), file=self.outFile)
             write('};', file=self.outFile)
 
-        else:
+        elif not self.replay and not self.proc_addr:
             self.newline()
             write(SOURCE_CPP_PREFIX, file=self.outFile)
 
@@ -1094,18 +7648,171 @@ class MockICDOutputGenerator(OutputGenerator):
         self.newline()
         if self.header:
             # record intercepted procedures
-            write('// Map of all APIs to be intercepted by this layer', file=self.outFile)
-            write('static const std::unordered_map<std::string, void*> name_to_funcptr_map = {', file=self.outFile)
-            write('\n'.join(self.intercepts), file=self.outFile)
-            write('};\n', file=self.outFile)
+            self.writeEntrypointIds()
+            write(TRACE_FORMAT_CODE, file=self.outFile)
+            write(PROFILE_FIELD_CODE, file=self.outFile)
+            for (struct_name, table_name) in PROFILE_FIELD_TABLES:
+                self.writeProfileFieldTable(struct_name, table_name)
+            write(ENTRYPOINT_LOOKUP_CODE, file=self.outFile)
+            write('// All APIs intercepted by this ICD', file=self.outFile)
+            self.writeEntrypointTable('instance_entrypoint', self.intercepts)
+            write('// Device-level APIs intercepted by this ICD, returned by vkGetDeviceProcAddr', file=self.outFile)
+            self.writeEntrypointTable('device_entrypoint', self.device_intercepts)
             self.newline()
             write('} // namespace vkmock', file=self.outFile)
             self.newline()
             write('#endif', file=self.outFile)
+        elif self.replay:
+            self.writeEntrypointIds()
+            write(TRACE_FORMAT_CODE, file=self.outFile)
+            write(REPLAY_CPP_PREFIX, file=self.outFile)
+            self.writeReplayPacket()
+            write(REPLAY_CPP_POSTFIX, file=self.outFile)
+        elif self.proc_addr:
+            self.writeEntrypointIds()
+            write(PROC_ADDR_CPP_CODE, file=self.outFile)
         else: # Loader-layer-interface, need to implement global interface functions
             write(SOURCE_CPP_POSTFIX, file=self.outFile)
         # Finish processing in superclass
         OutputGenerator.endFile(self)
+    #
+    # Number every intercept so per-entrypoint state can live in flat arrays indexed by EntrypointId
+    def writeEntrypointIds(self):
+        write('enum EntrypointId {', file=self.outFile)
+        for (name, protect) in self.intercepts:
+            write('    ENTRYPOINT_ID_%s,' % name, file=self.outFile)
+        write('    ENTRYPOINT_ID_COUNT', file=self.outFile)
+        write('};', file=self.outFile)
+        write('static const char* const entrypoint_names[ENTRYPOINT_ID_COUNT] = {', file=self.outFile)
+        for (name, protect) in self.intercepts:
+            write('    "%s",' % name, file=self.outFile)
+        write('};', file=self.outFile)
+        self.newline()
+    #
+    # The replayer's table of loader entrypoints, and ReplayPacket() with a case for every command it replays
+    def writeReplayPacket(self):
+        def writeProtected(protect, lines):
+            if protect is not None:
+                write('#ifdef %s' % protect, file=self.outFile)
+            write('\n'.join(lines), file=self.outFile)
+            if protect is not None:
+                write('#endif', file=self.outFile)
+        write('struct ReplayDispatch {', file=self.outFile)
+        for (name, protect, case_lines) in self.replay_commands:
+            writeProtected(protect, ['    PFN_%s %s;' % (name, name[2:])])
+        write('};', file=self.outFile)
+        write('static ReplayDispatch dispatch;', file=self.outFile)
+        self.newline()
+        write('static void LoadReplayDispatch(VkInstance instance) {', file=self.outFile)
+        for (name, protect, case_lines) in self.replay_commands:
+            writeProtected(protect, ['    LoadReplayFunction(&dispatch.%s, instance, "%s");' % (name[2:], name)])
+        write('}', file=self.outFile)
+        self.newline()
+        write('// Replays the packet the reader is at, or returns false if the call is skipped', file=self.outFile)
+        write('static bool ReplayPacket(uint32_t id, TraceReader* reader, ReplayScratch* scratch) {', file=self.outFile)
+        write('    switch (id) {', file=self.outFile)
+        for (name, protect, case_lines) in self.replay_commands:
+            writeProtected(protect, ['        ' + line for line in case_lines])
+        write('        default:', file=self.outFile)
+        write('            return false;', file=self.outFile)
+        write('    }', file=self.outFile)
+        write('}', file=self.outFile)
+        self.newline()
+    #
+    # List the members of struct_name that device profiles can set as a ProfileField table. Members that aren't plain
+    # numbers, or arrays of them, are left for the profile loader to handle by hand.
+    def writeProfileFieldTable(self, struct_name, table_name):
+        write('static const ProfileField %s[] = {' % table_name, file=self.outFile)
+        for member in self.registry.typedict[struct_name].elem.findall('member'):
+            member_type = member.find('type').text
+            member_name = member.find('name')
+            field_type = None
+            if member_type in ['uint32_t', 'VkBool32'] or member_type.endswith('Flags'):
+                field_type = 'PROFILE_FIELD_UINT32'
+            elif member_type == 'int32_t':
+                field_type = 'PROFILE_FIELD_INT32'
+            elif member_type in ['uint64_t', 'VkDeviceSize']:
+                field_type = 'PROFILE_FIELD_UINT64'
+            elif member_type == 'size_t':
+                field_type = 'PROFILE_FIELD_SIZE'
+            elif member_type == 'float':
+                field_type = 'PROFILE_FIELD_FLOAT'
+            array_len = re.match(r'^\[(\d+)\]$', (member_name.tail or '').strip())
+            if field_type is None or (member_name.tail or '').strip() and not array_len:
+                continue
+            count = int(array_len.group(1)) if array_len else 1
+            write('    {"%s", %s, offsetof(%s, %s), %d},' % (member_name.text, field_type, struct_name, member_name.text, count), file=self.outFile)
+        write('};', file=self.outFile)
+    #
+    # 64-bit hash helpers mirroring HashEntrypointName() and EntrypointSlot() in ENTRYPOINT_LOOKUP_CODE
+    def hashEntrypointName(self, name):
+        mask = 0xFFFFFFFFFFFFFFFF
+        hash = 14695981039346656037
+        for c in name.encode('ascii'):
+            hash = ((hash ^ c) * 1099511628211) & mask
+        return hash
+    def entrypointSlot(self, hash, displacement, slot_count):
+        mask = 0xFFFFFFFFFFFFFFFF
+        x = (hash + displacement * 0x9E3779B97F4A7C15) & mask
+        x ^= x >> 33
+        x = (x * 0xFF51AFD7ED558CCD) & mask
+        x ^= x >> 33
+        return x % slot_count
+    #
+    # Build a perfect hash over the (name, protect) pairs in intercepts and write it out as an EntrypointTable.
+    # Names are grouped into buckets of about four by the high half of their hash, then the biggest buckets are placed
+    # first by searching for a displacement that sends every name in the bucket to a free slot.
+    def writeEntrypointTable(self, table_name, intercepts):
+        bucket_count = max(1, len(intercepts) // 4)
+        slot_count = max(1, len(intercepts) * 5 // 4)
+        buckets = [[] for i in range(bucket_count)]
+        for intercept in intercepts:
+            hash = self.hashEntrypointName(intercept[0])
+            buckets[(hash >> 32) % bucket_count].append((hash, intercept))
+        displacements = [0] * bucket_count
+        slots = [None] * slot_count
+        for bucket_index in sorted(range(bucket_count), key=lambda i: -len(buckets[i])):
+            bucket = buckets[bucket_index]
+            if not bucket:
+                continue
+            displacement = 0
+            while True:
+                bucket_slots = [self.entrypointSlot(hash, displacement, slot_count) for (hash, intercept) in bucket]
+                if len(set(bucket_slots)) == len(bucket_slots) and all(slots[i] is None for i in bucket_slots):
+                    break
+                displacement += 1
+            displacements[bucket_index] = displacement
+            for slot, (hash, intercept) in zip(bucket_slots, bucket):
+                slots[slot] = intercept
+        write('static const uint32_t %s_displacements[%d] = {' % (table_name, bucket_count), file=self.outFile)
+        for i in range(0, bucket_count, 16):
+            write('    %s,' % ', '.join(str(d) for d in displacements[i:i + 16]), file=self.outFile)
+        write('};', file=self.outFile)
+        write('static const EntrypointTableEntry %s_slots[%d] = {' % (table_name, slot_count), file=self.outFile)
+        for slot in slots:
+            if slot is None:
+                write('    {nullptr, nullptr},', file=self.outFile)
+                continue
+            (name, protect) = slot
+            # Slot positions are fixed at generation time, so entrypoints compiled out on this platform keep their slot
+            if protect is not None:
+                write('#ifdef %s' % protect, file=self.outFile)
+            write('    {"%s", (void*)%s},' % (name, name[2:]), file=self.outFile)
+            if protect is not None:
+                write('#else', file=self.outFile)
+                write('    {"%s", nullptr},' % name, file=self.outFile)
+                write('#endif', file=self.outFile)
+        write('};', file=self.outFile)
+        write('static const EntrypointTable %s_table = {%s_displacements, %d, %s_slots, %d};' %
+              (table_name, table_name, bucket_count, table_name, slot_count), file=self.outFile)
+    #
+    # Record that the command will be intercepted, and whether vkGetDeviceProcAddr should return it
+    def addIntercept(self, cmdinfo, name):
+        intercept = (name, self.featureExtraProtect)
+        self.intercepts.append(intercept)
+        first_param_type = cmdinfo.elem.find('param/type')
+        if first_param_type is not None and first_param_type.text in ['VkDevice', 'VkQueue', 'VkCommandBuffer']:
+            self.device_intercepts.append(intercept)
     def beginFeature(self, interface, emit):
         #write('// starting beginFeature', file=self.outFile)
         # Start processing in superclass
@@ -1188,15 +7895,19 @@ class MockICDOutputGenerator(OutputGenerator):
     #
     # Command generation
     def genCmd(self, cmdinfo, name, alias):
+        if self.proc_addr:
+            self.addIntercept(cmdinfo, name)
+            return
+        if self.replay:
+            self.addIntercept(cmdinfo, name)
+            if name not in TRACE_UNTRACED_COMMANDS:
+                self.replay_commands.append((name, self.featureExtraProtect, self.makeTraceReplayer(cmdinfo, name)))
+            return
         decls = self.makeCDecls(cmdinfo.elem)
         if self.header: # In the header declare all intercepts
             self.appendSection('command', '')
             self.appendSection('command', 'static %s' % (decls[0]))
-            if (self.featureExtraProtect != None):
-                self.intercepts += [ '#ifdef %s' % self.featureExtraProtect ]
-            self.intercepts += [ '    {"%s", (void*)%s},' % (name,name[2:]) ]
-            if (self.featureExtraProtect != None):
-                self.intercepts += [ '#endif' ]
+            self.addIntercept(cmdinfo, name)
             return
 
         manual_functions = [
@@ -1222,22 +7933,15 @@ class MockICDOutputGenerator(OutputGenerator):
                 self.appendSection('command', '// TODO: Implement custom intercept body')
             else:
                 self.appendSection('command', 'static %s' % (decls[0][:-1]))
-                self.appendSection('command', '{\n%s}' % (CUSTOM_C_INTERCEPTS[name]))
-            self.intercepts += [ '    {"%s", (void*)%s},' % (name,name[2:]) ]
+                self.appendSection('command', '{\n%s%s}' % (self.makeEntrypointScope(cmdinfo, name), CUSTOM_C_INTERCEPTS[name].lstrip('\n')))
             return
-        # record that the function will be intercepted
-        if (self.featureExtraProtect != None):
-            self.intercepts += [ '#ifdef %s' % self.featureExtraProtect ]
-        self.intercepts += [ '    {"%s", (void*)%s},' % (name,name[2:]) ]
-        if (self.featureExtraProtect != None):
-            self.intercepts += [ '#endif' ]
 
         OutputGenerator.genCmd(self, cmdinfo, name, alias)
         #
         self.appendSection('command', '')
         self.appendSection('command', 'static %s' % (decls[0][:-1]))
         if name in CUSTOM_C_INTERCEPTS:
-            self.appendSection('command', '{%s}' % (CUSTOM_C_INTERCEPTS[name]))
+            self.appendSection('command', '{\n%s%s}' % (self.makeEntrypointScope(cmdinfo, name), CUSTOM_C_INTERCEPTS[name].lstrip('\n')))
             return
 
         # Declare result variable, if any.
@@ -1255,9 +7959,15 @@ class MockICDOutputGenerator(OutputGenerator):
             param_names = []
             for param in params:
                 param_names.append(param.text)
-            self.appendSection('command', '{\n    %s%s(%s);\n}' % (return_string, khr_name[2:], ", ".join(param_names)))
+            self.appendSection('command', '{\n%s    %s%s(%s);\n}' % (self.makeEntrypointScope(cmdinfo, name), return_string, khr_name[2:], ", ".join(param_names)))
             return
         self.appendSection('command', '{')
+        self.appendSection('command', self.makeEntrypointScope(cmdinfo, name)[:-1])
+        if name.startswith('vkCmd'):
+            for line in self.makeCommandRecorder(cmdinfo, name):
+                self.appendSection('command', '    ' + line)
+            self.appendSection('command', '}')
+            return
 
         api_function_name = cmdinfo.elem.attrib.get('name')
         # GET THE TYPE OF FUNCTION
@@ -1274,9 +7984,8 @@ class MockICDOutputGenerator(OutputGenerator):
             allocator_txt = 'CreateDispObjHandle()';
             if (self.isHandleTypeNonDispatchable(lp_type)):
                 handle_type = 'non-' + handle_type
-                allocator_txt = 'global_unique_handle++';
-            # Need to lock in both cases
-            self.appendSection('command', '    unique_lock_t lock(global_lock);')
+                allocator_txt = 'NewNonDispHandle()';
+            # Neither allocator needs global_lock: non-dispatchable handles come from a per-thread block
             if (lp_len != None):
                 #print("%s last params (%s) has len %s" % (handle_type, lp_txt, lp_len))
                 self.appendSection('command', '    for (uint32_t i = 0; i < %s; ++i) {' % (lp_len))
@@ -1295,6 +8004,377 @@ class MockICDOutputGenerator(OutputGenerator):
             self.appendSection('command', '    return VK_SUCCESS;')
         self.appendSection('command', '}')
     #
+    # Body of a vkCmd* intercept, which records the call's parameters into a packet with CommandWriter. Arrays and the
+    # structs parameters point to are copied into the packet too. What those structs point to in turn is written after
+    # the last parameter, see makeCopyFixups().
+    def makeCommandRecorder(self, cmdinfo, name):
+        lines = ['CommandWriter writer(commandBuffer, ENTRYPOINT_ID_%s);' % name]
+        if name in QUERY_COMMANDS:
+            lines.append('writer.SetHasQueries();')
+        elif name in TRANSFER_COMMANDS:
+            lines.append('writer.SetHasTransfers();')
+        elif name in EVENT_COMMANDS:
+            lines.append('writer.SetHasEvents();')
+        elif name == 'vkCmdExecuteCommands':
+            lines += ['for (uint32_t i = 0; i < commandBufferCount; ++i) {',
+                      '    if (GetCommandBufferState(pCommandBuffers[i])->has_queries) {',
+                      '        writer.SetHasQueries();',
+                      '    }',
+                      '    if (GetCommandBufferState(pCommandBuffers[i])->has_transfers) {',
+                      '        writer.SetHasTransfers();',
+                      '    }',
+                      '    if (GetCommandBufferState(pCommandBuffers[i])->has_events) {',
+                      '        writer.SetHasEvents();',
+                      '    }',
+                      '    writer.AddCost(GetCommandBufferState(pCommandBuffers[i])->cost_ns);',
+                      '}']
+        fixups = []
+        params = cmdinfo.elem.findall('param')
+        param_names = [param.find('name').text for param in params]
+        for param in params[1:]:
+            param_type = param.find('type').text
+            param_name = param.find('name').text
+            array_len = re.match(r'^\[(\d+)\]$', (param.find('name').tail or '').strip())
+            if array_len:
+                lines.append('writer.WriteArray(%s, %s);' % (param_name, array_len.group(1)))
+                continue
+            if '*' not in (param.find('type').tail or ''):
+                lines.append('writer.Write(%s);' % param_name)
+                continue
+            length = param.get('len', '').split(',')[0]
+            if length == 'null-terminated':
+                lines.append('writer.WriteString(%s);' % param_name)
+                continue
+            # Anything other than a parameter or an expression of parameters is a single element
+            if not length or any(token not in param_names for token in re.findall(r'[A-Za-z_]\w*', length)):
+                length = '1'
+            elif length not in param_names:
+                length = '(%s)' % length
+            if param_type == 'void':
+                lines.append('writer.WriteArray(static_cast<const uint8_t*>(%s), %s);' % (param_name, length))
+                continue
+            param_fixups = self.makeCopyFixups(param_type, '%s_copy' % param_name, length, 0)
+            if param_fixups:
+                lines.append('auto %s_copy = writer.WriteArray(%s, %s);' % (param_name, param_name, length))
+                fixups += param_fixups
+            else:
+                lines.append('writer.WriteArray(%s, %s);' % (param_name, length))
+        return lines + fixups
+    #
+    # Once a struct array has been copied into a packet, pointers inside it still point at the app's memory. Copy what
+    # they point to as well and point them at the copies, so the packet stays valid after the call returns. pNext
+    # chains, and pointers whose length isn't known, are cleared instead.
+    def makeCopyFixups(self, type_name, copy_name, count, depth):
+        type_info = self.registry.typedict.get(type_name)
+        if type_info is None or type_info.elem.get('category') != 'struct':
+            return []
+        members = type_info.elem.findall('member')
+        member_names = [member.find('name').text for member in members]
+        index = 'i%d' % depth
+        element = '%s[%s]' % (copy_name, index)
+        body = []
+        for member in members:
+            member_type = member.find('type').text
+            member_name = member.find('name').text
+            pointer_depth = (member.find('type').tail or '').count('*')
+            if pointer_depth == 0:
+                continue
+            length = member.get('len', '').split(',')[0]
+            if member_name == 'pNext' or pointer_depth > 1:
+                body.append('%s.%s = nullptr;' % (element, member_name))
+            elif length == 'null-terminated':
+                body.append('%s.%s = writer.WriteString(%s.%s);' % (element, member_name, element, member_name))
+            elif length in member_names and member_type == 'void':
+                body.append('%s.%s = writer.WriteArray(static_cast<const uint8_t*>(%s.%s), %s.%s);' % (element, member_name, element, member_name, element, length))
+            elif length in member_names:
+                member_copy = '%s_%s' % (copy_name, member_name)
+                body.append('auto %s = writer.WriteArray(%s.%s, %s.%s);' % (member_copy, element, member_name, element, length))
+                body.append('%s.%s = %s;' % (element, member_name, member_copy))
+                body += self.makeCopyFixups(member_type, member_copy, '%s.%s' % (element, length), depth + 1)
+            else:
+                body.append('%s.%s = nullptr;' % (element, member_name))
+        if not body:
+            return []
+        lines = ['for (uint64_t %s = 0; %s && %s < %s; ++%s) {' % (index, copy_name, index, count, index)]
+        lines += ['    ' + line for line in body]
+        lines.append('}')
+        return lines
+    #
+    # Every intercept body opens with a scope that feeds the per-entrypoint profile, and a TraceWriter that records the
+    # call when tracing
+    def makeEntrypointScope(self, cmdinfo, name):
+        scope = '    EntrypointScope entrypoint_scope(ENTRYPOINT_ID_%s);\n' % name
+        if name in TRACE_UNTRACED_COMMANDS:
+            return scope
+        return scope + ''.join('    %s\n' % line for line in self.makeTraceRecorder(cmdinfo, name))
+    #
+    # Trace capture and replay. makeTraceRecorder() writes a call's parameters as a packet, and makeTraceReplayer()
+    # reads them back item for item, so the two have to stay in step. Parameters are classified by getTraceParams().
+    def getTypeCategory(self, type_name):
+        type_info = self.registry.typedict.get(type_name)
+        return type_info.elem.get('category') if type_info is not None else None
+    #
+    # Window system types the registry only names, which can't be copied
+    def isTraceExternalType(self, type_name):
+        type_info = self.registry.typedict.get(type_name)
+        if type_info is None:
+            return True
+        requires = type_info.elem.get('requires')
+        return type_info.elem.get('category') is None and requires is not None and requires != 'vk_platform'
+    #
+    # Whether the struct, or one it points to, holds a function pointer
+    def hasFuncPointer(self, type_name, visited=None):
+        visited = visited if visited is not None else set()
+        if type_name in visited or self.getTypeCategory(type_name) != 'struct':
+            return False
+        visited.add(type_name)
+        for member in self.registry.typedict[type_name].elem.findall('member'):
+            member_type = member.find('type').text
+            if self.getTypeCategory(member_type) == 'funcpointer' or self.hasFuncPointer(member_type, visited):
+                return True
+        return False
+    #
+    # C expression for the length of a parameter, in terms of the other parameters
+    def getTraceParamLength(self, param, params_by_name):
+        length = param.get('len', '').split(',')[0]
+        if not length:
+            return '1'
+        if '::' in length:
+            parts = length.split('::')
+            return '->'.join(parts) if parts[0] in params_by_name else '1'
+        if length in params_by_name:
+            if '*' in (params_by_name[length].find('type').tail or ''):
+                return '(%s ? *%s : 0)' % (length, length)
+            return length
+        if all(token in params_by_name for token in re.findall(r'[A-Za-z_]\w*', length)):
+            return '(%s)' % length
+        return '1'
+    #
+    # C expression for the length of a struct member, or None if it isn't known. Lengths the registry gives as LaTeX are
+    # translated, for the two forms it uses.
+    def getTraceMemberLength(self, member, element, member_names):
+        length = member.get('len', '').split(',')[0]
+        if not length:
+            return '1' if member.find('type').text != 'void' else None
+        if length in member_names:
+            return '%s.%s' % (element, length)
+        expression = member.get('altlen')
+        if expression is None and length.startswith('latexmath:['):
+            latex = length[len('latexmath:['):-1]
+            ceiling = re.match(r'^\\lceil\{(.*)\}\\rceil$', latex)
+            latex = re.sub(r'\\(textrm|mathit)\{(\w+)\}', r'\2', ceiling.group(1) if ceiling else latex)
+            quotient = re.match(r'^(\w+)\s*\\over\s*(\d+)$', latex)
+            if quotient and ceiling:
+                expression = '(%s + %d) / %s' % (quotient.group(1), int(quotient.group(2)) - 1, quotient.group(2))
+            elif quotient:
+                expression = '%s / %s' % (quotient.group(1), quotient.group(2))
+        if expression is None:
+            return None
+        tokens = re.findall(r'[A-Za-z_]\w*', expression)
+        if not all(token in member_names for token in tokens):
+            return None
+        return '(%s)' % re.sub(r'[A-Za-z_]\w*', lambda token: '%s.%s' % (element, token.group(0)), expression)
+    #
+    # Classify each parameter of a command by how it's traced:
+    #   value     - passed by value, handles included
+    #   fixed     - fixed size array
+    #   string    - null-terminated string
+    #   array     - const pointer to length elements, with what structs point to written after the last parameter
+    #   inout     - count the call reads and writes
+    #   output    - only the length is written, and for handles what the call returned
+    #   none      - not traced, replayed as null: allocation callbacks and window system objects
+    def getTraceParams(self, cmdinfo):
+        params = cmdinfo.elem.findall('param')
+        params_by_name = dict((param.find('name').text, param) for param in params)
+        counts = set(param.get('len', '').split(',')[0] for param in params)
+        traced = []
+        for param in params:
+            param_type = param.find('type').text
+            param_name = param.find('name').text
+            pointer_depth = (param.find('type').tail or '').count('*')
+            array_len = re.match(r'^\[(\d+)\]$', (param.find('name').tail or '').strip())
+            is_const = 'const' in (param.text or '')
+            info = {'name': param_name, 'type': param_type, 'length': self.getTraceParamLength(param, params_by_name)}
+            if array_len:
+                info['kind'] = 'fixed'
+                info['length'] = array_len.group(1)
+            elif pointer_depth == 0:
+                info['kind'] = 'value'
+            elif param_type == 'VkAllocationCallbacks' or self.isTraceExternalType(param_type):
+                info['kind'] = 'none'
+            elif is_const and param.get('len', '').split(',')[0] == 'null-terminated':
+                info['kind'] = 'string'
+            elif is_const:
+                info['kind'] = 'array' if pointer_depth == 1 else 'none'
+            elif param_name in counts and pointer_depth == 1:
+                info['kind'] = 'inout'
+            else:
+                info['kind'] = 'output'
+                if pointer_depth > 1:
+                    info['element'] = param_type + '*' * (pointer_depth - 1)
+                else:
+                    info['element'] = 'uint8_t' if param_type == 'void' else param_type
+                info['handles'] = pointer_depth == 1 and self.getTypeCategory(param_type) == 'handle'
+                # Counts returned through a pointer are read again once the call has written them
+                length = param.get('len', '').split(',')[0]
+                info['count_pointer'] = length in params_by_name and '*' in (params_by_name[length].find('type').tail or '')
+                info['count'] = length if info['count_pointer'] else info['length']
+            traced.append(info)
+        return traced
+    #
+    # Write or read what an array of structs points to, recursively
+    def makeTraceArrayFixups(self, type_name, array, count, depth, prefix, reading):
+        index = 'i%d' % depth
+        if self.getTypeCategory(type_name) == 'handle' and reading:
+            body = ['%s[%s] = MapHandle(%s[%s]);' % (array, index, array, index)]
+        elif self.getTypeCategory(type_name) == 'struct':
+            body = self.makeTraceStructFixups(type_name, '%s[%s]' % (array, index), depth, prefix, reading)
+        else:
+            body = []
+        if not body:
+            return []
+        lines = ['for (uint64_t %s = 0; %s && %s < %s; ++%s) {' % (index, array, index, count, index)]
+        lines += ['    ' + line for line in body]
+        lines.append('}')
+        return lines
+    #
+    # Write or read what one struct points to. Writing walks the app's structs, reading walks the copies in the trace and
+    # points them at the arrays that follow, maps their handles, and clears pointers that weren't traced.
+    def makeTraceStructFixups(self, type_name, element, depth, prefix, reading):
+        members = self.registry.typedict[type_name].elem.findall('member')
+        member_names = [member.find('name').text for member in members]
+        body = []
+        for member in members:
+            member_type = member.find('type').text
+            member_name = member.find('name').text
+            pointer_depth = (member.find('type').tail or '').count('*')
+            if (member.find('name').tail or '').strip().startswith('['):
+                # Fixed size arrays are copied with the struct
+                continue
+            field = '%s.%s' % (element, member_name)
+            copy_name = '%s_%s' % (prefix, member_name)
+            category = self.getTypeCategory(member_type)
+            length = member.get('len', '')
+            if pointer_depth == 0:
+                if category == 'handle' and reading:
+                    body.append('%s = MapHandle(%s);' % (field, field))
+                elif category == 'funcpointer' and reading:
+                    body.append('%s = nullptr;' % field)
+                elif category == 'struct':
+                    body += self.makeTraceStructFixups(member_type, field, depth, copy_name, reading)
+                continue
+            if member_name == 'pNext' or category == 'funcpointer' or self.isTraceExternalType(member_type):
+                if reading:
+                    body.append('%s = nullptr;' % field)
+                continue
+            if pointer_depth == 2 and member_type == 'char' and length.endswith(',null-terminated') and length.split(',')[0] in member_names:
+                if reading:
+                    body.append('%s = ReadStringArray(reader, scratch);' % field)
+                else:
+                    body.append('trace_writer.WriteStringArray(%s, %s.%s);' % (field, element, length.split(',')[0]))
+                continue
+            if pointer_depth > 1:
+                if reading:
+                    body.append('%s = nullptr;' % field)
+                continue
+            if length == 'null-terminated':
+                body.append('%s = reader->ReadString();' % field if reading else 'trace_writer.WriteString(%s);' % field)
+                continue
+            count = self.getTraceMemberLength(member, element, member_names)
+            if count is None:
+                if reading:
+                    body.append('%s = nullptr;' % field)
+            elif member_type == 'void':
+                if reading:
+                    body.append('%s = reader->ReadArray<uint8_t>();' % field)
+                else:
+                    body.append('trace_writer.WriteArray(static_cast<const uint8_t*>(%s), %s);' % (field, count))
+            elif reading:
+                body.append('uint64_t %s_count = 0;' % copy_name)
+                body.append('auto %s = reader->ReadArray<%s>(&%s_count);' % (copy_name, member_type, copy_name))
+                body.append('%s = %s;' % (field, copy_name))
+                body += self.makeTraceArrayFixups(member_type, copy_name, '%s_count' % copy_name, depth + 1, copy_name, True)
+            else:
+                body.append('trace_writer.WriteArray(%s, %s);' % (field, count))
+                body += self.makeTraceArrayFixups(member_type, field, count, depth + 1, copy_name, False)
+        return body
+    #
+    # Opening of an intercept body that writes the call to the trace
+    def makeTraceRecorder(self, cmdinfo, name):
+        lines = ['TraceWriter trace_writer(ENTRYPOINT_ID_%s);' % name, 'if (trace_writer.Tracing()) {']
+        fixups = []
+        for param in self.getTraceParams(cmdinfo):
+            kind = param['kind']
+            param_name = param['name']
+            if kind == 'value':
+                lines.append('    trace_writer.Write(%s);' % param_name)
+            elif kind == 'fixed':
+                lines.append('    trace_writer.WriteArray(%s, %s);' % (param_name, param['length']))
+            elif kind == 'string':
+                lines.append('    trace_writer.WriteString(%s);' % param_name)
+            elif kind == 'array' and param['type'] == 'void':
+                lines.append('    trace_writer.WriteArray(static_cast<const uint8_t*>(%s), %s);' % (param_name, param['length']))
+            elif kind == 'array':
+                lines.append('    trace_writer.WriteArray(%s, %s);' % (param_name, param['length']))
+                fixups += self.makeTraceArrayFixups(param['type'], param_name, param['length'], 0, param_name, False)
+            elif kind == 'inout':
+                lines.append('    trace_writer.WriteArray(%s, 1);' % param_name)
+            elif kind == 'output':
+                lines.append('    trace_writer.WriteOutput(%s, %s);' % (param_name, param['length']))
+                if param['handles']:
+                    lines.append('    trace_writer.SetOutputHandles(%s, %s);' % (param_name, param['count']))
+        lines += ['    ' + line for line in fixups]
+        lines.append('}')
+        return lines
+    #
+    # Case of ReplayPacket() that reads the call back from the trace and makes it
+    def makeTraceReplayer(self, cmdinfo, name):
+        lines = ['case ENTRYPOINT_ID_%s: {' % name]
+        params = self.getTraceParams(cmdinfo)
+        if any(param['kind'] == 'array' and self.hasFuncPointer(param['type']) for param in params):
+            lines += ['    // Function pointers into the traced app can\'t be called', '    return false;', '}']
+            return lines
+        lines += ['    if (!dispatch.%s) {' % name[2:], '        return false;', '    }']
+        fixups = []
+        args = []
+        output_handles = None
+        for param in params:
+            kind = param['kind']
+            param_name = param['name']
+            param_type = param['type']
+            args.append(param_name)
+            if kind == 'value':
+                if self.getTypeCategory(param_type) == 'handle':
+                    lines.append('    %s %s = MapHandle(reader->Read<%s>());' % (param_type, param_name, param_type))
+                else:
+                    lines.append('    %s %s = reader->Read<%s>();' % (param_type, param_name, param_type))
+            elif kind == 'fixed' or kind == 'inout':
+                lines.append('    %s* %s = reader->ReadArray<%s>();' % (param_type, param_name, param_type))
+            elif kind == 'string':
+                lines.append('    const char* %s = reader->ReadString();' % param_name)
+            elif kind == 'array' and param_type == 'void':
+                lines.append('    const void* %s = reader->ReadArray<uint8_t>();' % param_name)
+            elif kind == 'array':
+                lines.append('    uint64_t %s_count = 0;' % param_name)
+                lines.append('    %s* %s = reader->ReadArray<%s>(&%s_count);' % (param_type, param_name, param_type, param_name))
+                fixups += self.makeTraceArrayFixups(param_type, param_name, '%s_count' % param_name, 0, param_name, True)
+            elif kind == 'output':
+                lines.append('    %s* %s = ReadOutput<%s>(reader, scratch);' % (param['element'], param_name, param['element']))
+                if param['handles']:
+                    output_handles = param
+            else:
+                args[-1] = 'nullptr'
+        lines += ['    ' + line for line in fixups]
+        call = 'dispatch.%s(%s)' % (name[2:], ', '.join(args))
+        result_type = cmdinfo.elem.find('proto/type').text
+        lines.append('    CountReplayResult(%s);' % call if result_type == 'VkResult' else '    %s;' % call)
+        if output_handles is not None:
+            lines.append('    ReadOutputHandles(reader, %s, %s);' % (output_handles['name'], output_handles['length']))
+        if name == 'vkCreateInstance':
+            lines += ['    if (pInstance && *pInstance) {', '        LoadReplayDispatch(*pInstance);', '    }']
+        lines += ['    return true;', '}']
+        return lines
+    #
     # override makeProtoName to drop the "vk" prefix
     def makeProtoName(self, name, tail):
         return self.genOpts.apientry + name[2:] + tail
@@ -460,7 +460,7 @@ static const char *VkFormatString(VkFormat fmt) {
     }
 }
 #if defined(VK_USE_PLATFORM_XCB_KHR) || defined(VK_USE_PLATFORM_XLIB_KHR) || defined(VK_USE_PLATFORM_WIN32_KHR) || \
-    defined(VK_USE_PLATFORM_MACOS_MVK)
+    defined(VK_USE_PLATFORM_MACOS_MVK) || defined(VK_EXT_headless_surface)
 static const char *VkPresentModeString(VkPresentModeKHR mode) {
     switch (mode) {
 #define STR(r)                \
@@ -763,6 +763,9 @@ static void AppCreateInstance(struct AppInstance *inst) {
                                               VK_KHR_SHARED_PRESENTABLE_IMAGE_EXTENSION_NAME,
                                               VK_KHR_SURFACE_EXTENSION_NAME,
                                               VK_KHR_DEVICE_GROUP_CREATION_EXTENSION_NAME,
+#ifdef VK_EXT_headless_surface
+                                              VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME,
+#endif
 #ifdef VK_USE_PLATFORM_WIN32_KHR
                                               VK_KHR_WIN32_SURFACE_EXTENSION_NAME
 #elif VK_USE_PLATFORM_XCB_KHR
@@ -1102,7 +1105,8 @@ static void AppDestroyWin32Window(struct AppInstance *inst) {
 #if defined(VK_USE_PLATFORM_XCB_KHR)     || \
     defined(VK_USE_PLATFORM_XLIB_KHR)    || \
     defined(VK_USE_PLATFORM_WIN32_KHR)   || \
-    defined(VK_USE_PLATFORM_MACOS_MVK)
+    defined(VK_USE_PLATFORM_MACOS_MVK)   || \
+    defined(VK_EXT_headless_surface)
 static void AppDestroySurface(struct AppInstance *inst) { //same for all platforms
     vkDestroySurfaceKHR(inst->instance, inst->surface, NULL);
 }
@@ -1243,10 +1247,32 @@ static void AppDestroyMacOSWindow(struct AppInstance *inst) {
 }
 #endif //VK_USE_PLATFORM_MACOS_MVK
 
+//--------------------------HEADLESS-------------------------
+
+#ifdef VK_EXT_headless_surface
+static void AppCreateHeadlessSurface(struct AppInstance *inst) {
+    VkResult U_ASSERT_ONLY err;
+    // The loader doesn't export vkCreateHeadlessSurfaceEXT, so fetch it from the instance
+    PFN_vkCreateHeadlessSurfaceEXT vkCreateHeadlessSurfaceEXT =
+        (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(inst->instance, "vkCreateHeadlessSurfaceEXT");
+    assert(vkCreateHeadlessSurfaceEXT);
+
+    VkHeadlessSurfaceCreateInfoEXT createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+
+    err = vkCreateHeadlessSurfaceEXT(inst->instance, &createInfo, NULL, &inst->surface);
+    assert(!err);
+}
+#endif //VK_EXT_headless_surface
+//-----------------------------------------------------------
+
 #if defined(VK_USE_PLATFORM_XCB_KHR)     || \
     defined(VK_USE_PLATFORM_XLIB_KHR)    || \
     defined(VK_USE_PLATFORM_WIN32_KHR)   || \
-    defined(VK_USE_PLATFORM_MACOS_MVK)
+    defined(VK_USE_PLATFORM_MACOS_MVK)   || \
+    defined(VK_EXT_headless_surface)
 static int AppDumpSurfaceFormats(struct AppInstance *inst, struct AppGpu *gpu, FILE *out) {
     // Get the list of VkFormat's that are supported
     VkResult U_ASSERT_ONLY err;
@@ -3510,7 +3536,7 @@ int main(int argc, char **argv) {
     bool has_display = true;
     const char *display_var = getenv("DISPLAY");
     if (display_var == NULL || strlen(display_var) == 0) {
-        fprintf(stderr, "'DISPLAY' environment variable not set... skipping surface info\n");
+        fprintf(stderr, "'DISPLAY' environment variable not set... skipping window system surface info\n");
         fflush(stderr);
         has_display = false;
     }
@@ -3610,6 +3636,30 @@ int main(int argc, char **argv) {
     }
 #endif
 
+//--HEADLESS--
+    // Fall back to a headless surface when the window system surface wasn't available, e.g. without a display server
+#ifdef VK_EXT_headless_surface
+    if (!format_count && !present_mode_count &&
+        CheckExtensionEnabled(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME, inst.inst_extensions, inst.inst_extensions_count)) {
+        for (uint32_t i = 0; i < gpu_count; ++i) {
+            AppCreateHeadlessSurface(&inst);
+            if (html_output) {
+                fprintf(out, "\t\t\t\t<details><summary>GPU id : <div class='val'>%u</div> (%s)</summary></details>\n", i,
+                        gpus[i].props.deviceName);
+                fprintf(out, "\t\t\t\t<details><summary>Surface type : <div class='type'>%s</div></summary></details>\n",
+                        VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+            } else if (human_readable_output) {
+                printf("GPU id       : %u (%s)\n", i, gpus[i].props.deviceName);
+                printf("Surface type : %s\n", VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+            }
+            format_count += AppDumpSurfaceFormats(&inst, &gpus[i], out);
+            present_mode_count += AppDumpSurfacePresentModes(&inst, &gpus[i], out);
+            AppDumpSurfaceCapabilities(&inst, &gpus[i], out);
+            AppDestroySurface(&inst);
+        }
+    }
+#endif
+
     // TODO: Android / Wayland / MIR
     if (!format_count && !present_mode_count) {
         if (html_output) {